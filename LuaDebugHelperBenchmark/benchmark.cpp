@@ -0,0 +1,248 @@
+// Measures the cost of the helper hook for each hook event with different breakpoint counts
+// Hook is called directly with Lua 5.4 structures laid out the same way as the interpreter has them, so no Lua library is required
+//
+// Windows: cl /O2 /EHsc /std:c++17 benchmark.cpp
+// Other platforms: g++ -O2 -std=c++17 -Iplatform benchmark.cpp -lpthread
+
+#include "../LuaDebugHelper_x86/dllmain.cpp"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+struct BenchmarkFunction
+{
+    std::vector<char> source; // TString header followed by the source name
+    Lua_5_4::Proto proto;
+    Lua_5_4::LClosure closure;
+    Lua_5_4::StackValue value;
+};
+
+struct BenchmarkWorkload
+{
+    const char *name;
+    int functionCount;
+    int lineCount; // Line events between the call and the return event
+};
+
+struct BenchmarkBreakTable
+{
+    LuaHelperBreakTable table;
+    std::vector<LuaHelperBreakData> data;
+    std::vector<uintptr_t> protos;
+    std::vector<LuaHelperBreakLine> lines;
+    std::vector<std::string> sources;
+};
+
+static void BenchmarkCreateFunction(BenchmarkFunction &function, const char *sourceName, int linedefined, int lastlinedefined)
+{
+    function.source.assign(sizeof(Lua_5_4::TString) + strlen(sourceName) + 1, 0);
+    memcpy(function.source.data() + sizeof(Lua_5_4::TString), sourceName, strlen(sourceName));
+
+    memset(&function.proto, 0, sizeof(function.proto));
+    function.proto.linedefined = linedefined;
+    function.proto.lastlinedefined = lastlinedefined;
+    function.proto.source = (Lua_5_4::TString*)function.source.data();
+
+    memset(&function.closure, 0, sizeof(function.closure));
+    function.closure.p = &function.proto;
+
+    memset(&function.value, 0, sizeof(function.value));
+    function.value.val.value_.gc = (Lua_5_4::GCObject*)&function.closure;
+    function.value.val.tt_ = 6 | (1 << 6); // Lua closure, collectable
+}
+
+// Same layout as the table built by the debugger, breakpoints are placed on the lines the workload runs, but in other source files
+static void BenchmarkCreateBreakTable(BenchmarkBreakTable &result, int count)
+{
+    result.sources.reserve(16);
+
+    for(int i = 0; i < 16; i++)
+        result.sources.push_back("module" + std::to_string(i) + ".lua");
+
+    for(int i = 0; i < count; i++)
+    {
+        LuaHelperBreakData entry = {};
+
+        entry.line = 1 + unsigned(i * 7) % 512;
+        entry.sourceName = result.sources[i % 16].c_str();
+        entry.id = i;
+
+        result.data.push_back(entry);
+    }
+
+    std::stable_sort(result.data.begin(), result.data.end(), [](const LuaHelperBreakData &a, const LuaHelperBreakData &b) { return a.line < b.line; });
+
+    unsigned lineSlotCount = 16;
+
+    while(lineSlotCount < unsigned(count) * 2)
+        lineSlotCount *= 2;
+
+    result.protos.assign(16, 0);
+    result.lines.assign(lineSlotCount, LuaHelperBreakLine{});
+
+    memset(&result.table, 0, sizeof(result.table));
+
+    for(unsigned i = 0; i < result.data.size(); i++)
+    {
+        unsigned line = unsigned(result.data[i].line);
+
+        result.table.lineMask[(line & (LUA_HELPER_BREAK_LINE_BITS - 1)) / 32] |= 1u << (line % 32);
+
+        unsigned slot = line & (lineSlotCount - 1);
+
+        while(result.lines[slot].line != 0 && result.lines[slot].line != line)
+            slot = (slot + 1) & (lineSlotCount - 1);
+
+        if(result.lines[slot].line == 0)
+        {
+            result.lines[slot].line = line;
+            result.lines[slot].first = i;
+        }
+
+        result.lines[slot].count++;
+    }
+
+    result.table.generation = unsigned(count) + 1;
+    result.table.count = unsigned(count);
+    result.table.sourceCount = unsigned(count);
+    result.table.protoSlotCount = unsigned(result.protos.size());
+    result.table.lineSlotCount = lineSlotCount;
+    result.table.valueSize = sizeof(Lua_5_4::TValue);
+    result.table.data = result.data.data();
+    result.table.protos = result.protos.data();
+    result.table.lines = result.lines.data();
+}
+
+typedef void(*BenchmarkHook)(Lua_5_4::lua_State *L, Lua_5_4::lua_Debug *ar);
+
+static volatile int benchmarkEmptyHookEvent = 0;
+
+static void BenchmarkEmptyHook(Lua_5_4::lua_State *L, Lua_5_4::lua_Debug *ar)
+{
+    // Hook call itself is the baseline cost
+    benchmarkEmptyHookEvent = ar->event;
+}
+
+// Returns the number of events passed to the hook
+static unsigned long long BenchmarkRun(BenchmarkHook volatile hook, const BenchmarkWorkload &workload, std::vector<BenchmarkFunction> &functions, int iterations, unsigned long long &lineEvents)
+{
+    Lua_5_4::lua_State state = {};
+    Lua_5_4::CallInfo callInfo = {};
+    Lua_5_4::lua_Debug ar = {};
+
+    state.ci = &callInfo;
+
+    unsigned long long events = 0;
+
+    lineEvents = 0;
+
+    for(int iteration = 0; iteration < iterations; iteration++)
+    {
+        for(int i = 0; i < workload.functionCount; i++)
+        {
+            BenchmarkFunction &function = functions[i];
+
+            callInfo.func = &function.value;
+            state.top = &function.value + 1;
+
+            ar.event = LUA_HOOKCALL;
+            ar.currentline = -1;
+            hook(&state, &ar);
+
+            for(int line = 0; line < workload.lineCount; line++)
+            {
+                ar.event = LUA_HOOKLINE;
+                ar.currentline = function.proto.linedefined + 1 + line;
+                hook(&state, &ar);
+            }
+
+            ar.event = LUA_HOOKRET;
+            ar.currentline = -1;
+            hook(&state, &ar);
+
+            events += workload.lineCount + 2;
+            lineEvents += workload.lineCount;
+        }
+    }
+
+    return events;
+}
+
+static double BenchmarkMeasure(BenchmarkHook hook, const BenchmarkWorkload &workload, std::vector<BenchmarkFunction> &functions, unsigned long long &events)
+{
+    unsigned long long lineEvents = 0;
+
+    // Warm up caches and the breakpoint source cache
+    BenchmarkRun(hook, workload, functions, 16, lineEvents);
+
+    double best = 0.0;
+
+    for(int attempt = 0; attempt < 5; attempt++)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        events = BenchmarkRun(hook, workload, functions, 2000, lineEvents);
+
+        auto end = std::chrono::steady_clock::now();
+
+        double nanoseconds = std::chrono::duration<double, std::nano>(end - start).count() / events;
+
+        if(attempt == 0 || nanoseconds < best)
+            best = nanoseconds;
+    }
+
+    return best;
+}
+
+int main()
+{
+    LuaHelperInitializeStats();
+    LuaHelperInitializeTrace();
+    LuaHelperInitializeTiming();
+
+    // Binary-trees and fannkuch style code makes many short calls, n-body and string building spend most events on lines of hot loops
+    BenchmarkWorkload workloads[] = {
+        { "call-heavy", 256, 2 },
+        { "line-heavy", 8, 64 },
+    };
+
+    std::vector<BenchmarkFunction> functions(256);
+
+    for(int i = 0; i < 256; i++)
+        BenchmarkCreateFunction(functions[i], "@benchmark.lua", 1 + (i % 64) * 8, 8 + (i % 64) * 8);
+
+    int breakpointCounts[] = { 0, 1, 256, 4096 };
+
+    for(auto &workload : workloads)
+    {
+        unsigned long long events = 0;
+
+        double baseline = BenchmarkMeasure(BenchmarkEmptyHook, workload, functions, events);
+
+        printf("%s (%d functions, %d lines per call)\n", workload.name, workload.functionCount, workload.lineCount);
+        printf("  %-16s %8.2f ns per event\n", "empty hook", baseline);
+
+        for(int count : breakpointCounts)
+        {
+            BenchmarkBreakTable table;
+
+            if(count != 0)
+                BenchmarkCreateBreakTable(table, count);
+
+            luaHelperBreakTable = count != 0 ? &table.table : nullptr;
+
+            double result = BenchmarkMeasure(LuaHelperHook_5_4, workload, functions, events);
+
+            luaHelperBreakTable = nullptr;
+
+            char label[32];
+            snprintf(label, sizeof(label), "%d breakpoints", count);
+
+            printf("  %-16s %8.2f ns per event %6.2fx empty hook\n", label, result, result / baseline);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+// Minimal subset of the Windows API used by the helper library, so that the hook code can be built and measured on other platforms
+// Only included when this directory is on the include path, Windows builds use the system header
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define __declspec(x)
+#define __stdcall
+#define APIENTRY
+
+#define FALSE 0
+#define TRUE 1
+#define INFINITE 0xffffffffu
+
+#define DLL_PROCESS_ATTACH 1
+#define DLL_THREAD_DETACH 3
+
+typedef int BOOL;
+typedef unsigned long DWORD;
+typedef void *HMODULE;
+typedef void *HANDLE;
+typedef void *LPVOID;
+
+typedef union
+{
+    struct
+    {
+        DWORD LowPart;
+        long HighPart;
+    };
+    long long QuadPart;
+} LARGE_INTEGER;
+
+inline long InterlockedIncrement(volatile long *target)
+{
+    return __atomic_add_fetch(target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline long InterlockedDecrement(volatile long *target)
+{
+    return __atomic_sub_fetch(target, 1, __ATOMIC_SEQ_CST);
+}
+
+inline long InterlockedCompareExchange(volatile long *target, long exchange, long comparand)
+{
+    __atomic_compare_exchange_n(target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return comparand;
+}
+
+inline long long InterlockedCompareExchange64(volatile long long *target, long long exchange, long long comparand)
+{
+    __atomic_compare_exchange_n(target, &comparand, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return comparand;
+}
+
+inline void MemoryBarrier()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Zero when free, -1 when held exclusively, reader count otherwise
+struct SRWLOCK
+{
+    volatile long state;
+};
+
+#define SRWLOCK_INIT { 0 }
+
+inline void AcquireSRWLockExclusive(SRWLOCK *lock)
+{
+    while(InterlockedCompareExchange(&lock->state, -1, 0) != 0)
+        sched_yield();
+}
+
+inline void ReleaseSRWLockExclusive(SRWLOCK *lock)
+{
+    __atomic_store_n(&lock->state, 0, __ATOMIC_SEQ_CST);
+}
+
+inline void AcquireSRWLockShared(SRWLOCK *lock)
+{
+    while(true)
+    {
+        long state = lock->state;
+
+        if(state >= 0 && InterlockedCompareExchange(&lock->state, state + 1, state) == state)
+            return;
+
+        sched_yield();
+    }
+}
+
+inline void ReleaseSRWLockShared(SRWLOCK *lock)
+{
+    InterlockedDecrement(&lock->state);
+}
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *frequency)
+{
+    frequency->QuadPart = 1000000000ll;
+
+    return TRUE;
+}
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER *counter)
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    counter->QuadPart = time.tv_sec * 1000000000ll + time.tv_nsec;
+
+    return TRUE;
+}
+
+inline DWORD GetTickCount()
+{
+    timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return DWORD(time.tv_sec * 1000 + time.tv_nsec / 1000000);
+}
+
+inline DWORD GetCurrentThreadId()
+{
+    static volatile long nextId = 0;
+    static thread_local DWORD id = DWORD(InterlockedIncrement(&nextId));
+
+    return id;
+}
+
+inline void Sleep(DWORD milliseconds)
+{
+    usleep(useconds_t(milliseconds) * 1000);
+}
+
+// Events are not available, helper thread falls back to polling without them
+inline void* CreateEventA(void *attributes, BOOL manualReset, BOOL initialState, const char *name)
+{
+    return nullptr;
+}
+
+inline BOOL SetEvent(void *event)
+{
+    return FALSE;
+}
+
+inline DWORD WaitForSingleObject(void *handle, DWORD milliseconds)
+{
+    Sleep(milliseconds < 40 ? milliseconds : 40);
+
+    return 0;
+}
+
+inline HANDLE CreateThread(void *attributes, size_t stackSize, DWORD(__stdcall *start)(void*), void *parameter, DWORD flags, DWORD *threadId)
+{
+    struct Start
+    {
+        static void* Run(void *context)
+        {
+            auto data = (void**)context;
+            auto function = (DWORD(*)(void*))data[0];
+            void *argument = data[1];
+
+            free(data);
+
+            function(argument);
+
+            return nullptr;
+        }
+    };
+
+    void **data = (void**)malloc(sizeof(void*) * 2);
+
+    data[0] = (void*)start;
+    data[1] = parameter;
+
+    pthread_t thread;
+
+    if(pthread_create(&thread, nullptr, Start::Run, data) != 0)
+    {
+        free(data);
+        return nullptr;
+    }
+
+    pthread_detach(thread);
+
+    if(threadId)
+        *threadId = 0;
+
+    return (HANDLE)thread;
+}
+
+inline DWORD GetCurrentDirectoryA(DWORD size, char *buffer)
+{
+    if(!getcwd(buffer, size))
+        return 0;
+
+    return DWORD(strlen(buffer));
+}
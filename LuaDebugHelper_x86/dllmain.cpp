@@ -41,7 +41,96 @@ extern "C"
 }
 
 extern "C" __declspec(dllexport) volatile unsigned luaHelperAsyncBreakCode = 0;
-extern "C" __declspec(dllexport) unsigned long long luaHelperAsyncBreakData[1024] = {};
+
+// Debugger signals the event after writing the async break code
+extern "C" __declspec(dllexport) void *luaHelperAsyncBreakEvent = 0;
+
+// Commands are written by the debugger (single producer) and executed in order by the async break thread (single consumer)
+// Positions are free-running, debugger writes command words first and then advances the write position
+#define LUA_HELPER_COMMAND_SET_HOOK 1 // [lua_sethook, hook, mask, hook count, state count, states...]
+
+#define LUA_HELPER_COMMAND_RING_SIZE 16384 // Power of two
+
+extern "C" __declspec(dllexport) unsigned long long luaHelperCommandRing[LUA_HELPER_COMMAND_RING_SIZE] = {};
+extern "C" __declspec(dllexport) volatile unsigned luaHelperCommandWrite = 0;
+extern "C" __declspec(dllexport) volatile unsigned luaHelperCommandRead = 0;
+
+// Debugger sets this flag when it has commands that didn't fit in the ring, helper notifies it again after making space
+#define LUA_HELPER_ASYNC_BREAK_COMMANDS 4
+
+extern "C" __declspec(dllexport) volatile unsigned luaHelperCommandRetry = 0;
+
+// Helper thread reports tracepoint records periodically, so they are visible even if the process never stops
+#define LUA_HELPER_ASYNC_BREAK_TRACE 5
+
+// Helper thread reports the profiler histogram periodically while new samples arrive
+#define LUA_HELPER_ASYNC_BREAK_PROFILE 6
+
+// Helper thread asks the debugger to drain the timing buffers before they wrap around
+#define LUA_HELPER_ASYNC_BREAK_TIMING 7
+
+bool LuaHelperTraceReportDue(DWORD &timeout);
+bool LuaHelperProfileReportDue(DWORD &timeout);
+bool LuaHelperTimingReportDue(DWORD &timeout);
+
+void* LuaHelperCreateSignal()
+{
+    return CreateEventA(0, FALSE, FALSE, 0);
+}
+
+void LuaHelperWaitSignal(void *signal, DWORD timeout)
+{
+    // Without an event, fall back to polling
+    if(signal)
+        WaitForSingleObject(signal, timeout);
+    else
+        Sleep(timeout < 40 ? timeout : 40);
+}
+
+// Code written by the debugger takes priority, debugger handles pending commands and trace records on every async break
+static void LuaHelperRequestAsyncBreak(unsigned code)
+{
+    InterlockedCompareExchange((volatile long*)&luaHelperAsyncBreakCode, long(code), 0);
+}
+
+static unsigned long long LuaHelperReadCommandWord(unsigned &position)
+{
+    return luaHelperCommandRing[position++ & (LUA_HELPER_COMMAND_RING_SIZE - 1)];
+}
+
+void LuaHelperExecuteCommands()
+{
+    unsigned position = luaHelperCommandRead;
+    unsigned end = luaHelperCommandWrite;
+
+    MemoryBarrier();
+
+    while(position != end)
+    {
+        unsigned long long type = LuaHelperReadCommandWord(position);
+
+        if(type == LUA_HELPER_COMMAND_SET_HOOK)
+        {
+            auto setHook = (int(*)(void*, void*, int, int))uintptr_t(LuaHelperReadCommandWord(position));
+            void *hook = (void*)uintptr_t(LuaHelperReadCommandWord(position));
+            int mask = int(LuaHelperReadCommandWord(position));
+            int hookCount = int(LuaHelperReadCommandWord(position));
+            unsigned count = unsigned(LuaHelperReadCommandWord(position));
+
+            for(unsigned i = 0; i < count; i++)
+                setHook((void*)uintptr_t(LuaHelperReadCommandWord(position)), hook, mask, hookCount);
+        }
+        else
+        {
+            // Can't find the start of the next command
+            position = end;
+        }
+
+        MemoryBarrier();
+
+        luaHelperCommandRead = position;
+    }
+}
 
 DWORD __stdcall BreakpointHookLoop(void *context)
 {
@@ -49,35 +138,55 @@ DWORD __stdcall BreakpointHookLoop(void *context)
     {
         if(luaHelperAsyncBreakCode != 0)
         {
+            // Debugger acknowledges the code and might queue new commands
             OnLuaHelperAsyncBreak();
 
-            if(luaHelperAsyncBreakCode == 2)
-            {
-                unsigned index = 2;
-                while(void* state = (void*)luaHelperAsyncBreakData[index++])
-                    ((int(*)(void*, void*, int, int))luaHelperAsyncBreakData[0])(state, (void*)luaHelperAsyncBreakData[1], 7, 0); // lua_sethook
-                luaHelperAsyncBreakCode = 0;
-            }
-
-            if(luaHelperAsyncBreakCode == 4)
-            {
-                unsigned index = 2;
-                while (void* state = (void*)luaHelperAsyncBreakData[index++])
-                    ((int(*)(void*, void*, int, int))luaHelperAsyncBreakData[0])(state, (void*)luaHelperAsyncBreakData[1], 0, 0); // lua_sethook
-                luaHelperAsyncBreakCode = 0;
-            }
-
             // If the code hasn't been cleared, it's a signal to stop the loop
             if(luaHelperAsyncBreakCode != 0)
                 break;
         }
 
-        Sleep(40);
+        LuaHelperExecuteCommands();
+
+        if(luaHelperCommandRetry != 0)
+        {
+            luaHelperCommandRetry = 0;
+            LuaHelperRequestAsyncBreak(LUA_HELPER_ASYNC_BREAK_COMMANDS);
+            continue;
+        }
+
+        DWORD timeout = INFINITE;
+
+        if(LuaHelperTraceReportDue(timeout))
+        {
+            LuaHelperRequestAsyncBreak(LUA_HELPER_ASYNC_BREAK_TRACE);
+            continue;
+        }
+
+        if(LuaHelperProfileReportDue(timeout))
+        {
+            LuaHelperRequestAsyncBreak(LUA_HELPER_ASYNC_BREAK_PROFILE);
+            continue;
+        }
+
+        if(LuaHelperTimingReportDue(timeout))
+        {
+            LuaHelperRequestAsyncBreak(LUA_HELPER_ASYNC_BREAK_TIMING);
+            continue;
+        }
+
+        LuaHelperWaitSignal(luaHelperAsyncBreakEvent, timeout);
     }
 
     return 0;
 }
 
+void LuaHelperInitializeStats();
+void LuaHelperInitializeTrace();
+void LuaHelperInitializeTiming();
+void LuaHelperReleaseTimingBuffer();
+void LuaHelperReleaseStopRecord();
+
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved)
 {
 	switch(ul_reason_for_call)
@@ -85,11 +194,21 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
     case DLL_PROCESS_ATTACH:
         GetCurrentDirectoryA(1024, luaHelperWorkingDirectory);
 
+        LuaHelperInitializeStats();
+        LuaHelperInitializeTrace();
+        LuaHelperInitializeTiming();
+
+        luaHelperAsyncBreakEvent = LuaHelperCreateSignal();
+
         CreateThread(0, 32 * 1024, BreakpointHookLoop, 0, 0, &breakpointLoopThreadId);
 
         luaHelperIsInitialized = 1;
         OnLuaHelperInitialized();
         break;
+    case DLL_THREAD_DETACH:
+        LuaHelperReleaseTimingBuffer();
+        LuaHelperReleaseStopRecord();
+        break;
     default:
 		break;
 	}
@@ -98,9 +217,13 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 }
 
 #include <stdio.h>
+#include <stddef.h>
 
 //#define DEBUG_MODE
 
+// Collects hook event counts and time spent inside the hooks, debugger reports them in the log
+//#define STATS_MODE
+
 #define LUA_HOOKCALL	0
 #define LUA_HOOKRET	1
 #define LUA_HOOKLINE	2
@@ -108,6 +231,52 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 #define LUA_HOOKTAILCALL 4
 #define LUA_HOOKTAILRET 4
 
+#if defined(STATS_MODE)
+struct LuaHelperHookStats
+{
+    unsigned long long events[5]; // By event type
+    unsigned long long ticks; // Includes the time the process is stopped in debugger at breakpoints and steps
+    unsigned long long frequency;
+};
+
+extern "C" __declspec(dllexport) LuaHelperHookStats luaHelperHookStats = {};
+
+struct LuaHelperHookTimer
+{
+    LuaHelperHookTimer(int event)
+    {
+        if(unsigned(event) < 5)
+            luaHelperHookStats.events[event]++;
+
+        QueryPerformanceCounter(&start);
+    }
+
+    ~LuaHelperHookTimer()
+    {
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+
+        luaHelperHookStats.ticks += end.QuadPart - start.QuadPart;
+    }
+
+    LARGE_INTEGER start;
+};
+
+#define LUA_HELPER_HOOK_TIMER(event) LuaHelperHookTimer hookTimer(event)
+#else
+#define LUA_HELPER_HOOK_TIMER(event)
+#endif
+
+void LuaHelperInitializeStats()
+{
+#if defined(STATS_MODE)
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    luaHelperHookStats.frequency = frequency.QuadPart;
+#endif
+}
+
 namespace Lua_5_4
 {
     typedef unsigned char lu_byte;
@@ -627,38 +796,378 @@ namespace Luajit
         int lastlinedefined;
         // other
     };
+
+    // Complete activation record for lua_getstack calls that can't use the record passed to the hook
+    struct lj_DebugFull
+    {
+        lj_Debug header;
+        char short_src[60]; // LUA_IDSIZE
+        int i_ci;
+    };
 }
 
+#define LUA_HELPER_PREDICATE_COMPARE 1
+#define LUA_HELPER_PREDICATE_AND 2
+#define LUA_HELPER_PREDICATE_OR 3
+#define LUA_HELPER_PREDICATE_NOT 4
+
+#define LUA_HELPER_PREDICATE_EQUAL 0
+#define LUA_HELPER_PREDICATE_NOT_EQUAL 1
+#define LUA_HELPER_PREDICATE_LESS 2
+#define LUA_HELPER_PREDICATE_LESS_EQUAL 3
+#define LUA_HELPER_PREDICATE_GREATER 4
+#define LUA_HELPER_PREDICATE_GREATER_EQUAL 5
+#define LUA_HELPER_PREDICATE_TRUTHY 6
+
+#define LUA_HELPER_PREDICATE_REGISTER 1
+#define LUA_HELPER_PREDICATE_UPVALUE 2
+
+#define LUA_HELPER_PREDICATE_NIL 0
+#define LUA_HELPER_PREDICATE_FALSE 1
+#define LUA_HELPER_PREDICATE_TRUE 2
+#define LUA_HELPER_PREDICATE_INTEGER 3
+#define LUA_HELPER_PREDICATE_NUMBER 4
+#define LUA_HELPER_PREDICATE_OTHER 5
+
+#define LUA_HELPER_PREDICATE_STACK_SIZE 16
+
+// Every Nth rejected hit is still reported, so that the debugger can notice that the condition text has changed
+#define LUA_HELPER_PREDICATE_RECHECK_RATE 256
+
+// Postfix program instruction, comparison pushes a value, 'and' and 'or' pop two values
+struct LuaHelperPredicateOp
+{
+    unsigned char code;
+    unsigned char compare;
+    unsigned char operandKind;
+    unsigned char constantKind;
+    int operandIndex;
+    long long constantInteger;
+    double constantNumber;
+};
+
+// Simple breakpoint condition compiled by the debugger, register and upvalue indices are only valid inside the specified function
+struct LuaHelperBreakPredicate
+{
+    uintptr_t proto;
+    unsigned opCount;
+    unsigned rejectCount;
+
+    // Value layout of the Lua version
+    unsigned valueSize;
+    unsigned valueOffset;
+    unsigned tagOffset;
+    unsigned tagMask;
+    int nilTag;
+    int falseTag;
+    int trueTag;
+    int integerTag;
+    int floatTag;
+    unsigned booleanInPayload;
+    unsigned upvalueArrayOffset;
+    unsigned upvalueValueOffset;
+
+    LuaHelperPredicateOp ops[1];
+};
+
 struct LuaHelperBreakData
 {
     uintptr_t line;
     uintptr_t proto;
     const char *sourceName;
+    LuaHelperBreakPredicate *predicate;
+    uintptr_t traceId; // Tracepoints (non-zero id) are recorded into the trace buffer without stopping
+    uintptr_t id; // Breakpoint index reported to the debugger, entries are ordered by line
+};
+
+// Entries of a single line are placed next to each other, hook only looks at the entries of the current line
+struct LuaHelperBreakLine
+{
+    unsigned line; // Zero for an empty slot
+    unsigned first;
+    unsigned count;
+};
+
+// Line mask has a bit set for each (line % bit count) that has a breakpoint, it's used to reject lines before the breakpoint list is searched
+#define LUA_HELPER_BREAK_LINE_BITS 8192
+
+// Breakpoint table is allocated and filled by the debugger with a single write into an inactive buffer and is published by replacing the table pointer
+struct LuaHelperBreakTable
+{
+    unsigned generation;
+    unsigned count;
+    unsigned sourceCount;
+    unsigned protoSlotCount; // Power of two
+    unsigned lineSlotCount; // Power of two
+    unsigned valueSize;
+    unsigned traceValueCount; // Number of registers captured by tracepoints
+    unsigned padding;
+    LuaHelperBreakData *data;
+    uintptr_t *protos; // Open-addressed set of Protos with function breakpoints
+    LuaHelperBreakLine *lines; // Open-addressed map from a line to its entries
+    unsigned lineMask[LUA_HELPER_BREAK_LINE_BITS / 32];
+};
+
+extern "C" __declspec(dllexport) LuaHelperBreakTable * volatile luaHelperBreakTable = nullptr;
+
+#define LUA_HELPER_STOP_RECORD_COUNT 64
+#define LUA_HELPER_STOP_NO_BREAKPOINT 0xffffffffu
+
+// Each thread reports its stops in its own record, so that threads running their own states can hit breakpoints at the same time
+// Layout is the same for 32 and 64 bit processes
+struct LuaHelperStopRecord
+{
+    volatile long threadId;
+    unsigned breakpointId; // Id of the breakpoint table entry or LUA_HELPER_STOP_NO_BREAKPOINT for step actions
+    unsigned long long state;
+    unsigned long long proto;
 };
 
-extern "C" __declspec(dllexport) unsigned luaHelperBreakCount = 0;
-extern "C" __declspec(dllexport) LuaHelperBreakData luaHelperBreakData[256] = {};
+extern "C" __declspec(dllexport) LuaHelperStopRecord luaHelperStopRecords[LUA_HELPER_STOP_RECORD_COUNT] = {};
+
+// Last stop of a thread that didn't get a record
 extern "C" __declspec(dllexport) unsigned luaHelperBreakHitId = 0;
 extern "C" __declspec(dllexport) uintptr_t luaHelperBreakHitLuaStateAddress = 0;
-extern "C" __declspec(dllexport) char luaHelperBreakSources[128 * 256] = {};
+
+static thread_local LuaHelperStopRecord *luaHelperStopThreadRecord = nullptr;
+
+void LuaHelperReleaseStopRecord()
+{
+    if(luaHelperStopThreadRecord)
+        luaHelperStopThreadRecord->threadId = 0;
+
+    luaHelperStopThreadRecord = nullptr;
+}
+
+static void LuaHelperRecordStop(void *L, unsigned breakpointId, uintptr_t proto)
+{
+    LuaHelperStopRecord *record = luaHelperStopThreadRecord;
+
+    if(!record)
+    {
+        long threadId = long(GetCurrentThreadId());
+
+        for(unsigned i = 0; i < LUA_HELPER_STOP_RECORD_COUNT && !record; i++)
+        {
+            if(luaHelperStopRecords[i].threadId == 0 && InterlockedCompareExchange(&luaHelperStopRecords[i].threadId, threadId, 0) == 0)
+                record = &luaHelperStopRecords[i];
+        }
+
+        luaHelperStopThreadRecord = record;
+    }
+
+    if(record)
+    {
+        record->breakpointId = breakpointId;
+        record->state = uintptr_t(L);
+        record->proto = proto;
+    }
+    else
+    {
+        luaHelperBreakHitId = breakpointId;
+        luaHelperBreakHitLuaStateAddress = uintptr_t(L);
+    }
+}
+
+#define LUA_HELPER_TRACE_RECORD_COUNT 2048 // Power of two
+#define LUA_HELPER_TRACE_VALUE_BYTES 128
+
+// Layout is the same for 32 and 64 bit processes
+struct LuaHelperTraceRecord
+{
+    volatile unsigned sequence; // Record position + 1 when the record is complete
+    int line;
+    long long timestamp;
+    unsigned long long state;
+    unsigned long long proto;
+    unsigned long long function;
+    unsigned traceId;
+    unsigned valueCount;
+    unsigned char values[LUA_HELPER_TRACE_VALUE_BYTES]; // Raw register values
+};
+
+// Any number of Lua threads write records, debugger drains them in bulk when the process is stopped or when the helper thread reports them
+// Writers never wait, if the debugger doesn't keep up, older records are overwritten
+struct LuaHelperTraceBuffer
+{
+    volatile unsigned write;
+    unsigned recordCount;
+    long long frequency;
+    LuaHelperTraceRecord records[LUA_HELPER_TRACE_RECORD_COUNT];
+};
+
+extern "C" __declspec(dllexport) LuaHelperTraceBuffer luaHelperTraceBuffer = {};
+
+#define LUA_HELPER_TRACE_REPORT_INTERVAL 250 // Milliseconds
+
+// Write position at the last report, records are reported at most once per interval unless half of the ring is filled
+volatile unsigned luaHelperTraceReported = 0;
+DWORD luaHelperTraceReportTime = 0;
+
+bool LuaHelperTraceReportDue(DWORD &timeout)
+{
+    unsigned write = luaHelperTraceBuffer.write;
+
+    if(write == luaHelperTraceReported)
+        return false;
+
+    DWORD elapsed = GetTickCount() - luaHelperTraceReportTime;
+
+    if(elapsed < LUA_HELPER_TRACE_REPORT_INTERVAL && write - luaHelperTraceReported < LUA_HELPER_TRACE_RECORD_COUNT / 2)
+    {
+        if(timeout > LUA_HELPER_TRACE_REPORT_INTERVAL - elapsed)
+            timeout = LUA_HELPER_TRACE_REPORT_INTERVAL - elapsed;
+
+        return false;
+    }
+
+    luaHelperTraceReported = write;
+    luaHelperTraceReportTime = GetTickCount();
+
+    return true;
+}
+
+void LuaHelperInitializeTrace()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    luaHelperTraceBuffer.recordCount = LUA_HELPER_TRACE_RECORD_COUNT;
+    luaHelperTraceBuffer.frequency = frequency.QuadPart;
+}
+
+static void LuaHelperTraceHit(LuaHelperBreakTable *table, unsigned traceId, void *L, int line, uintptr_t proto, const char *function, const char *top)
+{
+    unsigned position = unsigned(InterlockedIncrement((volatile long*)&luaHelperTraceBuffer.write)) - 1;
+
+    // Wake up the helper thread to start the report interval and when the ring is half full
+    if((position == luaHelperTraceReported || position - luaHelperTraceReported == LUA_HELPER_TRACE_RECORD_COUNT / 2) && luaHelperAsyncBreakEvent)
+        SetEvent(luaHelperAsyncBreakEvent);
+
+    LuaHelperTraceRecord &record = luaHelperTraceBuffer.records[position & (LUA_HELPER_TRACE_RECORD_COUNT - 1)];
+
+    record.sequence = 0;
+
+    MemoryBarrier();
+
+    LARGE_INTEGER timestamp;
+    QueryPerformanceCounter(&timestamp);
+
+    record.line = line;
+    record.timestamp = timestamp.QuadPart;
+    record.state = uintptr_t(L);
+    record.proto = proto;
+    record.function = uintptr_t(function);
+    record.traceId = traceId;
+    record.valueCount = 0;
+
+    // Registers are located after the function slot, stack top limits how many of them are valid
+    if(function && top > function && table->valueSize != 0)
+    {
+        unsigned available = unsigned((top - function) / table->valueSize) - 1;
+        unsigned count = table->traceValueCount;
+
+        if(count > available)
+            count = available;
+
+        if(count > LUA_HELPER_TRACE_VALUE_BYTES / table->valueSize)
+            count = LUA_HELPER_TRACE_VALUE_BYTES / table->valueSize;
+
+        memcpy(record.values, function + table->valueSize, count * table->valueSize);
+
+        record.valueCount = count;
+    }
+
+    MemoryBarrier();
+
+    record.sequence = position + 1;
+}
+
+// Remembers which breakpoint source name (if any) matches the source of a function, so that strcmp is only called once per function
+struct LuaHelperBreakSourceCacheEntry
+{
+    uintptr_t proto;
+    const char *sourceName;
+    const char *breakSourceName;
+    bool hasBreakpoints;
+};
+
+#define LUA_HELPER_BREAK_SOURCE_CACHE_SIZE 1024
+
+// Each hooked thread has its own cache, so an entry can't be replaced or reset by another thread while it's being used
+static thread_local LuaHelperBreakSourceCacheEntry luaHelperBreakSourceCache[LUA_HELPER_BREAK_SOURCE_CACHE_SIZE] = {};
+static thread_local unsigned luaHelperBreakSourceCacheGeneration = 0;
+
+static inline unsigned LuaHelperPointerHash(uintptr_t pointer)
+{
+    return unsigned((pointer >> 3) ^ (pointer >> 12));
+}
 
 extern "C" __declspec(dllexport) unsigned luaHelperStepOver = 0;
 extern "C" __declspec(dllexport) unsigned luaHelperStepInto = 0;
 extern "C" __declspec(dllexport) unsigned luaHelperStepOut = 0;
-extern "C" __declspec(dllexport) unsigned luaHelperSkipDepth = 0;
-extern "C" __declspec(dllexport) unsigned luaHelperStackDepthAtCall = 0;
 
-void LuaHelperStepHook(int event)
+// State that is being stepped, other states ignore the step action (zero if the state is not known and any state can complete the step)
+extern "C" __declspec(dllexport) unsigned long long luaHelperStepLuaState = 0;
+
+#define LUA_HELPER_STEP_STATE_COUNT 64
+
+// Stepping context is kept for each lua_State, so that calls made on other threads can't change the skip depth of the stepped state
+struct LuaHelperStepState
+{
+    volatile long long state;
+    unsigned skipDepth;
+    unsigned stackDepthAtCall;
+};
+
+// Debugger clears the table when a step action starts
+extern "C" __declspec(dllexport) LuaHelperStepState luaHelperStepStates[LUA_HELPER_STEP_STATE_COUNT] = {};
+
+// Shared by states that didn't fit into the table
+LuaHelperStepState luaHelperStepStateOverflow = {};
+
+static LuaHelperStepState* LuaHelperGetStepState(void *L)
+{
+    if(!luaHelperStepOver && !luaHelperStepInto && !luaHelperStepOut)
+        return nullptr;
+
+    if(luaHelperStepLuaState && luaHelperStepLuaState != uintptr_t(L))
+        return nullptr;
+
+    long long key = (long long)uintptr_t(L);
+
+    for(unsigned slot = LuaHelperPointerHash(uintptr_t(L)), i = 0; i < LUA_HELPER_STEP_STATE_COUNT; slot++, i++)
+    {
+        auto &entry = luaHelperStepStates[slot & (LUA_HELPER_STEP_STATE_COUNT - 1)];
+
+        if(entry.state == key)
+            return &entry;
+
+        // Only the thread running the state inserts its key, so a lost race means that the slot was taken by another state
+        if(entry.state == 0 && InterlockedCompareExchange64(&entry.state, key, 0) == 0)
+            return &entry;
+    }
+
+    return &luaHelperStepStateOverflow;
+}
+
+void LuaHelperStepHook(void *L, int event)
 {
+    LuaHelperStepState *step = LuaHelperGetStepState(L);
+
+    if(!step)
+        return;
+
     if(event == LUA_HOOKCALL)
     {
         if(luaHelperStepInto)
         {
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepInto();
         }
         else if(luaHelperStepOver || luaHelperStepOut)
         {
-            luaHelperSkipDepth++;
+            step->skipDepth++;
         }
     }
 
@@ -666,41 +1175,52 @@ void LuaHelperStepHook(int event)
     {
         if(luaHelperStepInto)
         {
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepInto();
         }
     }
 
     if(event == LUA_HOOKRET)
     {
-        if(luaHelperStepOut && luaHelperSkipDepth == 0)
+        if(luaHelperStepOut && step->skipDepth == 0)
         {
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepOut();
         }
-        else if((luaHelperStepOver || luaHelperStepOut) && luaHelperSkipDepth > 0)
+        else if((luaHelperStepOver || luaHelperStepOut) && step->skipDepth > 0)
         {
-            luaHelperSkipDepth--;
+            step->skipDepth--;
         }
     }
 
-    if(event == LUA_HOOKLINE && (luaHelperStepOver || luaHelperStepInto) && luaHelperSkipDepth == 0)
+    if(event == LUA_HOOKLINE && (luaHelperStepOver || luaHelperStepInto) && step->skipDepth == 0)
+    {
+        LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
         OnLuaHelperStepComplete();
+    }
 }
 
-void LuaHelperDebugStepHook(int event, int line, const char *sourceName)
+void LuaHelperDebugStepHook(void *L, int event, int line, const char *sourceName)
 {
+    LuaHelperStepState *step = LuaHelperGetStepState(L);
+
+    if(!step)
+        return;
+
     if(event == LUA_HOOKCALL)
     {
         if(luaHelperStepInto)
         {
-            printf("hook call at line %d from '%s', step into (skip depth %d)\n", line, sourceName, luaHelperSkipDepth);
+            printf("hook call at line %d from '%s', step into (skip depth %d)\n", line, sourceName, step->skipDepth);
 
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepInto();
         }
         else if(luaHelperStepOver || luaHelperStepOut)
         {
-            printf("hook call at line %d from '%s', step over (skip depth raised to %d)\n", line, sourceName, luaHelperSkipDepth + 1);
+            printf("hook call at line %d from '%s', step over (skip depth raised to %d)\n", line, sourceName, step->skipDepth + 1);
 
-            luaHelperSkipDepth++;
+            step->skipDepth++;
         }
     }
 
@@ -708,102 +1228,767 @@ void LuaHelperDebugStepHook(int event, int line, const char *sourceName)
     {
         if(luaHelperStepInto)
         {
-            printf("hook tail at line %d from '%s', step into (skip depth %d)\n", line, sourceName, luaHelperSkipDepth);
+            printf("hook tail at line %d from '%s', step into (skip depth %d)\n", line, sourceName, step->skipDepth);
 
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepInto();
         }
     }
 
     if(event == LUA_HOOKRET)
     {
-        if(luaHelperStepOut && luaHelperSkipDepth == 0)
+        if(luaHelperStepOut && step->skipDepth == 0)
         {
-            printf("hook return at line %d from '%s', step out (skip depth %d)\n", line, sourceName, luaHelperSkipDepth);
+            printf("hook return at line %d from '%s', step out (skip depth %d)\n", line, sourceName, step->skipDepth);
 
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepOut();
         }
-        else if((luaHelperStepOver || luaHelperStepOut) && luaHelperSkipDepth > 0)
+        else if((luaHelperStepOver || luaHelperStepOut) && step->skipDepth > 0)
         {
-            printf("hook return at line %d from '%s', step over (skip depth dropped to %d)\n", line, sourceName, luaHelperSkipDepth - 1);
+            printf("hook return at line %d from '%s', step over (skip depth dropped to %d)\n", line, sourceName, step->skipDepth - 1);
 
-            luaHelperSkipDepth--;
+            step->skipDepth--;
         }
     }
 
     if(event == LUA_HOOKLINE && (luaHelperStepOver || luaHelperStepInto))
     {
-        printf("hook line at line %d from '%s', step%s%s%s (skip depth %d)\n", line, sourceName, luaHelperStepOver ? " over" : "", luaHelperStepInto ? " into" : "", luaHelperStepOut ? " out" : "", luaHelperSkipDepth);
+        printf("hook line at line %d from '%s', step%s%s%s (skip depth %d)\n", line, sourceName, luaHelperStepOver ? " over" : "", luaHelperStepInto ? " into" : "", luaHelperStepOut ? " out" : "", step->skipDepth);
 
-        if(luaHelperSkipDepth == 0)
+        if(step->skipDepth == 0)
         {
             printf("step complete\n");
 
+            LuaHelperRecordStop(L, LUA_HELPER_STOP_NO_BREAKPOINT, 0);
             OnLuaHelperStepComplete();
         }
     }
 }
 
-void LuaHelperBreakpointHook(void *L, int line, uintptr_t proto, const char *sourceName)
+static inline bool LuaHelperIsBreakLine(LuaHelperBreakTable *table, int line)
 {
-    for(auto curr = luaHelperBreakData, end = luaHelperBreakData + luaHelperBreakCount; curr != end; curr++)
-    {
-        if(line != curr->line)
-            continue;
+    unsigned bit = unsigned(line) & (LUA_HELPER_BREAK_LINE_BITS - 1);
 
-        if(curr->proto)
-        {
-            if(proto == curr->proto)
-            {
-                luaHelperBreakHitId = unsigned(curr - luaHelperBreakData);
-                luaHelperBreakHitLuaStateAddress = uintptr_t(L);
+    return (table->lineMask[bit / 32] & (1u << (bit % 32))) != 0;
+}
 
-                OnLuaHelperBreakpointHit();
-                break;
-            }
-        }
-        else
-        {
-            if(strcmp(curr->sourceName, sourceName) == 0)
-            {
-                luaHelperBreakHitId = unsigned(curr - luaHelperBreakData);
-                luaHelperBreakHitLuaStateAddress = uintptr_t(L);
+static bool LuaHelperIsBreakProto(LuaHelperBreakTable *table, uintptr_t proto)
+{
+    unsigned mask = table->protoSlotCount - 1;
 
-                OnLuaHelperBreakpointHit();
-                break;
-            }
-        }
+    for(unsigned slot = LuaHelperPointerHash(proto) & mask, i = 0; i < table->protoSlotCount; slot = (slot + 1) & mask, i++)
+    {
+        if(table->protos[slot] == proto)
+            return true;
+
+        if(table->protos[slot] == 0)
+            return false;
     }
+
+    return false;
 }
 
-extern "C" __declspec(dllexport) void LuaHelperHook_5_4(Lua_5_4::lua_State *L, Lua_5_4::lua_Debug *ar)
+static LuaHelperBreakLine* LuaHelperFindBreakLine(LuaHelperBreakTable *table, int line)
 {
-#if defined(DEBUG_MODE)
-    const char *sourceName = "uknown location";
+    unsigned mask = table->lineSlotCount - 1;
 
-    if(L->ci && (L->ci->func->val.tt_ & 0x3f) == 6)
+    for(unsigned slot = unsigned(line) & mask, i = 0; i < table->lineSlotCount; slot = (slot + 1) & mask, i++)
     {
-        auto proto = ((Lua_5_4::LClosure*)L->ci->func->val.value_.gc)->p;
+        if(table->lines[slot].line == unsigned(line))
+            return &table->lines[slot];
 
-        sourceName = (char*)proto->source + sizeof(Lua_5_4::TString);
+        if(table->lines[slot].line == 0)
+            return nullptr;
     }
 
-    LuaHelperDebugStepHook(ar->event, ar->currentline, sourceName);
-#else
-    LuaHelperStepHook(ar->event);
-#endif
+    return nullptr;
+}
 
-    if(L->ci && (L->ci->func->val.tt_ & 0x3f) == 6)
+static LuaHelperBreakSourceCacheEntry* LuaHelperResolveBreakSource(LuaHelperBreakTable *table, uintptr_t proto, const char *sourceName)
+{
+    if(luaHelperBreakSourceCacheGeneration != table->generation)
     {
-        auto proto = ((Lua_5_4::LClosure*)L->ci->func->val.value_.gc)->p;
-
-        const char *sourceName = (char*)proto->source + sizeof(Lua_5_4::TString);
+        memset(luaHelperBreakSourceCache, 0, sizeof(luaHelperBreakSourceCache));
 
-        LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName);
+        luaHelperBreakSourceCacheGeneration = table->generation;
     }
-}
 
-extern "C" __declspec(dllexport) void LuaHelperHook_5_3(Lua_5_3::lua_State *L, Lua_5_3::lua_Debug *ar)
-{
+    // LuaJIT doesn't provide the function, but source name pointer is stable for all functions of a chunk
+    auto &entry = luaHelperBreakSourceCache[LuaHelperPointerHash(proto ? proto : uintptr_t(sourceName)) & (LUA_HELPER_BREAK_SOURCE_CACHE_SIZE - 1)];
+
+    if(entry.proto == proto && entry.sourceName == sourceName)
+        return &entry;
+
+    entry.proto = proto;
+    entry.sourceName = sourceName;
+    entry.breakSourceName = nullptr;
+
+    // Debugger places each unique source name once, so after this point a pointer comparison is enough
+    for(auto curr = table->data, end = table->data + table->count; curr != end; curr++)
+    {
+        if(!curr->proto && strcmp(curr->sourceName, sourceName) == 0)
+        {
+            entry.breakSourceName = curr->sourceName;
+            break;
+        }
+    }
+
+    entry.hasBreakpoints = entry.breakSourceName != nullptr || (proto && LuaHelperIsBreakProto(table, proto));
+
+    return &entry;
+}
+
+// Result of a predicate operation is 0 (false), 1 (true) or 2 (unknown, error or a type that the debugger has to look at)
+static unsigned char LuaHelperComparePredicateValue(LuaHelperBreakPredicate *predicate, const char *function, const LuaHelperPredicateOp &op)
+{
+    const char *value = nullptr;
+
+    if(op.operandKind == LUA_HELPER_PREDICATE_REGISTER)
+    {
+        value = function + predicate->valueSize * (1 + op.operandIndex);
+    }
+    else if(op.operandKind == LUA_HELPER_PREDICATE_UPVALUE)
+    {
+        char *closure = *(char**)(function + predicate->valueOffset);
+        char *upvalue = *(char**)(closure + predicate->upvalueArrayOffset + op.operandIndex * sizeof(void*));
+
+        if(!upvalue)
+            return 2;
+
+        value = *(char**)(upvalue + predicate->upvalueValueOffset);
+    }
+
+    if(!value)
+        return 2;
+
+    int tag = *(int*)(value + predicate->tagOffset) & int(predicate->tagMask);
+
+    unsigned char kind = LUA_HELPER_PREDICATE_OTHER;
+    long long integer = 0;
+    double number = 0.0;
+
+    if(tag == predicate->nilTag)
+    {
+        kind = LUA_HELPER_PREDICATE_NIL;
+    }
+    else if(predicate->booleanInPayload && tag == predicate->falseTag)
+    {
+        kind = *(int*)(value + predicate->valueOffset) ? LUA_HELPER_PREDICATE_TRUE : LUA_HELPER_PREDICATE_FALSE;
+    }
+    else if(tag == predicate->falseTag)
+    {
+        kind = LUA_HELPER_PREDICATE_FALSE;
+    }
+    else if(tag == predicate->trueTag)
+    {
+        kind = LUA_HELPER_PREDICATE_TRUE;
+    }
+    else if(tag == predicate->integerTag)
+    {
+        kind = LUA_HELPER_PREDICATE_INTEGER;
+        integer = *(long long*)(value + predicate->valueOffset);
+        number = double(integer);
+    }
+    else if(tag == predicate->floatTag)
+    {
+        kind = LUA_HELPER_PREDICATE_NUMBER;
+        number = *(double*)(value + predicate->valueOffset);
+    }
+
+    if(op.compare == LUA_HELPER_PREDICATE_TRUTHY)
+        return kind != LUA_HELPER_PREDICATE_NIL && kind != LUA_HELPER_PREDICATE_FALSE;
+
+    bool isNumber = kind == LUA_HELPER_PREDICATE_INTEGER || kind == LUA_HELPER_PREDICATE_NUMBER;
+    bool isIntegerComparison = kind == LUA_HELPER_PREDICATE_INTEGER && op.constantKind == LUA_HELPER_PREDICATE_INTEGER;
+
+    if(op.compare == LUA_HELPER_PREDICATE_EQUAL || op.compare == LUA_HELPER_PREDICATE_NOT_EQUAL)
+    {
+        bool equal;
+
+        if(op.constantKind == LUA_HELPER_PREDICATE_INTEGER || op.constantKind == LUA_HELPER_PREDICATE_NUMBER)
+            equal = isNumber && (isIntegerComparison ? integer == op.constantInteger : number == op.constantNumber);
+        else
+            equal = kind == op.constantKind;
+
+        return op.compare == LUA_HELPER_PREDICATE_EQUAL ? equal : !equal;
+    }
+
+    // Ordering of other types is an error or a metamethod call
+    if(!isNumber)
+        return 2;
+
+    switch(op.compare)
+    {
+    case LUA_HELPER_PREDICATE_LESS:
+        return isIntegerComparison ? integer < op.constantInteger : number < op.constantNumber;
+    case LUA_HELPER_PREDICATE_LESS_EQUAL:
+        return isIntegerComparison ? integer <= op.constantInteger : number <= op.constantNumber;
+    case LUA_HELPER_PREDICATE_GREATER:
+        return isIntegerComparison ? integer > op.constantInteger : number > op.constantNumber;
+    case LUA_HELPER_PREDICATE_GREATER_EQUAL:
+        return isIntegerComparison ? integer >= op.constantInteger : number >= op.constantNumber;
+    }
+
+    return 2;
+}
+
+// Returns false only when the condition is known to be false
+static bool LuaHelperCheckBreakPredicate(LuaHelperBreakPredicate *predicate, uintptr_t proto, const char *function)
+{
+    if(!predicate || !function || predicate->proto != proto)
+        return true;
+
+    unsigned char stack[LUA_HELPER_PREDICATE_STACK_SIZE];
+    unsigned top = 0;
+
+    for(unsigned i = 0; i < predicate->opCount; i++)
+    {
+        const LuaHelperPredicateOp &op = predicate->ops[i];
+
+        if(op.code == LUA_HELPER_PREDICATE_COMPARE)
+        {
+            if(top == LUA_HELPER_PREDICATE_STACK_SIZE)
+                return true;
+
+            stack[top++] = LuaHelperComparePredicateValue(predicate, function, op);
+        }
+        else if(op.code == LUA_HELPER_PREDICATE_NOT)
+        {
+            if(top < 1)
+                return true;
+
+            if(stack[top - 1] != 2)
+                stack[top - 1] = !stack[top - 1];
+        }
+        else
+        {
+            if(top < 2)
+                return true;
+
+            unsigned char rhs = stack[--top];
+            unsigned char lhs = stack[top - 1];
+
+            // Right side is only evaluated by Lua when left side doesn't decide the result
+            if(op.code == LUA_HELPER_PREDICATE_AND)
+                stack[top - 1] = lhs == 1 ? rhs : lhs;
+            else
+                stack[top - 1] = lhs == 0 ? rhs : lhs;
+        }
+    }
+
+    if(top != 1 || stack[0] != 0)
+        return true;
+
+    predicate->rejectCount++;
+
+    return predicate->rejectCount % LUA_HELPER_PREDICATE_RECHECK_RATE == 0;
+}
+
+void LuaHelperBreakpointHook(void *L, int line, uintptr_t proto, const char *sourceName, const char *function, const char *top)
+{
+    // Table pointer is read once, debugger might publish a new one at any moment
+    LuaHelperBreakTable *table = luaHelperBreakTable;
+
+    if(!table || !LuaHelperIsBreakLine(table, line))
+        return;
+
+    const char *breakSourceName = nullptr;
+
+    if(table->sourceCount == 0)
+    {
+        // Without source breakpoints, only functions from the table can match
+        if(proto && !LuaHelperIsBreakProto(table, proto))
+            return;
+    }
+    else
+    {
+        auto entry = LuaHelperResolveBreakSource(table, proto, sourceName);
+
+        if(!entry->hasBreakpoints)
+            return;
+
+        breakSourceName = entry->breakSourceName;
+    }
+
+    auto breakLine = LuaHelperFindBreakLine(table, line);
+
+    if(!breakLine)
+        return;
+
+    for(auto curr = table->data + breakLine->first, end = curr + breakLine->count; curr != end; curr++)
+    {
+        if(curr->proto)
+        {
+            if(proto == curr->proto)
+            {
+                if(!LuaHelperCheckBreakPredicate(curr->predicate, proto, function))
+                    break;
+
+                if(curr->traceId)
+                {
+                    LuaHelperTraceHit(table, unsigned(curr->traceId), L, line, proto, function, top);
+                    break;
+                }
+
+                LuaHelperRecordStop(L, unsigned(curr->id), proto);
+                OnLuaHelperBreakpointHit();
+                break;
+            }
+        }
+        else
+        {
+            if(breakSourceName && curr->sourceName == breakSourceName)
+            {
+                if(!LuaHelperCheckBreakPredicate(curr->predicate, proto, function))
+                    break;
+
+                if(curr->traceId)
+                {
+                    LuaHelperTraceHit(table, unsigned(curr->traceId), L, line, proto, function, top);
+                    break;
+                }
+
+                LuaHelperRecordStop(L, unsigned(curr->id), proto);
+                OnLuaHelperBreakpointHit();
+                break;
+            }
+        }
+    }
+}
+
+#define LUA_MASKCALL (1 << LUA_HOOKCALL)
+#define LUA_MASKLINE (1 << LUA_HOOKLINE)
+
+#define LUA_5_4_CIST_C (1 << 1)
+
+// When enabled by the debugger, line hook is kept only while inside functions with breakpoints
+// Entering a function without breakpoints disables it, returning enables it until the first line event in the caller
+struct LuaHelperLineHookSettings
+{
+    unsigned enabled;
+    unsigned hookMaskOffset;
+    unsigned hookMaskSize;
+
+    // For Lua 5.4 'trap' flag
+    unsigned stateCallInfoOffset;
+    unsigned callInfoPreviousOffset;
+    unsigned callInfoCallStatusOffset;
+    unsigned callInfoTrapOffset;
+};
+
+extern "C" __declspec(dllexport) LuaHelperLineHookSettings luaHelperLineHookSettings = {};
+
+static bool LuaHelperHasBreakpoints(uintptr_t proto, const char *sourceName)
+{
+    LuaHelperBreakTable *table = luaHelperBreakTable;
+
+    if(!table || table->count == 0)
+        return false;
+
+    if(table->sourceCount == 0)
+        return LuaHelperIsBreakProto(table, proto);
+
+    return LuaHelperResolveBreakSource(table, proto, sourceName)->hasBreakpoints;
+}
+
+static void LuaHelperSetLineHook(char *L, bool enable)
+{
+    // Call hook is checked in case hooks were removed by the debugger
+    if(luaHelperLineHookSettings.hookMaskSize == 4)
+    {
+        int &mask = *(int*)(L + luaHelperLineHookSettings.hookMaskOffset);
+
+        if(mask & LUA_MASKCALL)
+            mask = enable ? (mask | LUA_MASKLINE) : (mask & ~LUA_MASKLINE);
+    }
+    else
+    {
+        unsigned char &mask = *(unsigned char*)(L + luaHelperLineHookSettings.hookMaskOffset);
+
+        if(mask & LUA_MASKCALL)
+            mask = (unsigned char)(enable ? (mask | LUA_MASKLINE) : (mask & ~LUA_MASKLINE));
+    }
+}
+
+static void LuaHelperSetCallInfoTrap(char *callInfo)
+{
+    if(callInfo && (*(unsigned short*)(callInfo + luaHelperLineHookSettings.callInfoCallStatusOffset) & LUA_5_4_CIST_C) == 0)
+        *(int*)(callInfo + luaHelperLineHookSettings.callInfoTrapOffset) = 1;
+}
+
+void LuaHelperLineHookUpdate(void *L, int event, uintptr_t proto, const char *sourceName)
+{
+    if(!luaHelperLineHookSettings.enabled)
+        return;
+
+    // Stepping frame has to see every line, functions called below it (and all functions during step out) only need line hooks for breakpoints
+    // Returns to the stepping frame enable the line hook and the 'trap' flags below
+    if(event != LUA_HOOKRET && (luaHelperStepOver || luaHelperStepInto))
+    {
+        if(LuaHelperStepState *step = LuaHelperGetStepState(L))
+        {
+            if(step->skipDepth == 0)
+            {
+                LuaHelperSetLineHook((char*)L, true);
+                return;
+            }
+        }
+    }
+
+    if(event == LUA_HOOKRET)
+    {
+        LuaHelperSetLineHook((char*)L, true);
+
+        // Lua 5.4 will only check the mask again if 'trap' is set in the returning function and the caller
+        if(luaHelperLineHookSettings.callInfoTrapOffset)
+        {
+            if(char *callInfo = *(char**)((char*)L + luaHelperLineHookSettings.stateCallInfoOffset))
+            {
+                LuaHelperSetCallInfoTrap(callInfo);
+                LuaHelperSetCallInfoTrap(*(char**)(callInfo + luaHelperLineHookSettings.callInfoPreviousOffset));
+            }
+        }
+    }
+    else if(event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL || event == LUA_HOOKLINE)
+    {
+        LuaHelperSetLineHook((char*)L, proto && LuaHelperHasBreakpoints(proto, sourceName));
+    }
+}
+
+#define LUA_HELPER_TIMING_THREAD_COUNT 16
+#define LUA_HELPER_TIMING_RECORD_COUNT 8192 // Power of two
+
+#define LUA_HELPER_TIMING_CALL 1
+#define LUA_HELPER_TIMING_RETURN 2
+#define LUA_HELPER_TIMING_TAIL 3 // Tail call in Lua 5.2+, tail return in Lua 5.1 and LuaJIT
+
+// Fixed size record, layout is the same for 32 and 64 bit processes
+struct LuaHelperTimingRecord
+{
+    unsigned long long timestamp; // Performance counter value shifted by 2, low bits contain the event
+    unsigned long long function; // Proto address (LuaJIT: source name address and definition line, packed as profile keys)
+};
+
+// Each buffer is written only by the thread that owns it, debugger drains them when the process is stopped or when the helper thread reports them
+struct LuaHelperTimingBuffer
+{
+    volatile unsigned threadId;
+    volatile unsigned write;
+    LuaHelperTimingRecord records[LUA_HELPER_TIMING_RECORD_COUNT];
+};
+
+struct LuaHelperTiming
+{
+    volatile unsigned enabled;
+    unsigned threadCount;
+    unsigned recordCount;
+    volatile long lostCount; // Events from threads that didn't get a buffer
+    long long frequency;
+    LuaHelperTimingBuffer buffers[LUA_HELPER_TIMING_THREAD_COUNT];
+};
+
+extern "C" __declspec(dllexport) LuaHelperTiming luaHelperTiming = {};
+
+static thread_local LuaHelperTimingBuffer *luaHelperTimingThreadBuffer = nullptr;
+
+#define LUA_HELPER_TIMING_REPORT_INTERVAL 250 // Milliseconds
+
+// Write positions at the last report, buffers are reported at most once per interval unless half of a ring is filled
+volatile unsigned luaHelperTimingReported[LUA_HELPER_TIMING_THREAD_COUNT] = {};
+DWORD luaHelperTimingReportTime = 0;
+
+bool LuaHelperTimingReportDue(DWORD &timeout)
+{
+    if(!luaHelperTiming.enabled)
+        return false;
+
+    bool pending = false;
+    bool filled = false;
+
+    for(unsigned i = 0; i < LUA_HELPER_TIMING_THREAD_COUNT; i++)
+    {
+        unsigned written = luaHelperTiming.buffers[i].write - luaHelperTimingReported[i];
+
+        pending |= written != 0;
+        filled |= written >= LUA_HELPER_TIMING_RECORD_COUNT / 2;
+    }
+
+    if(!pending)
+        return false;
+
+    DWORD elapsed = GetTickCount() - luaHelperTimingReportTime;
+
+    if(elapsed < LUA_HELPER_TIMING_REPORT_INTERVAL && !filled)
+    {
+        if(timeout > LUA_HELPER_TIMING_REPORT_INTERVAL - elapsed)
+            timeout = LUA_HELPER_TIMING_REPORT_INTERVAL - elapsed;
+
+        return false;
+    }
+
+    for(unsigned i = 0; i < LUA_HELPER_TIMING_THREAD_COUNT; i++)
+        luaHelperTimingReported[i] = luaHelperTiming.buffers[i].write;
+
+    luaHelperTimingReportTime = GetTickCount();
+
+    return true;
+}
+
+void LuaHelperInitializeTiming()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    luaHelperTiming.threadCount = LUA_HELPER_TIMING_THREAD_COUNT;
+    luaHelperTiming.recordCount = LUA_HELPER_TIMING_RECORD_COUNT;
+    luaHelperTiming.frequency = frequency.QuadPart;
+}
+
+void LuaHelperReleaseTimingBuffer()
+{
+    // Write position is kept, debugger continues reading from where it was when the buffer is reused
+    if(luaHelperTimingThreadBuffer)
+        luaHelperTimingThreadBuffer->threadId = 0;
+
+    luaHelperTimingThreadBuffer = nullptr;
+}
+
+static void LuaHelperTimingHook(int event, unsigned long long function)
+{
+    int code = event == LUA_HOOKCALL ? LUA_HELPER_TIMING_CALL : event == LUA_HOOKRET ? LUA_HELPER_TIMING_RETURN : event == LUA_HOOKTAILCALL ? LUA_HELPER_TIMING_TAIL : 0;
+
+    if(!code)
+        return;
+
+    LuaHelperTimingBuffer *buffer = luaHelperTimingThreadBuffer;
+
+    if(!buffer)
+    {
+        unsigned threadId = GetCurrentThreadId();
+
+        for(unsigned i = 0; i < LUA_HELPER_TIMING_THREAD_COUNT && !buffer; i++)
+        {
+            if(luaHelperTiming.buffers[i].threadId == 0 && InterlockedCompareExchange((volatile long*)&luaHelperTiming.buffers[i].threadId, long(threadId), 0) == 0)
+                buffer = &luaHelperTiming.buffers[i];
+        }
+
+        if(!buffer)
+        {
+            InterlockedIncrement(&luaHelperTiming.lostCount);
+            return;
+        }
+
+        luaHelperTimingThreadBuffer = buffer;
+    }
+
+    LARGE_INTEGER timestamp;
+    QueryPerformanceCounter(&timestamp);
+
+    unsigned position = buffer->write;
+
+    LuaHelperTimingRecord &record = buffer->records[position & (LUA_HELPER_TIMING_RECORD_COUNT - 1)];
+
+    record.timestamp = ((unsigned long long)timestamp.QuadPart << 2) | unsigned(code);
+    record.function = function;
+
+    MemoryBarrier();
+
+    buffer->write = position + 1;
+
+    // Wake up the helper thread to start the report interval, or to report right away when half of the ring is filled
+    unsigned reported = luaHelperTimingReported[buffer - luaHelperTiming.buffers];
+
+    if((position == reported || position - reported == LUA_HELPER_TIMING_RECORD_COUNT / 2) && luaHelperAsyncBreakEvent)
+        SetEvent(luaHelperAsyncBreakEvent);
+}
+
+#define LUA_HELPER_PROFILE_SLOT_COUNT 8192 // Power of two
+#define LUA_HELPER_PROFILE_PROBE_LIMIT 32
+#define LUA_HELPER_PROFILE_POSITION_BITS 20
+
+// Count hook samples are collected into an open-addressed histogram that the debugger reads when the process is stopped or when the helper thread reports it
+// Key combines an 8 byte aligned Proto address (LuaJIT: source name) with an instruction index (LuaJIT: line), zero key is an empty slot
+struct LuaHelperProfileSlot
+{
+    volatile long long key;
+    volatile long count;
+    unsigned padding;
+};
+
+struct LuaHelperProfile
+{
+    volatile long sampleCount;
+    volatile long lostCount; // Samples that didn't find a slot within the probe limit
+    unsigned slotCount;
+    unsigned positionBits;
+    LuaHelperProfileSlot slots[LUA_HELPER_PROFILE_SLOT_COUNT];
+};
+
+extern "C" __declspec(dllexport) LuaHelperProfile luaHelperProfile = { 0, 0, LUA_HELPER_PROFILE_SLOT_COUNT, LUA_HELPER_PROFILE_POSITION_BITS };
+
+#define LUA_HELPER_PROFILE_REPORT_INTERVAL 1000 // Milliseconds
+
+// Sample count at the last report, histogram is reported at most once per interval
+volatile long luaHelperProfileReported = 0;
+DWORD luaHelperProfileReportTime = 0;
+
+bool LuaHelperProfileReportDue(DWORD &timeout)
+{
+    long sampleCount = luaHelperProfile.sampleCount;
+
+    if(sampleCount == luaHelperProfileReported)
+        return false;
+
+    DWORD elapsed = GetTickCount() - luaHelperProfileReportTime;
+
+    if(elapsed < LUA_HELPER_PROFILE_REPORT_INTERVAL)
+    {
+        if(timeout > LUA_HELPER_PROFILE_REPORT_INTERVAL - elapsed)
+            timeout = LUA_HELPER_PROFILE_REPORT_INTERVAL - elapsed;
+
+        return false;
+    }
+
+    luaHelperProfileReported = sampleCount;
+    luaHelperProfileReportTime = GetTickCount();
+
+    return true;
+}
+
+// Filled by the debugger, current instruction is not available in the hook arguments
+struct LuaHelperProfileSettings
+{
+    unsigned callInfoSavedPcOffset;
+    unsigned protoCodeOffset; // For compatibility mode hook
+};
+
+extern "C" __declspec(dllexport) LuaHelperProfileSettings luaHelperProfileSettings = {};
+
+static unsigned long long LuaHelperProfileKey(uintptr_t address, unsigned position)
+{
+    if(position >= (1u << LUA_HELPER_PROFILE_POSITION_BITS))
+        position = (1u << LUA_HELPER_PROFILE_POSITION_BITS) - 1;
+
+    return (unsigned long long)(address >> 3) | ((unsigned long long)position << (64 - LUA_HELPER_PROFILE_POSITION_BITS));
+}
+
+static void LuaHelperProfileSample(uintptr_t address, unsigned position)
+{
+    if(!address)
+        return;
+
+    long long key = (long long)LuaHelperProfileKey(address, position);
+
+    // Wake up the helper thread to start the report interval
+    if(InterlockedIncrement(&luaHelperProfile.sampleCount) - 1 == luaHelperProfileReported && luaHelperAsyncBreakEvent)
+        SetEvent(luaHelperAsyncBreakEvent);
+
+    unsigned index = unsigned(((unsigned long long)key * 0x9E3779B97F4A7C15ull) >> 32);
+
+    for(unsigned i = 0; i < LUA_HELPER_PROFILE_PROBE_LIMIT; i++)
+    {
+        LuaHelperProfileSlot &slot = luaHelperProfile.slots[(index + i) & (LUA_HELPER_PROFILE_SLOT_COUNT - 1)];
+
+        long long current = slot.key;
+
+        // Claim an empty slot, another thread might have claimed it for the same key
+        if(current == 0)
+            current = InterlockedCompareExchange64(&slot.key, key, 0);
+
+        if(current == 0 || current == key)
+        {
+            InterlockedIncrement(&slot.count);
+            return;
+        }
+    }
+
+    InterlockedIncrement(&luaHelperProfile.lostCount);
+}
+
+static unsigned LuaHelperProfileInstruction(const char *callInfo, const char *code)
+{
+    if(!luaHelperProfileSettings.callInfoSavedPcOffset || !callInfo || !code)
+        return 0;
+
+    const char *savedpc = *(const char**)(callInfo + luaHelperProfileSettings.callInfoSavedPcOffset);
+
+    // Saved instruction pointer is already advanced past the current instruction
+    if(savedpc <= code)
+        return 0;
+
+    return unsigned((savedpc - code) / 4) - 1;
+}
+
+extern "C" __declspec(dllexport) void LuaHelperHook_5_4(Lua_5_4::lua_State *L, Lua_5_4::lua_Debug *ar)
+{
+    LUA_HELPER_HOOK_TIMER(ar->event);
+
+    if(ar->event == LUA_HOOKCOUNT)
+    {
+        if(L->ci && (L->ci->func->val.tt_ & 0x3f) == 6)
+        {
+            auto proto = ((Lua_5_4::LClosure*)L->ci->func->val.value_.gc)->p;
+
+            LuaHelperProfileSample(uintptr_t(proto), LuaHelperProfileInstruction((const char*)L->ci, (const char*)proto->code));
+        }
+
+        return;
+    }
+
+    if(luaHelperTiming.enabled && L->ci && (L->ci->func->val.tt_ & 0x3f) == 6)
+        LuaHelperTimingHook(ar->event, uintptr_t(((Lua_5_4::LClosure*)L->ci->func->val.value_.gc)->p));
+
+#if defined(DEBUG_MODE)
+    const char *sourceName = "uknown location";
+
+    if(L->ci && (L->ci->func->val.tt_ & 0x3f) == 6)
+    {
+        auto proto = ((Lua_5_4::LClosure*)L->ci->func->val.value_.gc)->p;
+
+        sourceName = (char*)proto->source + sizeof(Lua_5_4::TString);
+    }
+
+    LuaHelperDebugStepHook(L, ar->event, ar->currentline, sourceName);
+#else
+    LuaHelperStepHook(L, ar->event);
+#endif
+
+    if(L->ci && (L->ci->func->val.tt_ & 0x3f) == 6)
+    {
+        auto proto = ((Lua_5_4::LClosure*)L->ci->func->val.value_.gc)->p;
+
+        const char *sourceName = (char*)proto->source + sizeof(Lua_5_4::TString);
+
+        LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName, (const char*)L->ci->func, (const char*)L->top);
+
+        LuaHelperLineHookUpdate(L, ar->event, uintptr_t(proto), sourceName);
+    }
+    else
+    {
+        LuaHelperLineHookUpdate(L, ar->event, 0, nullptr);
+    }
+}
+
+extern "C" __declspec(dllexport) void LuaHelperHook_5_3(Lua_5_3::lua_State *L, Lua_5_3::lua_Debug *ar)
+{
+    LUA_HELPER_HOOK_TIMER(ar->event);
+
+    if(ar->event == LUA_HOOKCOUNT)
+    {
+        if(L->ci && (L->ci->func->tt_ & 0x3f) == 6)
+        {
+            auto proto = ((Lua_5_3::LClosure*)L->ci->func->value_.gc)->p;
+
+            LuaHelperProfileSample(uintptr_t(proto), LuaHelperProfileInstruction((const char*)L->ci, (const char*)proto->code));
+        }
+
+        return;
+    }
+
+    if(luaHelperTiming.enabled && L->ci && (L->ci->func->tt_ & 0x3f) == 6)
+        LuaHelperTimingHook(ar->event, uintptr_t(((Lua_5_3::LClosure*)L->ci->func->value_.gc)->p));
+
 #if defined(DEBUG_MODE)
     const char *sourceName = "uknown location";
 
@@ -814,9 +1999,9 @@ extern "C" __declspec(dllexport) void LuaHelperHook_5_3(Lua_5_3::lua_State *L, L
         sourceName = (char*)proto->source + sizeof(Lua_5_3::TString);
     }
 
-    LuaHelperDebugStepHook(ar->event, ar->currentline, sourceName);
+    LuaHelperDebugStepHook(L, ar->event, ar->currentline, sourceName);
 #else
-    LuaHelperStepHook(ar->event);
+    LuaHelperStepHook(L, ar->event);
 #endif
 
     if(L->ci && (L->ci->func->tt_ & 0x3f) == 6)
@@ -825,13 +2010,36 @@ extern "C" __declspec(dllexport) void LuaHelperHook_5_3(Lua_5_3::lua_State *L, L
 
         const char *sourceName = (char*)proto->source + sizeof(Lua_5_3::TString);
 
-        LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName);
+        LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName, (const char*)L->ci->func, (const char*)L->top);
+
+        LuaHelperLineHookUpdate(L, ar->event, uintptr_t(proto), sourceName);
+    }
+    else
+    {
+        LuaHelperLineHookUpdate(L, ar->event, 0, nullptr);
     }
 }
 
 extern "C" __declspec(dllexport) void LuaHelperHook_5_2(Lua_5_2::lua_State *L, Lua_5_2::lua_Debug *ar)
 {
-    LuaHelperStepHook(ar->event);
+    LUA_HELPER_HOOK_TIMER(ar->event);
+
+    if(ar->event == LUA_HOOKCOUNT)
+    {
+        if(L->ci && (L->ci->func->u.i.tt__ & 0x3f) == 6)
+        {
+            auto proto = ((Lua_5_2::LClosure*)L->ci->func->u.i.v__.gc)->p;
+
+            LuaHelperProfileSample(uintptr_t(proto), LuaHelperProfileInstruction((const char*)L->ci, (const char*)proto->code));
+        }
+
+        return;
+    }
+
+    if(luaHelperTiming.enabled && L->ci && (L->ci->func->u.i.tt__ & 0x3f) == 6)
+        LuaHelperTimingHook(ar->event, uintptr_t(((Lua_5_2::LClosure*)L->ci->func->u.i.v__.gc)->p));
+
+    LuaHelperStepHook(L, ar->event);
 
     if(L->ci && (L->ci->func->u.i.tt__ & 0x3f) == 6)
     {
@@ -839,46 +2047,59 @@ extern "C" __declspec(dllexport) void LuaHelperHook_5_2(Lua_5_2::lua_State *L, L
 
         const char *sourceName = (char*)proto->source + sizeof(Lua_5_2::TString);
 
-        LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName);
+        LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName, (const char*)L->ci->func, (const char*)L->top);
+
+        LuaHelperLineHookUpdate(L, ar->event, uintptr_t(proto), sourceName);
+    }
+    else
+    {
+        LuaHelperLineHookUpdate(L, ar->event, 0, nullptr);
     }
 }
 
 extern "C" __declspec(dllexport) void LuaHelperHook_5_1(Lua_5_1::lua_State *L, Lua_5_1::lua_Debug *ar)
 {
-    if(ar->event == LUA_HOOKCALL)
-    {
-        if(luaHelperStepInto)
-        {
-            OnLuaHelperStepInto();
-        }
-        else if(luaHelperStepOver || luaHelperStepOut)
-        {
-            luaHelperSkipDepth++;
-        }
-    }
+    LUA_HELPER_HOOK_TIMER(ar->event);
 
-    if(ar->event == LUA_HOOKRET || ar->event == LUA_HOOKTAILRET)
+    if(ar->event == LUA_HOOKCOUNT)
     {
-        if(luaHelperStepOut && luaHelperSkipDepth == 0)
-        {
-            OnLuaHelperStepOut();
-        }
-        else if((luaHelperStepOver || luaHelperStepOut) && luaHelperSkipDepth > 0)
+        auto function = L->ci->func;
+
+        if((function->tt & 0x3f) == 6 && !((Lua_5_1::LClosure*)function->value.gc)->isC)
         {
-            luaHelperSkipDepth--;
+            auto proto = ((Lua_5_1::LClosure*)function->value.gc)->p;
+
+            // Lua 5.1 keeps the instruction pointer of the current function in lua_State
+            unsigned instruction = L->savedpc > proto->code ? unsigned(L->savedpc - proto->code) - 1 : 0;
+
+            LuaHelperProfileSample(uintptr_t(proto), instruction);
         }
+
+        return;
     }
 
-    if(ar->event == LUA_HOOKLINE && (luaHelperStepOver || luaHelperStepInto) && luaHelperSkipDepth == 0)
+    if(luaHelperTiming.enabled)
     {
-        OnLuaHelperStepComplete();
+        auto function = L->ci->func;
+
+        // Tail return doesn't belong to a specific function, it ends a frame that was replaced by a tail call
+        if(ar->event == LUA_HOOKTAILRET)
+            LuaHelperTimingHook(ar->event, 0);
+        else if((function->tt & 0x3f) == 6 && !((Lua_5_1::LClosure*)function->value.gc)->isC)
+            LuaHelperTimingHook(ar->event, uintptr_t(((Lua_5_1::LClosure*)function->value.gc)->p));
     }
 
+    // In Lua 5.1, tail return shares the value with tail call of later versions
+    LuaHelperStepHook(L, ar->event == LUA_HOOKTAILRET ? LUA_HOOKRET : ar->event);
+
     unsigned callInfoIndex = 0;
 
     if(ar->event != LUA_HOOKTAILRET)
         callInfoIndex = unsigned(L->ci - L->base_ci);
 
+    Lua_5_1::Proto *proto = nullptr;
+    const char *sourceName = nullptr;
+
     if(callInfoIndex >= 0)
     {
         auto function = L->base_ci[callInfoIndex].func;
@@ -889,14 +2110,17 @@ extern "C" __declspec(dllexport) void LuaHelperHook_5_1(Lua_5_1::lua_State *L, L
 
             if(!luaClosure->isC)
             {
-                auto proto = luaClosure->p;
+                proto = luaClosure->p;
 
-                const char *sourceName = (char*)proto->source + sizeof(Lua_5_1::TString);
+                sourceName = (char*)proto->source + sizeof(Lua_5_1::TString);
 
-                LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName);
+                LuaHelperBreakpointHook(L, ar->currentline, uintptr_t(proto), sourceName, (const char*)function, (const char*)L->top);
             }
         }
     }
+
+    // In Lua 5.1, tail return shares the value with tail call of later versions
+    LuaHelperLineHookUpdate(L, ar->event == LUA_HOOKTAILRET ? LUA_HOOKRET : ar->event, uintptr_t(proto), sourceName);
 }
 
 extern "C" __declspec(dllexport) unsigned luaHelperCompatLuaDebugEventOffset = 0;
@@ -908,88 +2132,604 @@ extern "C" __declspec(dllexport) unsigned luaHelperCompatTaggedValueValueOffset
 extern "C" __declspec(dllexport) unsigned luaHelperCompatLuaClosureProtoOffset = 0;
 extern "C" __declspec(dllexport) unsigned luaHelperCompatLuaFunctionSourceOffset = 0;
 extern "C" __declspec(dllexport) unsigned luaHelperCompatStringContentOffset = 0;
+extern "C" __declspec(dllexport) unsigned luaHelperCompatLuaStateTopOffset = 0;
 
-extern "C" __declspec(dllexport) void LuaHelperHook_5_234_compat(char *L, char *ar)
+// Offsets in the compatibility layout are provided by the debugger from the debug information of the Lua library
+struct LuaHelperCompatLayout
+{
+    static const unsigned &luaDebugEvent;
+    static const unsigned &luaDebugCurrentLine;
+    static const unsigned &luaStateCallInfo;
+    static const unsigned &callInfoFunction;
+    static const unsigned &taggedValueTypeTag;
+    static const unsigned &taggedValueValue;
+    static const unsigned &luaClosureProto;
+    static const unsigned &luaFunctionSource;
+    static const unsigned &stringContent;
+    static const unsigned &luaStateTop;
+};
+
+const unsigned &LuaHelperCompatLayout::luaDebugEvent = luaHelperCompatLuaDebugEventOffset;
+const unsigned &LuaHelperCompatLayout::luaDebugCurrentLine = luaHelperCompatLuaDebugCurrentLineOffset;
+const unsigned &LuaHelperCompatLayout::luaStateCallInfo = luaHelperCompatLuaStateCallInfoOffset;
+const unsigned &LuaHelperCompatLayout::callInfoFunction = luaHelperCompatCallInfoFunctionOffset;
+const unsigned &LuaHelperCompatLayout::taggedValueTypeTag = luaHelperCompatTaggedValueTypeTagOffset;
+const unsigned &LuaHelperCompatLayout::taggedValueValue = luaHelperCompatTaggedValueValueOffset;
+const unsigned &LuaHelperCompatLayout::luaClosureProto = luaHelperCompatLuaClosureProtoOffset;
+const unsigned &LuaHelperCompatLayout::luaFunctionSource = luaHelperCompatLuaFunctionSourceOffset;
+const unsigned &LuaHelperCompatLayout::stringContent = luaHelperCompatStringContentOffset;
+const unsigned &LuaHelperCompatLayout::luaStateTop = luaHelperCompatLuaStateTopOffset;
+
+// Offsets of a known Lua build are constant, so that the compiler can fold them into the hook
+template<unsigned LuaDebugEvent, unsigned LuaDebugCurrentLine, unsigned LuaStateCallInfo, unsigned CallInfoFunction, unsigned TaggedValueTypeTag, unsigned TaggedValueValue, unsigned LuaClosureProto, unsigned LuaFunctionSource, unsigned StringContent, unsigned LuaStateTop>
+struct LuaHelperFixedLayout
+{
+    static constexpr unsigned luaDebugEvent = LuaDebugEvent;
+    static constexpr unsigned luaDebugCurrentLine = LuaDebugCurrentLine;
+    static constexpr unsigned luaStateCallInfo = LuaStateCallInfo;
+    static constexpr unsigned callInfoFunction = CallInfoFunction;
+    static constexpr unsigned taggedValueTypeTag = TaggedValueTypeTag;
+    static constexpr unsigned taggedValueValue = TaggedValueValue;
+    static constexpr unsigned luaClosureProto = LuaClosureProto;
+    static constexpr unsigned luaFunctionSource = LuaFunctionSource;
+    static constexpr unsigned stringContent = StringContent;
+    static constexpr unsigned luaStateTop = LuaStateTop;
+};
+
+// Lua 5.2 uses NaN trick on x86 by default, number values are not a part of 'Value' union, otherwise the union has a double
+typedef LuaHelperFixedLayout<offsetof(Lua_5_2::lua_Debug, event), offsetof(Lua_5_2::lua_Debug, currentline), offsetof(Lua_5_2::lua_State, ci), offsetof(Lua_5_2::CallInfo, func), offsetof(Lua_5_2::TValue, u.i.tt__), 0, offsetof(Lua_5_2::LClosure, p), offsetof(Lua_5_2::Proto, source), sizeof(Lua_5_2::TString), offsetof(Lua_5_2::lua_State, top)> LuaHelperLayout_5_2_nantrick;
+typedef LuaHelperFixedLayout<offsetof(Lua_5_2::lua_Debug, event), offsetof(Lua_5_2::lua_Debug, currentline), offsetof(Lua_5_2::lua_State, ci), offsetof(Lua_5_2::CallInfo, func), sizeof(double), 0, offsetof(Lua_5_2::LClosure, p), offsetof(Lua_5_2::Proto, source), sizeof(Lua_5_2::TString), offsetof(Lua_5_2::lua_State, top)> LuaHelperLayout_5_2;
+typedef LuaHelperFixedLayout<offsetof(Lua_5_3::lua_Debug, event), offsetof(Lua_5_3::lua_Debug, currentline), offsetof(Lua_5_3::lua_State, ci), offsetof(Lua_5_3::CallInfo, func), offsetof(Lua_5_3::TValue, tt_), offsetof(Lua_5_3::TValue, value_), offsetof(Lua_5_3::LClosure, p), offsetof(Lua_5_3::Proto, source), sizeof(Lua_5_3::TString), offsetof(Lua_5_3::lua_State, top)> LuaHelperLayout_5_3;
+typedef LuaHelperFixedLayout<offsetof(Lua_5_4::lua_Debug, event), offsetof(Lua_5_4::lua_Debug, currentline), offsetof(Lua_5_4::lua_State, ci), offsetof(Lua_5_4::CallInfo, func), offsetof(Lua_5_4::TValue, tt_), offsetof(Lua_5_4::TValue, value_), offsetof(Lua_5_4::LClosure, p), offsetof(Lua_5_4::Proto, source), sizeof(Lua_5_4::TString), offsetof(Lua_5_4::lua_State, top)> LuaHelperLayout_5_4;
+
+// LUA_32BITS builds of Lua 5.3 and 5.4 have 4 byte numbers, the value is pointer sized
+// In 64 bit builds, the layout is the same as the default one
+#if !defined(_WIN64)
+typedef LuaHelperFixedLayout<offsetof(Lua_5_3::lua_Debug, event), offsetof(Lua_5_3::lua_Debug, currentline), offsetof(Lua_5_3::lua_State, ci), offsetof(Lua_5_3::CallInfo, func), sizeof(void*), 0, offsetof(Lua_5_3::LClosure, p), offsetof(Lua_5_3::Proto, source), sizeof(Lua_5_3::TString), offsetof(Lua_5_3::lua_State, top)> LuaHelperLayout_5_3_32bits;
+typedef LuaHelperFixedLayout<offsetof(Lua_5_4::lua_Debug, event), offsetof(Lua_5_4::lua_Debug, currentline), offsetof(Lua_5_4::lua_State, ci), offsetof(Lua_5_4::CallInfo, func), sizeof(void*), 0, offsetof(Lua_5_4::LClosure, p), offsetof(Lua_5_4::Proto, source), sizeof(Lua_5_4::TString), offsetof(Lua_5_4::lua_State, top)> LuaHelperLayout_5_4_32bits;
+#endif
+
+template<typename Layout>
+void LuaHelperLayoutHook(char *L, char *ar)
 {
-    int eventType = *(int*)(ar + luaHelperCompatLuaDebugEventOffset);
-    int currentLine = *(int*)(ar + luaHelperCompatLuaDebugCurrentLineOffset);
+    int eventType = *(int*)(ar + Layout::luaDebugEvent);
+    int currentLine = *(int*)(ar + Layout::luaDebugCurrentLine);
 
-    LuaHelperStepHook(eventType);
+    LUA_HELPER_HOOK_TIMER(eventType);
 
-    if(char *callInfo = *(char**)(L + luaHelperCompatLuaStateCallInfoOffset))
+    if(eventType == LUA_HOOKCOUNT)
     {
-        if(char *function = *(char**)(callInfo + luaHelperCompatCallInfoFunctionOffset))
+        char *callInfo = *(char**)(L + Layout::luaStateCallInfo);
+        char *function = callInfo ? *(char**)(callInfo + Layout::callInfoFunction) : nullptr;
+
+        if(function && (*(int*)(function + Layout::taggedValueTypeTag) & 0x3f) == 6 && luaHelperProfileSettings.protoCodeOffset)
+        {
+            char *luaClosureValue = *(char**)(function + Layout::taggedValueValue);
+            char *proto = *(char**)(luaClosureValue + Layout::luaClosureProto);
+
+            LuaHelperProfileSample(uintptr_t(proto), LuaHelperProfileInstruction(callInfo, *(char**)(proto + luaHelperProfileSettings.protoCodeOffset)));
+        }
+
+        return;
+    }
+
+    LuaHelperStepHook(L, eventType);
+
+    char *proto = nullptr;
+    const char *sourceName = nullptr;
+
+    if(char *callInfo = *(char**)(L + Layout::luaStateCallInfo))
+    {
+        if(char *function = *(char**)(callInfo + Layout::callInfoFunction))
         {
-            int typeTag = *(int*)(function + luaHelperCompatTaggedValueTypeTagOffset);
+            int typeTag = *(int*)(function + Layout::taggedValueTypeTag);
 
             if((typeTag & 0x3f) == 6)
             {
-                char *luaClosureValue = *(char**)(function + luaHelperCompatTaggedValueValueOffset);
+                char *luaClosureValue = *(char**)(function + Layout::taggedValueValue);
+
+                proto = *(char**)(luaClosureValue + Layout::luaClosureProto);
+
+                if(luaHelperTiming.enabled)
+                    LuaHelperTimingHook(eventType, uintptr_t(proto));
 
-                char *proto = *(char**)(luaClosureValue + luaHelperCompatLuaClosureProtoOffset);
+                char *source = *(char**)(proto + Layout::luaFunctionSource);
 
-                char *source = *(char**)(proto + luaHelperCompatLuaFunctionSourceOffset);
+                sourceName = source + Layout::stringContent;
 
-                const char *sourceName = source + luaHelperCompatStringContentOffset;
+                // Stack top limits the registers that tracepoints capture, offset is zero when it's not known
+                char *top = Layout::luaStateTop ? *(char**)(L + Layout::luaStateTop) : nullptr;
 
-                LuaHelperBreakpointHook(L, currentLine, uintptr_t(proto), sourceName);
+                LuaHelperBreakpointHook(L, currentLine, uintptr_t(proto), sourceName, function, top);
             }
         }
     }
+
+    LuaHelperLineHookUpdate(L, eventType, uintptr_t(proto), sourceName);
+}
+
+extern "C" __declspec(dllexport) void LuaHelperHook_5_234_compat(char *L, char *ar)
+{
+    LuaHelperLayoutHook<LuaHelperCompatLayout>(L, ar);
+}
+
+// Debugger compares the offsets with the debug information of the Lua library and uses the matching hook instead of the compatibility hook
+// Layout is the same for 32 and 64 bit processes
+struct LuaHelperHookLayout
+{
+    unsigned offsets[10]; // Same order as the compatibility hook offsets
+    unsigned long long hook;
+};
+
+template<typename Layout>
+LuaHelperHookLayout LuaHelperCreateHookLayout()
+{
+    return { { Layout::luaDebugEvent, Layout::luaDebugCurrentLine, Layout::luaStateCallInfo, Layout::callInfoFunction, Layout::taggedValueTypeTag, Layout::taggedValueValue, Layout::luaClosureProto, Layout::luaFunctionSource, Layout::stringContent, Layout::luaStateTop }, uintptr_t(&LuaHelperLayoutHook<Layout>) };
 }
 
+#if defined(_WIN64)
+#define LUA_HELPER_HOOK_LAYOUT_COUNT 4
+#else
+#define LUA_HELPER_HOOK_LAYOUT_COUNT 6
+#endif
+
+extern "C" __declspec(dllexport) unsigned luaHelperHookLayoutCount = LUA_HELPER_HOOK_LAYOUT_COUNT;
+
+extern "C" __declspec(dllexport) LuaHelperHookLayout luaHelperHookLayouts[LUA_HELPER_HOOK_LAYOUT_COUNT] = {
+    LuaHelperCreateHookLayout<LuaHelperLayout_5_2_nantrick>(),
+    LuaHelperCreateHookLayout<LuaHelperLayout_5_2>(),
+    LuaHelperCreateHookLayout<LuaHelperLayout_5_3>(),
+    LuaHelperCreateHookLayout<LuaHelperLayout_5_4>(),
+#if !defined(_WIN64)
+    LuaHelperCreateHookLayout<LuaHelperLayout_5_3_32bits>(),
+    LuaHelperCreateHookLayout<LuaHelperLayout_5_4_32bits>(),
+#endif
+};
+
 extern "C" __declspec(dllexport) unsigned long long luaHelperLuajitGetInfoAddress = 0;
 extern "C" __declspec(dllexport) unsigned long long luaHelperLuajitGetStackAddress = 0;
 
-static unsigned LuaHelperMeasureStackDepth(char *L, Luajit::lj_Debug *ar)
+// Activation record of the hook is not used, lua_getstack replaces its frame reference, which the hook needs for lua_getinfo later
+static unsigned LuaHelperMeasureStackDepth(char *L)
+{
+    auto getStack = (int(*)(void*, int, void*))luaHelperLuajitGetStackAddress;
+
+    Luajit::lj_DebugFull probe;
+    Luajit::lj_Debug *ar = &probe.header;
+
+    if(!getStack(L, 0, ar))
+        return 0;
+
+    // Each lua_getstack call walks the frames up to the level, so the number of calls is kept logarithmic
+    // First, find a missing level by doubling, then find the first missing level between the last present one and it
+    unsigned present = 0;
+    unsigned missing = 1;
+
+    while(getStack(L, int(missing), ar))
+    {
+        present = missing;
+        missing *= 2;
+    }
+
+    while(missing - present > 1)
+    {
+        unsigned middle = present + (missing - present) / 2;
+
+        if(getStack(L, int(middle), ar))
+            present = middle;
+        else
+            missing = middle;
+    }
+
+    return missing;
+}
+
+#define LUAJIT_MODE_FUNC 2
+#define LUAJIT_MODE_OFF 0x0000
+#define LUAJIT_MODE_ON 0x0100
+
+#define LUAJIT_REGISTRYINDEX (-10000)
+
+// Lua library functions used to switch functions with breakpoints to the interpreter, written by the debugger
+struct LuaHelperLuajitFunctionMode
+{
+    unsigned long long setMode; // luaJIT_setmode
+    unsigned long long setTop;
+    unsigned long long toPointer;
+    unsigned long long rawGetI;
+    unsigned long long ref; // luaL_ref
+    unsigned long long unref;
+    unsigned long long setHook;
+
+    // Bytecode reference of a Lua closure (GCfuncL::pc) identifies its prototype, without it each closure is tracked separately
+    unsigned closurePcOffset;
+    unsigned closurePcSize;
+};
+
+extern "C" __declspec(dllexport) LuaHelperLuajitFunctionMode luaHelperLuajitFunctionMode = {};
+
+// Debugger sets this flag instead of removing the hooks while some functions are switched to the interpreter
+// Hook of each Lua state switches them back and then removes itself
+extern "C" __declspec(dllexport) volatile unsigned luaHelperLuajitHookRemoval = 0;
+
+#define LUA_HELPER_JIT_FUNCTION_COUNT 1024 // Power of two
+#define LUA_HELPER_JIT_FUNCTION_REMOVED 1
+
+// Function that had JIT compilation disabled by the helper, a registry reference keeps it alive until it's switched back
+struct LuaHelperJitFunction
+{
+    uintptr_t id; // Zero for an empty slot
+    uintptr_t registry; // Functions can only be switched back by the Lua state they belong to
+    int ref;
+    const char *source;
+    int linedefined;
+    int lastlinedefined;
+};
+
+LuaHelperJitFunction luaHelperJitFunctions[LUA_HELPER_JIT_FUNCTION_COUNT] = {};
+SRWLOCK luaHelperJitFunctionLock = SRWLOCK_INIT;
+
+extern "C" __declspec(dllexport) volatile long luaHelperJitFunctionCount = 0;
+
+// Function mode only has to be checked again when breakpoints or step actions change
+static unsigned LuaHelperJitStamp()
+{
+    LuaHelperBreakTable *table = luaHelperBreakTable;
+
+    unsigned stamp = table ? table->generation * 2 : 0;
+
+    if(luaHelperStepOver || luaHelperStepInto || luaHelperStepOut)
+        stamp |= 1;
+
+    return stamp;
+}
+
+struct LuaHelperJitStateStamp
 {
-    unsigned depth = 0;
-    while(((int(*)(void*, int, void*))luaHelperLuajitGetStackAddress)(L, depth, ar))
-        depth++;
-    return depth;
+    uintptr_t registry;
+    unsigned stamp;
+};
+
+#define LUA_HELPER_JIT_STATE_STAMP_COUNT 4
+
+static thread_local LuaHelperJitStateStamp luaHelperJitStateStamps[LUA_HELPER_JIT_STATE_STAMP_COUNT] = {};
+static thread_local unsigned luaHelperJitStateStampNext = 0;
+
+// Returns false if the Lua state was already checked with the same stamp by this thread
+static bool LuaHelperUpdateJitStateStamp(uintptr_t registry, unsigned stamp)
+{
+    for(auto &state : luaHelperJitStateStamps)
+    {
+        if(state.registry == registry)
+        {
+            if(state.stamp == stamp)
+                return false;
+
+            state.stamp = stamp;
+            return true;
+        }
+    }
+
+    auto &state = luaHelperJitStateStamps[luaHelperJitStateStampNext++ % LUA_HELPER_JIT_STATE_STAMP_COUNT];
+
+    state.registry = registry;
+    state.stamp = stamp;
+
+    return true;
+}
+
+// Line events of the function that was checked last don't have to look it up again
+struct LuaHelperJitLastCheck
+{
+    void *L;
+    const char *source;
+    int linedefined;
+    int lastlinedefined;
+    unsigned stamp;
+};
+
+static thread_local LuaHelperJitLastCheck luaHelperJitLastCheck = {};
+
+// Breakpoints of a chunk between the first and the last line of a function (lines of nested functions are included)
+static bool LuaHelperHasBreakpointsInLines(const char *sourceName, int firstLine, int lastLine)
+{
+    LuaHelperBreakTable *table = luaHelperBreakTable;
+
+    if(!table || table->count == 0 || table->sourceCount == 0 || !sourceName)
+        return false;
+
+    auto entry = LuaHelperResolveBreakSource(table, 0, sourceName);
+
+    if(!entry->breakSourceName)
+        return false;
+
+    // Entries are ordered by line
+    unsigned low = 0;
+    unsigned high = table->count;
+
+    while(low < high)
+    {
+        unsigned middle = low + (high - low) / 2;
+
+        if(int(table->data[middle].line) < firstLine)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    for(auto curr = table->data + low, end = table->data + table->count; curr != end && int(curr->line) <= lastLine; curr++)
+    {
+        if(!curr->proto && curr->sourceName == entry->breakSourceName)
+            return true;
+    }
+
+    return false;
+}
+
+static LuaHelperJitFunction* LuaHelperFindJitFunction(uintptr_t id, uintptr_t registry, bool insert)
+{
+    LuaHelperJitFunction *available = nullptr;
+
+    for(unsigned slot = LuaHelperPointerHash(id ^ registry), i = 0; i < LUA_HELPER_JIT_FUNCTION_COUNT; slot++, i++)
+    {
+        auto &entry = luaHelperJitFunctions[slot & (LUA_HELPER_JIT_FUNCTION_COUNT - 1)];
+
+        if(entry.id == id && entry.registry == registry)
+            return &entry;
+
+        if(entry.id == LUA_HELPER_JIT_FUNCTION_REMOVED && !available)
+            available = &entry;
+
+        if(entry.id == 0)
+        {
+            if(!available)
+                available = &entry;
+
+            break;
+        }
+    }
+
+    if(!insert || !available)
+        return nullptr;
+
+    available->id = id;
+    available->registry = registry;
+
+    InterlockedIncrement(&luaHelperJitFunctionCount);
+
+    return available;
+}
+
+static void LuaHelperRemoveJitFunction(LuaHelperJitFunction *entry)
+{
+    entry->id = LUA_HELPER_JIT_FUNCTION_REMOVED;
+
+    // Removed slots are only reclaimed when the table is empty
+    if(InterlockedDecrement(&luaHelperJitFunctionCount) == 0)
+        memset(luaHelperJitFunctions, 0, sizeof(luaHelperJitFunctions));
+}
+
+// Function has to be on top of the stack
+static uintptr_t LuaHelperLuajitFunctionId(char *L)
+{
+    auto &api = luaHelperLuajitFunctionMode;
+
+    auto function = (const char*)((const void*(*)(void*, int))api.toPointer)(L, -1);
+
+    if(function && api.closurePcSize == 8)
+        return uintptr_t(*(const unsigned long long*)(function + api.closurePcOffset));
+
+    if(function && api.closurePcSize == 4)
+        return uintptr_t(*(const unsigned*)(function + api.closurePcOffset));
+
+    return uintptr_t(function);
+}
+
+// Functions of this Lua state that don't need the interpreter anymore are switched back to JIT compilation
+static void LuaHelperLuajitRestoreFunctions(char *L, bool all)
+{
+    auto &api = luaHelperLuajitFunctionMode;
+
+    uintptr_t registry = uintptr_t(((const void*(*)(void*, int))api.toPointer)(L, LUAJIT_REGISTRYINDEX));
+    unsigned stamp = LuaHelperJitStamp();
+
+    if(!all && !LuaHelperUpdateJitStateStamp(registry, stamp))
+        return;
+
+    bool stepping = (stamp & 1) != 0;
+
+    // Lua functions are not called while the lock is held
+    int refs[64];
+    unsigned count = 0;
+
+    do
+    {
+        count = 0;
+
+        AcquireSRWLockExclusive(&luaHelperJitFunctionLock);
+
+        for(unsigned i = 0; i < LUA_HELPER_JIT_FUNCTION_COUNT && count < 64; i++)
+        {
+            auto &entry = luaHelperJitFunctions[i];
+
+            if(entry.id <= LUA_HELPER_JIT_FUNCTION_REMOVED || entry.registry != registry)
+                continue;
+
+            if(!all && (stepping || LuaHelperHasBreakpointsInLines(entry.source, entry.linedefined, entry.lastlinedefined)))
+                continue;
+
+            refs[count++] = entry.ref;
+
+            LuaHelperRemoveJitFunction(&entry);
+        }
+
+        ReleaseSRWLockExclusive(&luaHelperJitFunctionLock);
+
+        for(unsigned i = 0; i < count; i++)
+        {
+            ((void(*)(void*, int, int))api.rawGetI)(L, LUAJIT_REGISTRYINDEX, refs[i]);
+            ((int(*)(void*, int, int))api.setMode)(L, -1, LUAJIT_MODE_FUNC | LUAJIT_MODE_ON);
+            ((void(*)(void*, int))api.setTop)(L, -2);
+            ((void(*)(void*, int, int))api.unref)(L, LUAJIT_REGISTRYINDEX, refs[i]);
+        }
+    }
+    while(count == 64);
+}
+
+// Compiled traces don't call hooks, so functions with breakpoints in their lines (or the ones being stepped) are switched to the interpreter
+// Other functions keep their traces, and functions are switched back as soon as their Lua state runs after their breakpoints are removed
+static void LuaHelperLuajitUpdateFunctionMode(char *L, Luajit::lj_Debug *ar)
+{
+    auto &api = luaHelperLuajitFunctionMode;
+
+    if(!api.setMode)
+        return;
+
+    if(luaHelperJitFunctionCount != 0)
+        LuaHelperLuajitRestoreFunctions(L, false);
+
+    if(!ar->what || *ar->what == 'C')
+        return;
+
+    if(!LuaHelperHasBreakpointsInLines(ar->source, ar->linedefined, ar->lastlinedefined) && LuaHelperGetStepState(L) == nullptr)
+        return;
+
+    auto &last = luaHelperJitLastCheck;
+    unsigned stamp = LuaHelperJitStamp();
+
+    if(ar->event == LUA_HOOKLINE && last.L == L && last.source == ar->source && last.linedefined == ar->linedefined && last.lastlinedefined == ar->lastlinedefined && last.stamp == stamp)
+        return;
+
+    last = { L, ar->source, ar->linedefined, ar->lastlinedefined, stamp };
+
+    // Function is pushed on top of the stack to be selected by luaJIT_setmode
+    if(((int(*)(void*, const char*, void*))luaHelperLuajitGetInfoAddress)(L, "f", ar) != 1)
+        return;
+
+    uintptr_t id = LuaHelperLuajitFunctionId(L);
+    uintptr_t registry = uintptr_t(((const void*(*)(void*, int))api.toPointer)(L, LUAJIT_REGISTRYINDEX));
+
+    AcquireSRWLockExclusive(&luaHelperJitFunctionLock);
+
+    bool known = LuaHelperFindJitFunction(id, registry, false) != nullptr;
+
+    LuaHelperJitFunction *entry = known ? nullptr : LuaHelperFindJitFunction(id, registry, true);
+
+    if(entry)
+    {
+        entry->ref = -1; // LUA_NOREF until the reference is created
+        entry->source = ar->source;
+        entry->linedefined = ar->linedefined;
+        entry->lastlinedefined = ar->lastlinedefined;
+    }
+
+    ReleaseSRWLockExclusive(&luaHelperJitFunctionLock);
+
+    if(known)
+    {
+        ((void(*)(void*, int))api.setTop)(L, -2);
+        return;
+    }
+
+    // Disabling JIT compilation also flushes function traces
+    ((int(*)(void*, int, int))api.setMode)(L, -1, LUAJIT_MODE_FUNC | LUAJIT_MODE_OFF);
+
+    // Without space in the table, function stays in the interpreter
+    if(!entry)
+    {
+        ((void(*)(void*, int))api.setTop)(L, -2);
+        return;
+    }
+
+    // Reference pops the function, entries of this Lua state are only changed by the thread that runs it
+    int ref = ((int(*)(void*, int))api.ref)(L, LUAJIT_REGISTRYINDEX);
+
+    AcquireSRWLockExclusive(&luaHelperJitFunctionLock);
+
+    entry->ref = ref;
+
+    ReleaseSRWLockExclusive(&luaHelperJitFunctionLock);
+}
+
+// Hook of a Lua state is removed by the hook after its functions are switched back to JIT compilation
+static bool LuaHelperLuajitCheckHookRemoval(char *L)
+{
+    auto &api = luaHelperLuajitFunctionMode;
+
+    if(!luaHelperLuajitHookRemoval || !api.setMode || !api.setHook)
+        return false;
+
+    if(luaHelperJitFunctionCount != 0)
+        LuaHelperLuajitRestoreFunctions(L, true);
+
+    ((int(*)(void*, void*, int, int))api.setHook)(L, nullptr, 0, 0);
+
+    return true;
 }
 
 extern "C" __declspec(dllexport) void LuaHelperHook_luajit(char *L, Luajit::lj_Debug *ar)
 {
+    LUA_HELPER_HOOK_TIMER(ar->event);
+
+    if(LuaHelperLuajitCheckHookRemoval(L))
+        return;
+
+    if(ar->event == LUA_HOOKCOUNT)
+    {
+        // Source name string is owned by the function prototype, so its address identifies the chunk
+        if(luaHelperLuajitGetInfoAddress && ((int(*)(void*, const char*, void*))luaHelperLuajitGetInfoAddress)(L, "Sl", ar) == 1 && ar->currentline > 0)
+            LuaHelperProfileSample(uintptr_t(ar->source), unsigned(ar->currentline));
+
+        return;
+    }
+
     if(luaHelperLuajitGetInfoAddress && ((int(*)(void*, const char*, void*))luaHelperLuajitGetInfoAddress)(L, "Sln", ar) == 1)
     {
+        if(luaHelperTiming.enabled && ar->what && *ar->what != 'C')
+            LuaHelperTimingHook(ar->event, LuaHelperProfileKey(uintptr_t(ar->source), unsigned(ar->linedefined)));
+
+        LuaHelperStepState *step = luaHelperLuajitGetStackAddress && luaHelperStepOver ? LuaHelperGetStepState(L) : nullptr;
+
         // On a line event during step over action, check if we returned from some functions we don't know about
-        if(luaHelperLuajitGetStackAddress && luaHelperStepOver && ar->event == LUA_HOOKLINE && luaHelperStackDepthAtCall != 0)
+        if(step && ar->event == LUA_HOOKLINE && step->stackDepthAtCall != 0)
         {
-            unsigned currentDepth = LuaHelperMeasureStackDepth(L, ar);
+            unsigned currentDepth = LuaHelperMeasureStackDepth(L);
 
-            if(currentDepth < luaHelperStackDepthAtCall)
+            if(currentDepth < step->stackDepthAtCall)
             {
-                luaHelperSkipDepth = 0;
+                step->skipDepth = 0;
 
 #if defined(DEBUG_MODE)
-                printf("hook line is called at lower stack depth %u (recored at call as %u) (skip depth reset to 0)\n", currentDepth, luaHelperStackDepthAtCall);
+                printf("hook line is called at lower stack depth %u (recored at call as %u) (skip depth reset to 0)\n", currentDepth, step->stackDepthAtCall);
 #endif
 
-                luaHelperStackDepthAtCall = 0;
+                step->stackDepthAtCall = 0;
             }
         }
 
 #if defined(DEBUG_MODE)
-        LuaHelperDebugStepHook(ar->event, ar->currentline, ar->source);
+        LuaHelperDebugStepHook(L, ar->event, ar->currentline, ar->source);
 #else
-        LuaHelperStepHook(ar->event);
+        LuaHelperStepHook(L, ar->event);
 #endif
 
         // For the first call during step over action, measure the stack depth we are placed at
-        if(luaHelperLuajitGetStackAddress && luaHelperStepOver && ar->event == LUA_HOOKCALL && luaHelperStackDepthAtCall == 0)
+        if(step && ar->event == LUA_HOOKCALL && step->stackDepthAtCall == 0)
         {
-            luaHelperStackDepthAtCall = LuaHelperMeasureStackDepth(L, ar);
+            step->stackDepthAtCall = LuaHelperMeasureStackDepth(L);
 
 #if defined(DEBUG_MODE)
-            printf("   this call was measured at stack depth %u\n", luaHelperStackDepthAtCall);
+            printf("   this call was measured at stack depth %u\n", step->stackDepthAtCall);
 #endif
         }
 
-        LuaHelperBreakpointHook(L, ar->currentline, 0, ar->source);
+        if(ar->event == LUA_HOOKCALL || ar->event == LUA_HOOKLINE)
+            LuaHelperLuajitUpdateFunctionMode(L, ar);
+
+        LuaHelperBreakpointHook(L, ar->currentline, 0, ar->source, nullptr, nullptr);
     }
     else
     {
-        LuaHelperStepHook(ar->event);
+        LuaHelperStepHook(L, ar->event);
     }
 }
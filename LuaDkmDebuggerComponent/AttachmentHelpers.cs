@@ -19,6 +19,37 @@ namespace LuaDkmDebuggerComponent
 
         [DllImport("kernel32.dll", SetLastError = true)]
         internal static extern IntPtr LocalFree(IntPtr hMem);
+
+        [DllImport("kernel32.dll")]
+        internal static extern IntPtr GetCurrentProcess();
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        [return: MarshalAs(UnmanagedType.Bool)]
+        internal static extern bool DuplicateHandle(IntPtr hSourceProcessHandle, IntPtr hSourceHandle, IntPtr hTargetProcessHandle, out IntPtr lpTargetHandle, uint dwDesiredAccess, [MarshalAs(UnmanagedType.Bool)] bool bInheritHandle, uint dwOptions);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        [return: MarshalAs(UnmanagedType.Bool)]
+        internal static extern bool SetEvent(IntPtr hEvent);
+
+        [DllImport("kernel32.dll", SetLastError = true)]
+        [return: MarshalAs(UnmanagedType.Bool)]
+        internal static extern bool CloseHandle(IntPtr hObject);
+
+        internal static IntPtr DuplicateProcessHandle(int processId, ulong handle)
+        {
+            var processHandle = OpenProcess(0x0040, false, processId); // PROCESS_DUP_HANDLE
+
+            if (processHandle == IntPtr.Zero)
+                return IntPtr.Zero;
+
+            // DUPLICATE_SAME_ACCESS
+            if (!DuplicateHandle(processHandle, (IntPtr)(long)handle, GetCurrentProcess(), out IntPtr result, 0, false, 0x00000002))
+                result = IntPtr.Zero;
+
+            CloseHandle(processHandle);
+
+            return result;
+        }
     }
 
     internal class Advapi32
@@ -0,0 +1,557 @@
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+
+namespace LuaDkmDebuggerComponent
+{
+    // Must match LuaHelperPredicateOp constants in the helper library
+    public enum BreakpointPredicateCode : byte
+    {
+        Compare = 1,
+        And = 2,
+        Or = 3,
+        Not = 4,
+    }
+
+    public enum BreakpointPredicateCompare : byte
+    {
+        Equal = 0,
+        NotEqual = 1,
+        Less = 2,
+        LessEqual = 3,
+        Greater = 4,
+        GreaterEqual = 5,
+        Truthy = 6,
+    }
+
+    public enum BreakpointPredicateOperand : byte
+    {
+        None = 0,
+        Register = 1,
+        Upvalue = 2,
+    }
+
+    public enum BreakpointPredicateConstant : byte
+    {
+        Nil = 0,
+        False = 1,
+        True = 2,
+        Integer = 3,
+        Number = 4,
+    }
+
+    public class BreakpointPredicateOp
+    {
+        public BreakpointPredicateCode code;
+        public BreakpointPredicateCompare compare;
+        public BreakpointPredicateOperand operandKind;
+        public BreakpointPredicateConstant constantKind;
+        public int operandIndex;
+        public long constantInteger;
+        public double constantNumber;
+    }
+
+    // Value layout of the target Lua version that helper library needs to decode registers and upvalues
+    public class BreakpointPredicateLayout
+    {
+        public uint valueSize;
+        public uint valueOffset;
+        public uint tagOffset;
+        public uint tagMask;
+        public int nilTag;
+        public int falseTag;
+        public int trueTag;
+        public int integerTag = -1;
+        public int floatTag;
+        public bool booleanInPayload;
+        public uint upvalueArrayOffset;
+        public uint upvalueValueOffset;
+    }
+
+    // Compiles simple breakpoint conditions (variable compared with a constant, joined with 'and', 'or' and 'not') into a postfix program that helper library evaluates in-process
+    public class BreakpointPredicate
+    {
+        // Must match helper library evaluation stack size
+        public const int maxStackDepth = 16;
+
+        // Must match LuaHelperPredicateOp layout
+        public const int opSize = 24;
+
+        public delegate bool ResolveOperand(string name, out BreakpointPredicateOperand kind, out int index);
+
+        // What an operand or a subexpression leaves for the enclosing comparison
+        enum ValueKind
+        {
+            Variable, // Not emitted yet
+            Constant, // Not emitted yet
+            Boolean, // Emitted, result is true or false like in Lua
+            Truthy, // Emitted, result is the truthiness of a Lua value that might not be a boolean
+        }
+
+        public List<BreakpointPredicateOp> ops = new List<BreakpointPredicateOp>();
+
+        string expression;
+        int pos;
+        int depth;
+        int maxDepth;
+        ResolveOperand resolve;
+
+        // Returns null if the condition is too complex to be checked without the debugger
+        public static BreakpointPredicate Compile(string expression, ResolveOperand resolve)
+        {
+            if (expression == null || resolve == null)
+                return null;
+
+            var predicate = new BreakpointPredicate
+            {
+                expression = expression,
+                resolve = resolve
+            };
+
+            if (!predicate.ParseOr(out _))
+                return null;
+
+            predicate.SkipSpace();
+
+            if (predicate.pos != expression.Length)
+                return null;
+
+            if (predicate.maxDepth > maxStackDepth)
+                return null;
+
+            return predicate;
+        }
+
+        void SkipSpace()
+        {
+            while (pos < expression.Length && expression[pos] <= ' ')
+                pos++;
+        }
+
+        bool TryTakeToken(string token)
+        {
+            SkipSpace();
+
+            if (string.Compare(expression, pos, token, 0, token.Length) == 0)
+            {
+                pos += token.Length;
+                return true;
+            }
+
+            return false;
+        }
+
+        bool TryTakeNamedToken(string token)
+        {
+            SkipSpace();
+
+            if (string.Compare(expression, pos, token, 0, token.Length) == 0)
+            {
+                if (pos + token.Length < expression.Length && (char.IsLetterOrDigit(expression[pos + token.Length]) || expression[pos + token.Length] == '_'))
+                    return false;
+
+                pos += token.Length;
+                return true;
+            }
+
+            return false;
+        }
+
+        void Emit(BreakpointPredicateOp op)
+        {
+            ops.Add(op);
+
+            if (op.code == BreakpointPredicateCode.Compare)
+                depth++;
+            else if (op.code != BreakpointPredicateCode.Not)
+                depth--;
+
+            maxDepth = Math.Max(maxDepth, depth);
+        }
+
+        bool ParseOr(out ValueKind kind)
+        {
+            if (!ParseAnd(out kind))
+                return false;
+
+            while (TryTakeNamedToken("or"))
+            {
+                if (!ParseAnd(out ValueKind rhsKind))
+                    return false;
+
+                Emit(new BreakpointPredicateOp { code = BreakpointPredicateCode.Or });
+
+                kind = kind == ValueKind.Boolean && rhsKind == ValueKind.Boolean ? ValueKind.Boolean : ValueKind.Truthy;
+            }
+
+            return true;
+        }
+
+        bool ParseAnd(out ValueKind kind)
+        {
+            if (!ParseComparison(out kind))
+                return false;
+
+            while (TryTakeNamedToken("and"))
+            {
+                if (!ParseComparison(out ValueKind rhsKind))
+                    return false;
+
+                Emit(new BreakpointPredicateOp { code = BreakpointPredicateCode.And });
+
+                kind = kind == ValueKind.Boolean && rhsKind == ValueKind.Boolean ? ValueKind.Boolean : ValueKind.Truthy;
+            }
+
+            return true;
+        }
+
+        // Comparison binds looser than 'not', as in Lua 'not a == b' is '(not a) == b'
+        bool ParseComparison(out ValueKind kind)
+        {
+            kind = ValueKind.Truthy;
+
+            var lhs = new BreakpointPredicateOp { code = BreakpointPredicateCode.Compare };
+
+            if (!ParseOperand(lhs, out ValueKind lhsKind))
+                return false;
+
+            BreakpointPredicateCompare compare;
+
+            if (TryTakeToken("=="))
+                compare = BreakpointPredicateCompare.Equal;
+            else if (TryTakeToken("~="))
+                compare = BreakpointPredicateCompare.NotEqual;
+            else if (TryTakeToken("<="))
+                compare = BreakpointPredicateCompare.LessEqual;
+            else if (TryTakeToken(">="))
+                compare = BreakpointPredicateCompare.GreaterEqual;
+            else if (TryTakeToken("<"))
+                compare = BreakpointPredicateCompare.Less;
+            else if (TryTakeToken(">"))
+                compare = BreakpointPredicateCompare.Greater;
+            else
+                compare = BreakpointPredicateCompare.Truthy;
+
+            if (compare == BreakpointPredicateCompare.Truthy)
+            {
+                if (lhsKind == ValueKind.Constant)
+                    return false;
+
+                if (lhsKind == ValueKind.Variable)
+                {
+                    lhs.compare = compare;
+
+                    Emit(lhs);
+
+                    kind = ValueKind.Truthy;
+                    return true;
+                }
+
+                kind = lhsKind;
+                return true;
+            }
+
+            var rhs = new BreakpointPredicateOp { code = BreakpointPredicateCode.Compare };
+
+            if (!ParseOperand(rhs, out ValueKind rhsKind))
+                return false;
+
+            kind = ValueKind.Boolean;
+
+            if (lhsKind == ValueKind.Boolean && rhsKind == ValueKind.Constant)
+                return EmitBooleanComparison(compare, rhs);
+
+            if (lhsKind == ValueKind.Constant && rhsKind == ValueKind.Boolean)
+                return EmitBooleanComparison(compare, lhs);
+
+            // Only a variable against a constant is supported
+            if ((lhsKind != ValueKind.Variable || rhsKind != ValueKind.Constant) && (lhsKind != ValueKind.Constant || rhsKind != ValueKind.Variable))
+                return false;
+
+            bool lhsIsVariable = lhsKind == ValueKind.Variable;
+
+            var op = lhsIsVariable ? lhs : rhs;
+            var constant = lhsIsVariable ? rhs : lhs;
+
+            // Constant on the left side, mirror the comparison
+            if (!lhsIsVariable)
+            {
+                if (compare == BreakpointPredicateCompare.Less)
+                    compare = BreakpointPredicateCompare.Greater;
+                else if (compare == BreakpointPredicateCompare.LessEqual)
+                    compare = BreakpointPredicateCompare.GreaterEqual;
+                else if (compare == BreakpointPredicateCompare.Greater)
+                    compare = BreakpointPredicateCompare.Less;
+                else if (compare == BreakpointPredicateCompare.GreaterEqual)
+                    compare = BreakpointPredicateCompare.LessEqual;
+            }
+
+            // Ordering is only defined for numbers here
+            if (compare != BreakpointPredicateCompare.Equal && compare != BreakpointPredicateCompare.NotEqual)
+            {
+                if (constant.constantKind != BreakpointPredicateConstant.Integer && constant.constantKind != BreakpointPredicateConstant.Number)
+                    return false;
+            }
+
+            op.compare = compare;
+            op.constantKind = constant.constantKind;
+            op.constantInteger = constant.constantInteger;
+            op.constantNumber = constant.constantNumber;
+
+            Emit(op);
+            return true;
+        }
+
+        // Boolean that is already on the stack compared with a constant
+        bool EmitBooleanComparison(BreakpointPredicateCompare compare, BreakpointPredicateOp constant)
+        {
+            // Ordering of a boolean is an error in Lua
+            if (compare != BreakpointPredicateCompare.Equal && compare != BreakpointPredicateCompare.NotEqual)
+                return false;
+
+            // Comparison with nil or a number has a constant result, it's left to the debugger
+            if (constant.constantKind != BreakpointPredicateConstant.True && constant.constantKind != BreakpointPredicateConstant.False)
+                return false;
+
+            if ((constant.constantKind == BreakpointPredicateConstant.True) != (compare == BreakpointPredicateCompare.Equal))
+                Emit(new BreakpointPredicateOp { code = BreakpointPredicateCode.Not });
+
+            return true;
+        }
+
+        bool ParseOperand(BreakpointPredicateOp op, out ValueKind kind)
+        {
+            kind = ValueKind.Constant;
+
+            if (TryTakeNamedToken("not"))
+            {
+                var inner = new BreakpointPredicateOp { code = BreakpointPredicateCode.Compare };
+
+                if (!ParseOperand(inner, out ValueKind innerKind))
+                    return false;
+
+                if (innerKind == ValueKind.Constant)
+                    return false;
+
+                if (innerKind == ValueKind.Variable)
+                {
+                    inner.compare = BreakpointPredicateCompare.Truthy;
+
+                    Emit(inner);
+                }
+
+                Emit(new BreakpointPredicateOp { code = BreakpointPredicateCode.Not });
+
+                kind = ValueKind.Boolean;
+                return true;
+            }
+
+            if (TryTakeToken("("))
+            {
+                if (!ParseOr(out kind))
+                    return false;
+
+                return TryTakeToken(")");
+            }
+
+            if (!ParseTerm(op, out bool isVariable))
+                return false;
+
+            kind = isVariable ? ValueKind.Variable : ValueKind.Constant;
+            return true;
+        }
+
+        bool ParseTerm(BreakpointPredicateOp op, out bool isVariable)
+        {
+            isVariable = false;
+
+            SkipSpace();
+
+            if (TryTakeNamedToken("nil"))
+            {
+                op.constantKind = BreakpointPredicateConstant.Nil;
+                return true;
+            }
+
+            if (TryTakeNamedToken("false"))
+            {
+                op.constantKind = BreakpointPredicateConstant.False;
+                return true;
+            }
+
+            if (TryTakeNamedToken("true"))
+            {
+                op.constantKind = BreakpointPredicateConstant.True;
+                return true;
+            }
+
+            if (pos < expression.Length && (char.IsLetter(expression[pos]) || expression[pos] == '_'))
+            {
+                int start = pos;
+
+                while (pos < expression.Length && (char.IsLetterOrDigit(expression[pos]) || expression[pos] == '_'))
+                    pos++;
+
+                string name = expression.Substring(start, pos - start);
+
+                if (name == "and" || name == "or" || name == "not")
+                    return false;
+
+                // Member access, indexing and calls are left to the debugger
+                SkipSpace();
+
+                if (pos < expression.Length && (expression[pos] == '.' || expression[pos] == ':' || expression[pos] == '[' || expression[pos] == '(' || expression[pos] == '"' || expression[pos] == '\'' || expression[pos] == '{'))
+                    return false;
+
+                if (!resolve(name, out op.operandKind, out op.operandIndex))
+                    return false;
+
+                isVariable = true;
+                return true;
+            }
+
+            return ParseNumber(op);
+        }
+
+        bool ParseNumber(BreakpointPredicateOp op)
+        {
+            bool negative = TryTakeToken("-");
+
+            SkipSpace();
+
+            int start = pos;
+
+            if (pos + 1 < expression.Length && expression[pos] == '0' && (expression[pos + 1] == 'x' || expression[pos + 1] == 'X'))
+            {
+                pos += 2;
+
+                int digitStart = pos;
+
+                while (pos < expression.Length && Uri.IsHexDigit(expression[pos]))
+                    pos++;
+
+                if (pos == digitStart || pos - digitStart > 16)
+                    return false;
+
+                if (pos < expression.Length && (char.IsLetterOrDigit(expression[pos]) || expression[pos] == '.'))
+                    return false;
+
+                long value = (long)ulong.Parse(expression.Substring(digitStart, pos - digitStart), NumberStyles.AllowHexSpecifier, CultureInfo.InvariantCulture);
+
+                op.constantKind = BreakpointPredicateConstant.Integer;
+                op.constantInteger = negative ? -value : value;
+                op.constantNumber = op.constantInteger;
+                return true;
+            }
+
+            bool isFloat = false;
+
+            while (pos < expression.Length && char.IsDigit(expression[pos]))
+                pos++;
+
+            if (pos < expression.Length && expression[pos] == '.')
+            {
+                isFloat = true;
+                pos++;
+
+                while (pos < expression.Length && char.IsDigit(expression[pos]))
+                    pos++;
+            }
+
+            if (pos == start || (pos == start + 1 && isFloat))
+                return false;
+
+            if (pos < expression.Length && (expression[pos] == 'e' || expression[pos] == 'E'))
+            {
+                isFloat = true;
+                pos++;
+
+                if (pos < expression.Length && (expression[pos] == '+' || expression[pos] == '-'))
+                    pos++;
+
+                int exponentStart = pos;
+
+                while (pos < expression.Length && char.IsDigit(expression[pos]))
+                    pos++;
+
+                if (pos == exponentStart)
+                    return false;
+            }
+
+            if (pos < expression.Length && (char.IsLetterOrDigit(expression[pos]) || expression[pos] == '_'))
+                return false;
+
+            string text = expression.Substring(start, pos - start);
+
+            if (!isFloat && long.TryParse(text, NumberStyles.None, CultureInfo.InvariantCulture, out long integer))
+            {
+                op.constantKind = BreakpointPredicateConstant.Integer;
+                op.constantInteger = negative ? -integer : integer;
+                op.constantNumber = op.constantInteger;
+                return true;
+            }
+
+            if (!double.TryParse(text, NumberStyles.AllowDecimalPoint | NumberStyles.AllowExponent, CultureInfo.InvariantCulture, out double number))
+                return false;
+
+            op.constantKind = BreakpointPredicateConstant.Number;
+            op.constantNumber = negative ? -number : number;
+            return true;
+        }
+
+        // Must match LuaHelperBreakPredicate layout in the helper library
+        public static int GetHeaderSize(int pointerSize)
+        {
+            return (pointerSize + 14 * 4 + 7) & ~7;
+        }
+
+        public byte[] Encode(ulong proto, BreakpointPredicateLayout layout, int pointerSize)
+        {
+            int headerSize = GetHeaderSize(pointerSize);
+
+            byte[] data = new byte[headerSize + ops.Count * opSize];
+
+            if (pointerSize == 8)
+                Array.Copy(BitConverter.GetBytes(proto), 0, data, 0, 8);
+            else
+                Array.Copy(BitConverter.GetBytes((uint)proto), 0, data, 0, 4);
+
+            uint[] header = {
+                (uint)ops.Count,
+                0, // Reject count is updated by the helper library
+                layout.valueSize,
+                layout.valueOffset,
+                layout.tagOffset,
+                layout.tagMask,
+                (uint)layout.nilTag,
+                (uint)layout.falseTag,
+                (uint)layout.trueTag,
+                (uint)layout.integerTag,
+                (uint)layout.floatTag,
+                layout.booleanInPayload ? 1u : 0u,
+                layout.upvalueArrayOffset,
+                layout.upvalueValueOffset
+            };
+
+            for (int i = 0; i < header.Length; i++)
+                Array.Copy(BitConverter.GetBytes(header[i]), 0, data, pointerSize + i * 4, 4);
+
+            for (int i = 0; i < ops.Count; i++)
+            {
+                var op = ops[i];
+                int offset = headerSize + i * opSize;
+
+                data[offset + 0] = (byte)op.code;
+                data[offset + 1] = (byte)op.compare;
+                data[offset + 2] = (byte)op.operandKind;
+                data[offset + 3] = (byte)op.constantKind;
+
+                Array.Copy(BitConverter.GetBytes(op.operandIndex), 0, data, offset + 4, 4);
+                Array.Copy(BitConverter.GetBytes(op.constantInteger), 0, data, offset + 8, 8);
+                Array.Copy(BitConverter.GetBytes(op.constantNumber), 0, data, offset + 16, 8);
+            }
+
+            return data;
+        }
+    }
+}
@@ -1,6 +1,7 @@
 using Microsoft.VisualStudio.Debugger;
 using Microsoft.VisualStudio.Debugger.CallStack;
 using Microsoft.VisualStudio.Debugger.Evaluation;
+using System;
 using System.Collections.Generic;
 using System.Collections.ObjectModel;
 using System.Diagnostics;
@@ -83,6 +84,16 @@ namespace LuaDkmDebuggerComponent
             return (ulong)DebugHelpers.GetPointerSize(process) * 2 + 8;
         }
 
+        // Lua places the hash right after the GC header, LuaJIT places it before the length at the end of GCstr
+        internal static ulong GetStringHashOffset(DkmProcess process)
+        {
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                return GetStringDataOffset(process) - 8;
+
+            // Same in Lua 5.1, 5.2, 5.3 and 5.4
+            return (ulong)DebugHelpers.GetPointerSize(process) + 4;
+        }
+
         internal static ulong GetValueSize(DkmProcess process)
         {
             if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
@@ -128,6 +139,27 @@ namespace LuaDkmDebuggerComponent
             return 24u;
         }
 
+        // Offset of the 'next' field in a node, zero if unknown
+        internal static ulong GetNodeNextOffset(DkmProcess process)
+        {
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                return 2 * GetValueSize(process);
+
+            if (Schema.LuaNodeData.available)
+                return Schema.LuaNodeData.nextAddress_opt.GetValueOrDefault(0);
+
+            if (LuaHelpers.luaVersion == 501)
+                return DebugHelpers.Is64Bit(process) ? 32u : 28u;
+
+            if (LuaHelpers.luaVersion == 502)
+                return DebugHelpers.Is64Bit(process) ? 32u : 16u;
+
+            if (LuaHelpers.luaVersion == 503)
+                return 28u;
+
+            return 12u;
+        }
+
         internal static LuaExtendedType GetFloatNumberExtendedType()
         {
             if (LuaHelpers.luaVersion == 504)
@@ -177,6 +209,9 @@ namespace LuaDkmDebuggerComponent
             }
         }
 
+        // upvalue, proto, trace and cdata are not supported as values
+        static readonly LuaExtendedType[] ljTypeTagMapping = { LuaExtendedType.Nil, LuaExtendedType.Boolean, LuaExtendedType.BooleanTrue, LuaExtendedType.LightUserData, LuaExtendedType.ShortString, LuaExtendedType.Nil, LuaExtendedType.Thread, LuaExtendedType.Nil, LuaExtendedType.LuaFunction, LuaExtendedType.Nil, LuaExtendedType.Nil, LuaExtendedType.Table, LuaExtendedType.UserData };
+
         internal static int? ReadTypeTag(DkmProcess process, ulong address, out ulong tagAddress, out ulong valueAddress, BatchRead batch = null)
         {
             int? typeTag;
@@ -218,9 +253,6 @@ namespace LuaDkmDebuggerComponent
                         ljTypeTag = (~ljTypeTagEncoded.Value) & 0x1f;
                     }
 
-                    // upvalue, proto, trace and cdata are not supported as values
-                    LuaExtendedType[] ljTypeTagMapping = { LuaExtendedType.Nil, LuaExtendedType.Boolean, LuaExtendedType.BooleanTrue, LuaExtendedType.LightUserData, LuaExtendedType.ShortString, LuaExtendedType.Nil, LuaExtendedType.Thread, LuaExtendedType.Nil, LuaExtendedType.LuaFunction, LuaExtendedType.Nil, LuaExtendedType.Nil, LuaExtendedType.Table, LuaExtendedType.UserData };
-
                     if (ljTypeTag >= ljTypeTagMapping.Length)
                         return null;
 
@@ -1201,6 +1233,18 @@ namespace LuaDkmDebuggerComponent
 
         // Not interested in other data
 
+        public static ulong GetValueAddressOffset(DkmProcess process)
+        {
+            if (Schema.LuaUpvalueData.available)
+                return Schema.LuaUpvalueData.valueAddress.GetValueOrDefault(0);
+
+            // Lua 5.3 has no CommonHeader, in other versions the pointer follows it
+            if (LuaHelpers.luaVersion == 503)
+                return 0;
+
+            return (ulong)DebugHelpers.GetPointerSize(process);
+        }
+
         public void ReadFrom(DkmProcess process, ulong address)
         {
             if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
@@ -2173,6 +2217,22 @@ namespace LuaDkmDebuggerComponent
         }
     }
 
+    // String hash seeds of the global states seen in the process and the result of main position checks
+    public class LuaTableHashLookupData : DkmDataItem
+    {
+        public HashSet<ulong> globalStates = new HashSet<ulong>();
+        public List<uint> seeds = new List<uint>();
+
+        // Set when the hash stored in a string key found by the main position lookup matched the computed one, or when a lookup was refuted by the table contents
+        public bool? verified = null;
+
+        public void AddSeed(uint seed)
+        {
+            if (!seeds.Contains(seed))
+                seeds.Add(seed);
+        }
+    }
+
     public class LuaTableData
     {
         public byte flags_opt;
@@ -2195,6 +2255,27 @@ namespace LuaDkmDebuggerComponent
         protected List<LuaNodeData> nodeLazyElements;
         protected LuaTableData metaTable;
 
+        // Elements of large tables are decoded in windows around the requested index, only a limited number of windows is kept
+        public const int elementWindowSize = 256;
+        public const int maxElementWindows = 32;
+        public const int nodeScanChunkSize = 1024;
+
+        protected class ElementWindow
+        {
+            public BatchRead batch;
+            public List<LuaValueDataBase> arrayElements;
+            public List<LuaNodeData> nodeElements;
+            public long lastUse;
+        }
+
+        protected Dictionary<int, ElementWindow> arrayWindows;
+        protected Dictionary<int, ElementWindow> nodeWindows;
+        protected long windowUseCounter = 0;
+
+        // Large node arrays are scanned only up to the requested window, first slot to scan is kept for each window of used slots
+        protected List<int> nodeWindowStartSlots;
+        protected int nodeWindowCount = -1;
+
         public void ReadFrom(DkmProcess process, ulong address)
         {
             if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
@@ -2344,6 +2425,10 @@ namespace LuaDkmDebuggerComponent
 
         public int GetNodeElementCount(DkmProcess process)
         {
+            // Counting keys of a large table requires a scan of the whole node array, so the slot count is reported and unused slots are placed after the keys
+            if (!IsNodeElementCountExact())
+                return GetNodeArraySize();
+
             if (nodeLazyElements != null)
                 return nodeLazyElements.Count;
 
@@ -2358,6 +2443,236 @@ namespace LuaDkmDebuggerComponent
             return nodeLazyElements.Count;
         }
 
+        public bool IsNodeElementCountExact()
+        {
+            return GetNodeArraySize() <= elementWindowSize;
+        }
+
+        int GetNodeArraySize()
+        {
+            if (nodeDataAddress == 0)
+                return 0;
+
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                return ljNodeArraySize;
+
+            return 1 << nodeArraySizeLog2;
+        }
+
+        ElementWindow GetCachedWindow(Dictionary<int, ElementWindow> windows, int windowIndex)
+        {
+            if (windows.TryGetValue(windowIndex, out ElementWindow window))
+            {
+                window.lastUse = ++windowUseCounter;
+
+                return window;
+            }
+
+            return null;
+        }
+
+        void AddCachedWindow(Dictionary<int, ElementWindow> windows, int windowIndex, ElementWindow window)
+        {
+            if (windows.Count >= maxElementWindows)
+            {
+                int oldestIndex = 0;
+                long oldestUse = long.MaxValue;
+
+                foreach (var el in windows)
+                {
+                    if (el.Value.lastUse < oldestUse)
+                    {
+                        oldestIndex = el.Key;
+                        oldestUse = el.Value.lastUse;
+                    }
+                }
+
+                windows.Remove(oldestIndex);
+            }
+
+            window.lastUse = ++windowUseCounter;
+
+            windows.Add(windowIndex, window);
+        }
+
+        public LuaValueDataBase GetArrayElement(DkmProcess process, int index)
+        {
+            if (index < 0 || index >= GetArrayElementCount(process))
+                return null;
+
+            // Full data is already loaded, use it
+            if (arrayElements != null)
+                return arrayElements[index];
+
+            if (arraySize <= elementWindowSize)
+                return GetArrayElements(process)[index];
+
+            if (arrayWindows == null)
+                arrayWindows = new Dictionary<int, ElementWindow>();
+
+            int windowIndex = index / elementWindowSize;
+
+            var window = GetCachedWindow(arrayWindows, windowIndex);
+
+            if (window == null)
+            {
+                int start = windowIndex * elementWindowSize;
+                int count = arraySize - start < elementWindowSize ? arraySize - start : elementWindowSize;
+
+                ulong valueSize = LuaHelpers.GetValueSize(process);
+                ulong startAddress = arrayDataAddress + (ulong)start * valueSize;
+
+                window = new ElementWindow
+                {
+                    batch = BatchRead.Create(process, startAddress, count * (int)valueSize),
+                    arrayElements = new List<LuaValueDataBase>(count)
+                };
+
+                for (int i = 0; i < count; i++)
+                    window.arrayElements.Add(LuaHelpers.ReadValue(process, startAddress + (ulong)i * valueSize, window.batch));
+
+                AddCachedWindow(arrayWindows, windowIndex, window);
+            }
+
+            return window.arrayElements[index - windowIndex * elementWindowSize];
+        }
+
+        // Only key type tags are checked to find used node slots, nodes are read in chunks to stay within the batch size limit
+        List<int> ScanNodeSlots(DkmProcess process, int startSlot, int maxCount)
+        {
+            var slots = new List<int>(maxCount);
+
+            int nodeArraySize = GetNodeArraySize();
+            ulong nodeSize = LuaHelpers.GetNodeSize(process);
+
+            LuaNodeData node = new LuaNodeData();
+
+            for (int chunkStart = startSlot; chunkStart < nodeArraySize && slots.Count < maxCount; chunkStart += nodeScanChunkSize)
+            {
+                int chunkSize = nodeArraySize - chunkStart < nodeScanChunkSize ? nodeArraySize - chunkStart : nodeScanChunkSize;
+
+                ulong chunkAddress = nodeDataAddress + (ulong)chunkStart * nodeSize;
+
+                var batch = BatchRead.Create(process, chunkAddress, chunkSize * (int)nodeSize);
+
+                for (int i = 0; i < chunkSize && slots.Count < maxCount; i++)
+                {
+                    node.ReadFromMetaOnly(process, chunkAddress + (ulong)i * nodeSize, batch);
+
+                    if (LuaHelpers.GetBaseType(node.keyTypeTag.GetValueOrDefault(0)) != LuaBaseType.Nil)
+                        slots.Add(chunkStart + i);
+                }
+            }
+
+            return slots;
+        }
+
+        // Windows before the requested one are scanned once to find where it starts, windows past the last used slot are empty
+        ElementWindow LoadNodeWindow(DkmProcess process, int windowIndex)
+        {
+            if (nodeWindowStartSlots == null)
+                nodeWindowStartSlots = new List<int> { 0 };
+
+            if (nodeWindowCount != -1 && windowIndex >= nodeWindowCount)
+                return null;
+
+            int current = windowIndex < nodeWindowStartSlots.Count ? windowIndex : nodeWindowStartSlots.Count - 1;
+
+            while (true)
+            {
+                var slots = ScanNodeSlots(process, nodeWindowStartSlots[current], elementWindowSize);
+
+                if (slots.Count < elementWindowSize)
+                    nodeWindowCount = current + 1;
+                else if (current + 1 == nodeWindowStartSlots.Count)
+                    nodeWindowStartSlots.Add(slots[slots.Count - 1] + 1);
+
+                if (current == windowIndex)
+                    return CreateNodeWindow(process, slots);
+
+                if (slots.Count < elementWindowSize)
+                    return null;
+
+                current++;
+            }
+        }
+
+        ElementWindow CreateNodeWindow(DkmProcess process, List<int> slots)
+        {
+            var window = new ElementWindow
+            {
+                nodeElements = new List<LuaNodeData>(slots.Count)
+            };
+
+            if (slots.Count == 0)
+                return window;
+
+            ulong nodeSize = LuaHelpers.GetNodeSize(process);
+
+            int firstSlot = slots[0];
+            int lastSlot = slots[slots.Count - 1];
+
+            long windowBytes = (long)(lastSlot - firstSlot + 1) * (long)nodeSize;
+
+            window.batch = windowBytes <= int.MaxValue ? BatchRead.Create(process, nodeDataAddress + (ulong)firstSlot * nodeSize, (int)windowBytes) : null;
+
+            foreach (var slot in slots)
+            {
+                LuaNodeData node = new LuaNodeData();
+
+                node.ReadFromMetaOnly(process, nodeDataAddress + (ulong)slot * nodeSize, window.batch);
+
+                window.nodeElements.Add(node);
+            }
+
+            return window;
+        }
+
+        public LuaNodeData GetNodeLazyElement(DkmProcess process, int index, out BatchRead batch)
+        {
+            batch = batchNodeElementData;
+
+            // Loaded data is available, use it
+            var loadedElements = nodeLazyElements ?? nodeKeys ?? nodeElements;
+
+            if (loadedElements == null && !IsNodeElementCountExact())
+            {
+                if (index < 0)
+                    return null;
+
+                if (nodeWindows == null)
+                    nodeWindows = new Dictionary<int, ElementWindow>();
+
+                int windowIndex = index / elementWindowSize;
+
+                var window = GetCachedWindow(nodeWindows, windowIndex);
+
+                if (window == null)
+                {
+                    window = LoadNodeWindow(process, windowIndex);
+
+                    if (window == null)
+                        return null;
+
+                    AddCachedWindow(nodeWindows, windowIndex, window);
+                }
+
+                batch = window.batch;
+
+                int position = index - windowIndex * elementWindowSize;
+
+                return position < window.nodeElements.Count ? window.nodeElements[position] : null;
+            }
+
+            if (loadedElements == null)
+                loadedElements = GetNodeLazyElements(process);
+
+            if (index < 0 || index >= loadedElements.Count)
+                return null;
+
+            return loadedElements[index];
+        }
+
         public List<LuaNodeData> GetNodeElements(DkmProcess process)
         {
             LoadNodeElements(process);
@@ -2515,21 +2830,345 @@ namespace LuaDkmDebuggerComponent
 
         public LuaValueDataBase FetchMember(DkmProcess process, string name)
         {
+            return FetchElement(process, new LuaValueDataString(name));
+        }
+
+        public LuaValueDataBase FetchElement(DkmProcess process, LuaValueDataBase key)
+        {
+            var hashLookupData = DebugHelpers.GetOrCreateDataItem<LuaTableHashLookupData>(process);
+
+            if (TryFetchHashedElement(process, hashLookupData, key, out LuaValueDataBase value, out bool hashed))
+                return value;
+
             LoadNodeKeys(process);
 
             foreach (var element in nodeKeys)
             {
-                var keyAsString = element.LoadKey(process, batchNodeElementData) as LuaValueDataString;
+                var elementKey = element.LoadKey(process, batchNodeElementData);
 
-                if (keyAsString == null)
+                if (elementKey == null || elementKey.GetType() != key.GetType())
                     continue;
 
-                if (keyAsString.value == name)
+                if (elementKey.LuaCompare(key))
+                {
+                    // Key exists, but main position lookup didn't find it
+                    if (hashed && key is LuaValueDataString)
+                        hashLookupData.verified = false;
+
                     return element.LoadValue(process, batchNodeElementData);
+                }
             }
 
             return null;
         }
+
+        // Key is searched starting from the main position computed in the same way as the Lua library does it, following the collision chain
+        // Returns false if the key wasn't found and the result is not reliable enough to skip a full scan
+        bool TryFetchHashedElement(DkmProcess process, LuaTableHashLookupData hashLookupData, LuaValueDataBase key, out LuaValueDataBase value, out bool hashed)
+        {
+            value = null;
+            hashed = false;
+
+            if (nodeDataAddress == 0)
+                return false;
+
+            ulong nextOffset = LuaHelpers.GetNodeNextOffset(process);
+
+            if (nextOffset == 0)
+                return false;
+
+            bool isString = key is LuaValueDataString;
+
+            if (isString && hashLookupData.verified == false)
+                return false;
+
+            var mainPositions = GetMainPositions(hashLookupData, key);
+
+            if (mainPositions.Count == 0)
+                return false;
+
+            hashed = true;
+
+            foreach (var mainPosition in mainPositions)
+            {
+                if (FindInNodeChain(process, mainPosition, nextOffset, key, out value, out LuaValueDataBase nodeKey))
+                {
+                    // In small tables every start position reaches the key, so only a matching stored hash confirms the computation
+                    if (isString && hashLookupData.verified == null)
+                        hashLookupData.verified = VerifyStringHash(process, hashLookupData, nodeKey as LuaValueDataString);
+
+                    return true;
+                }
+            }
+
+            // Number key main position depends on the minor Lua version and number representation, so only missing string keys are trusted
+            return isString && hashLookupData.verified == true;
+        }
+
+        bool? VerifyStringHash(DkmProcess process, LuaTableHashLookupData hashLookupData, LuaValueDataString nodeKey)
+        {
+            if (nodeKey == null || nodeKey.targetAddress == 0)
+                return null;
+
+            uint? storedHash = DebugHelpers.ReadUintVariable(process, nodeKey.targetAddress - LuaHelpers.GetStringDataOffset(process) + LuaHelpers.GetStringHashOffset(process));
+
+            if (!storedHash.HasValue)
+                return null;
+
+            return GetStringHashes(hashLookupData, nodeKey.value).Contains(storedHash.Value);
+        }
+
+        bool FindInNodeChain(DkmProcess process, int mainPosition, ulong nextOffset, LuaValueDataBase key, out LuaValueDataBase value, out LuaValueDataBase nodeKey)
+        {
+            value = null;
+            nodeKey = null;
+
+            ulong nodeSize = LuaHelpers.GetNodeSize(process);
+            ulong nodeAddress = nodeDataAddress + (ulong)mainPosition * nodeSize;
+
+            int nodeArraySize = GetNodeArraySize();
+
+            // Chain can't be longer than the node array, this protects from loops in damaged tables
+            for (int i = 0; i < nodeArraySize && nodeAddress != 0; i++)
+            {
+                var batch = BatchRead.Create(process, nodeAddress, (int)nodeSize);
+
+                if (batch == null)
+                    return false;
+
+                LuaNodeData node = new LuaNodeData();
+
+                node.ReadFromMetaOnly(process, nodeAddress, batch);
+
+                if (LuaHelpers.GetBaseType(node.keyTypeTag.GetValueOrDefault(0)) == key.baseType)
+                {
+                    var currentKey = node.LoadKey(process, batch);
+
+                    if (currentKey != null && currentKey.GetType() == key.GetType() && currentKey.LuaCompare(key))
+                    {
+                        nodeKey = currentKey;
+                        value = node.LoadValue(process, batch);
+                        return true;
+                    }
+                }
+
+                ulong? nextAddress = ReadNodeNext(process, nodeAddress, nextOffset, batch);
+
+                if (!nextAddress.HasValue)
+                    return false;
+
+                nodeAddress = nextAddress.Value;
+            }
+
+            return false;
+        }
+
+        ulong? ReadNodeNext(DkmProcess process, ulong nodeAddress, ulong nextOffset, BatchRead batch)
+        {
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                return LuajitHelpers.ReadMrefVariable(process, nodeAddress + nextOffset, batch);
+
+            // Lua 5.3 and 5.4 store the node index offset to the next node
+            if (LuaHelpers.luaVersion == 503 || LuaHelpers.luaVersion == 504)
+            {
+                int? offset = DebugHelpers.ReadIntVariable(process, nodeAddress + nextOffset, batch);
+
+                if (!offset.HasValue)
+                    return null;
+
+                if (offset.Value == 0)
+                    return 0;
+
+                return nodeAddress + (ulong)((long)offset.Value * (long)LuaHelpers.GetNodeSize(process));
+            }
+
+            return DebugHelpers.ReadPointerVariable(process, nodeAddress + nextOffset, batch);
+        }
+
+        List<int> GetMainPositions(LuaTableHashLookupData hashLookupData, LuaValueDataBase key)
+        {
+            var mainPositions = new List<int>();
+
+            int nodeArraySize = GetNodeArraySize();
+
+            if (nodeArraySize <= 0)
+                return mainPositions;
+
+            uint mask = (uint)nodeArraySize - 1;
+            uint modulo = ((uint)nodeArraySize - 1) | 1;
+
+            if (key is LuaValueDataString keyAsString)
+            {
+                foreach (var hash in GetStringHashes(hashLookupData, keyAsString.value))
+                    mainPositions.Add((int)(hash & mask));
+            }
+            else if (key is LuaValueDataNumber keyAsNumber)
+            {
+                double number = keyAsNumber.value;
+
+                if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                {
+                    long bits = BitConverter.DoubleToInt64Bits(number);
+
+                    uint lo = (uint)bits;
+                    uint hi = (uint)(bits >> 32) << 1;
+
+                    lo ^= hi;
+                    hi = RotateLeft(hi, 14);
+                    lo -= hi;
+                    hi = RotateLeft(hi, 5);
+                    hi ^= lo;
+                    hi -= RotateLeft(lo, 13);
+
+                    mainPositions.Add((int)(hi & mask));
+                }
+                else if (LuaHelpers.luaVersion == 501)
+                {
+                    if (number == 0)
+                    {
+                        mainPositions.Add(0);
+                    }
+                    else
+                    {
+                        long bits = BitConverter.DoubleToInt64Bits(number + 1);
+
+                        mainPositions.Add((int)(((uint)bits + (uint)(bits >> 32)) % modulo));
+                    }
+                }
+                else if (LuaHelpers.luaVersion == 503 || LuaHelpers.luaVersion == 504)
+                {
+                    // Floats with an integer value are stored as integer keys
+                    if (number == Math.Floor(number) && number >= -9223372036854775808.0 && number < 9223372036854775808.0)
+                    {
+                        ulong integer = (ulong)(long)number;
+
+                        // Lua 5.4.3 switched from a power of 2 mask to a modulo
+                        if (LuaHelpers.luaVersion == 504)
+                            mainPositions.Add((int)(integer % modulo));
+
+                        mainPositions.Add((int)(integer & mask));
+                    }
+                    else
+                    {
+                        mainPositions.Add((int)((uint)GetLuaFloatHash(number) % modulo));
+                    }
+                }
+            }
+
+            return mainPositions;
+        }
+
+        List<uint> GetStringHashes(LuaTableHashLookupData hashLookupData, string value)
+        {
+            var hashes = new List<uint>();
+
+            byte[] str = Encoding.UTF8.GetBytes(value);
+
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+            {
+                hashes.Add(GetLuajitStringHash(str));
+            }
+            else if (LuaHelpers.luaVersion == 501)
+            {
+                hashes.Add(GetLuaStringHash(str, 0, false));
+            }
+            else
+            {
+                // Each global state has its own seed
+                foreach (var seed in hashLookupData.seeds)
+                    hashes.Add(GetLuaStringHash(str, seed, LuaHelpers.luaVersion == 504));
+            }
+
+            return hashes;
+        }
+
+        static uint RotateLeft(uint value, int bits)
+        {
+            return (value << bits) | (value >> (32 - bits));
+        }
+
+        // luaS_hash, Lua 5.4 hashes every character, previous versions skip characters in long strings
+        static uint GetLuaStringHash(byte[] str, uint seed, bool hashAllCharacters)
+        {
+            uint h = seed ^ (uint)str.Length;
+            int step = hashAllCharacters ? 1 : (str.Length >> 5) + 1;
+
+            for (int l = str.Length; l >= step; l -= step)
+                h ^= (h << 5) + (h >> 2) + str[l - 1];
+
+            return h;
+        }
+
+        // lj_str_new hash
+        static uint GetLuajitStringHash(byte[] str)
+        {
+            int len = str.Length;
+
+            if (len == 0)
+                return 0;
+
+            uint a, b, h = (uint)len;
+
+            if (len >= 4)
+            {
+                a = BitConverter.ToUInt32(str, 0);
+                h ^= BitConverter.ToUInt32(str, len - 4);
+                b = BitConverter.ToUInt32(str, (len >> 1) - 2);
+                h ^= b;
+                h -= RotateLeft(b, 14);
+                b += BitConverter.ToUInt32(str, (len >> 2) - 1);
+            }
+            else
+            {
+                a = str[0];
+                h ^= str[len - 1];
+                b = str[len >> 1];
+                h ^= b;
+                h -= RotateLeft(b, 14);
+            }
+
+            a ^= h;
+            a -= RotateLeft(h, 11);
+            b ^= a;
+            b -= RotateLeft(a, 25);
+            h ^= b;
+            h -= RotateLeft(b, 16);
+
+            return h;
+        }
+
+        // l_hashfloat from Lua 5.3 and 5.4
+        static int GetLuaFloatHash(double number)
+        {
+            if (double.IsNaN(number) || double.IsInfinity(number))
+                return 0;
+
+            int exponent = 0;
+
+            if (number != 0)
+            {
+                long bits = BitConverter.DoubleToInt64Bits(number);
+                int rawExponent = (int)((bits >> 52) & 0x7ff);
+
+                // Normalize subnormal numbers
+                if (rawExponent == 0)
+                {
+                    bits = BitConverter.DoubleToInt64Bits(number * 18014398509481984.0);
+                    rawExponent = (int)((bits >> 52) & 0x7ff) - 54;
+                }
+
+                exponent = rawExponent - 1022;
+
+                // Mantissa in [0.5, 1) range as returned by frexp
+                number = BitConverter.Int64BitsToDouble((bits & ~(0x7ffL << 52)) | (1022L << 52));
+            }
+
+            long integer = (long)(number * 2147483648.0);
+
+            uint u = (uint)exponent + (uint)integer;
+
+            return (int)(u <= int.MaxValue ? u : ~u);
+        }
     }
 
     public class LuaClosureData
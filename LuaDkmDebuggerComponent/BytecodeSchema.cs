@@ -370,6 +370,8 @@ namespace LuaDkmDebuggerComponent
             public static ulong? keyDataTypeAddress_5_4;
             public static ulong? keyDataValueAddress_5_4;
 
+            public static ulong? nextAddress_opt;
+
             public static void LoadSchema(DkmInspectionSession inspectionSession, DkmThread thread, DkmStackWalkFrame frame)
             {
                 available = true;
@@ -389,6 +391,11 @@ namespace LuaDkmDebuggerComponent
                 else
                     keyDataAddress_5_123 = null;
 
+                if (keyDataAddress_5_123.HasValue)
+                    nextAddress_opt = Helper.ReadOptional(inspectionSession, thread, frame, "Node", "i_key.nk.next", "used in table key lookup", ref optional);
+                else
+                    nextAddress_opt = Helper.ReadOptional(inspectionSession, thread, frame, "Node", "u.next", "used in table key lookup", ref optional);
+
                 if (Log.instance != null)
                     Log.instance.Debug($"LuaNodeData schema {(available ? "available" : "not available")} with {success} successes and {failure} failures and {optional} optional");
             }
@@ -535,6 +542,7 @@ namespace LuaDkmDebuggerComponent
 
             public static ulong? globalStateAddress_opt;
             public static ulong? callInfoAddress;
+            public static ulong? topAddress_opt;
             public static ulong? savedProgramCounterAddress_5_1_opt;
             public static ulong? baseCallInfoAddress_5_1;
 
@@ -549,6 +557,7 @@ namespace LuaDkmDebuggerComponent
 
                 globalStateAddress_opt = Helper.ReadOptional(inspectionSession, thread, frame, "lua_State", "l_G", "used in Locals Window", ref optional);
                 callInfoAddress = Helper.Read(inspectionSession, thread, frame, "lua_State", "ci", ref available, ref success, ref failure);
+                topAddress_opt = Helper.ReadOptional(inspectionSession, thread, frame, "lua_State", "top", "used in tracepoints", ref optional);
                 savedProgramCounterAddress_5_1_opt = Helper.ReadOptional(inspectionSession, thread, frame, "lua_State", "savedpc", "used in 5.1 (*)", ref optional);
                 baseCallInfoAddress_5_1 = Helper.ReadOptional(inspectionSession, thread, frame, "lua_State", "base_ci", "used in 5.1", ref optional);
 
@@ -617,6 +626,7 @@ namespace LuaDkmDebuggerComponent
             public static long luaStateSize = 0;
 
             public static ulong? upvalueDataOffset;
+            public static ulong? closurePcOffset;
 
             public static bool fullPointer = false;
 
@@ -636,6 +646,7 @@ namespace LuaDkmDebuggerComponent
 
                 int optional = 0;
                 upvalueDataOffset = Helper.ReadOptional(inspectionSession, thread, frame, "GCupval", "v", "used in LuaJIT", ref optional);
+                closurePcOffset = Helper.ReadOptional(inspectionSession, thread, frame, "GCfuncL", "pc", "used in LuaJIT", ref optional);
 
                 fullPointer = mrefSize == 8 && gcrefSize == 8;
             }
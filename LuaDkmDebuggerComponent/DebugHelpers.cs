@@ -1,4 +1,5 @@
 using System;
+using System.Collections.Generic;
 using Microsoft.VisualStudio.Debugger;
 using Microsoft.VisualStudio.Debugger.DefaultPort;
 using Microsoft.VisualStudio.Debugger.Native;
@@ -50,6 +51,194 @@ namespace LuaDkmDebuggerComponent
             Array.Copy(data, (int)(target - address), result, 0, length);
             return true;
         }
+
+        // Provides the batch buffer and the offset of the target inside it, values are decoded in place without a copy
+        public bool TryGetData(ulong target, int length, out byte[] result, out int offset)
+        {
+            result = null;
+            offset = 0;
+
+            if (target < address)
+                return false;
+
+            if (target + (ulong)length > address + (ulong)data.Length)
+                return false;
+
+            result = data;
+            offset = (int)(target - address);
+            return true;
+        }
+    }
+
+    // Target memory is read in whole pages while the process is stopped, pages are dropped when it continues or when memory is written
+    public class ProcessMemoryCache : DkmDataItem
+    {
+        const int pageSize = 4096;
+        const int maxPages = 4096;
+
+        Dictionary<ulong, byte[]> pages = new Dictionary<ulong, byte[]>();
+
+        int activeStops = 0;
+
+        public long hits = 0;
+        public long misses = 0;
+
+        public double HitRate => hits + misses != 0 ? hits * 100.0 / (hits + misses) : 0.0;
+
+        public void BeginStop()
+        {
+            lock (pages)
+            {
+                // Nested stops (messages handled during a pause) keep the pages of the outer stop
+                if (activeStops++ == 0)
+                    pages.Clear();
+            }
+        }
+
+        public void EndStop()
+        {
+            lock (pages)
+            {
+                if (activeStops == 0)
+                    return;
+
+                if (--activeStops == 0)
+                    pages.Clear();
+            }
+        }
+
+        public void Invalidate()
+        {
+            lock (pages)
+            {
+                pages.Clear();
+            }
+        }
+
+        byte[] FetchPage(DkmProcess process, ulong pageAddress)
+        {
+            if (pages.TryGetValue(pageAddress, out byte[] page))
+            {
+                hits++;
+
+                return page;
+            }
+
+            misses++;
+
+            page = new byte[pageSize];
+
+            try
+            {
+                if (process.ReadMemory(pageAddress, DkmReadMemoryFlags.None, page) == 0)
+                    page = null;
+            }
+            catch (DkmException)
+            {
+                page = null;
+            }
+
+            if (pages.Count >= maxPages)
+                pages.Clear();
+
+            // Unreadable pages are remembered as well
+            pages.Add(pageAddress, page);
+
+            return page;
+        }
+
+        public bool TryRead(DkmProcess process, ulong address, byte[] result)
+        {
+            lock (pages)
+            {
+                if (activeStops == 0)
+                    return false;
+
+                int offset = 0;
+
+                while (offset < result.Length)
+                {
+                    ulong current = address + (ulong)offset;
+                    ulong pageAddress = current & ~(ulong)(pageSize - 1);
+
+                    byte[] page = FetchPage(process, pageAddress);
+
+                    if (page == null)
+                        return false;
+
+                    int pageOffset = (int)(current - pageAddress);
+                    int length = Math.Min(pageSize - pageOffset, result.Length - offset);
+
+                    Array.Copy(page, pageOffset, result, offset, length);
+
+                    offset += length;
+                }
+
+                return true;
+            }
+        }
+
+        // Provides the cached page and the offset of the address inside it when the value doesn't cross a page boundary
+        public bool TryGetData(DkmProcess process, ulong address, int length, out byte[] result, out int offset)
+        {
+            result = null;
+            offset = 0;
+
+            lock (pages)
+            {
+                if (activeStops == 0)
+                    return false;
+
+                ulong pageAddress = address & ~(ulong)(pageSize - 1);
+                int pageOffset = (int)(address - pageAddress);
+
+                if (pageOffset + length > pageSize)
+                    return false;
+
+                byte[] page = FetchPage(process, pageAddress);
+
+                if (page == null)
+                    return false;
+
+                // Page arrays are never modified after they are read, so the reference can be used outside the lock
+                result = page;
+                offset = pageOffset;
+                return true;
+            }
+        }
+
+        // Result includes the terminating zero if it was found within the limit
+        public byte[] TryReadString(DkmProcess process, ulong address, int limit)
+        {
+            lock (pages)
+            {
+                if (activeStops == 0)
+                    return null;
+
+                var result = new List<byte>();
+
+                while (result.Count < limit)
+                {
+                    ulong current = address + (ulong)result.Count;
+                    ulong pageAddress = current & ~(ulong)(pageSize - 1);
+
+                    byte[] page = FetchPage(process, pageAddress);
+
+                    if (page == null)
+                        return null;
+
+                    for (int i = (int)(current - pageAddress); i < pageSize && result.Count < limit; i++)
+                    {
+                        result.Add(page[i]);
+
+                        if (page[i] == 0)
+                            return result.ToArray();
+                    }
+                }
+
+                return result.ToArray();
+            }
+        }
     }
 
     static class DebugHelpers
@@ -81,6 +270,36 @@ namespace LuaDkmDebuggerComponent
             return 0;
         }
 
+        internal static bool ReadMemory(DkmProcess process, ulong address, byte[] data)
+        {
+            var cache = process.GetDataItem<ProcessMemoryCache>();
+
+            if (cache != null && cache.TryRead(process, address, data))
+                return true;
+
+            return process.ReadMemory(address, DkmReadMemoryFlags.None, data) != 0;
+        }
+
+        internal static bool TryGetReadData(DkmProcess process, ulong address, int length, BatchRead batch, out byte[] data, out int offset)
+        {
+            if (batch != null && batch.TryGetData(address, length, out data, out offset))
+                return true;
+
+            var cache = process.GetDataItem<ProcessMemoryCache>();
+
+            if (cache != null && cache.TryGetData(process, address, length, out data, out offset))
+                return true;
+
+            data = null;
+            offset = 0;
+            return false;
+        }
+
+        internal static void InvalidateMemoryCache(DkmProcess process)
+        {
+            process.GetDataItem<ProcessMemoryCache>()?.Invalidate();
+        }
+
         internal static bool Is64Bit(DkmProcess process)
         {
             return (process.SystemInformation.Flags & DkmSystemInformationFlags.Is64Bit) != 0;
@@ -93,13 +312,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static byte? ReadByteVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 1, batch, out byte[] data, out int offset))
+                return data[offset];
+
             byte[] variableAddressData = new byte[1];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -112,13 +332,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static short? ReadShortVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 2, batch, out byte[] data, out int offset))
+                return BitConverter.ToInt16(data, offset);
+
             byte[] variableAddressData = new byte[2];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -131,13 +352,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static int? ReadIntVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 4, batch, out byte[] data, out int offset))
+                return BitConverter.ToInt32(data, offset);
+
             byte[] variableAddressData = new byte[4];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -150,13 +372,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static uint? ReadUintVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 4, batch, out byte[] data, out int offset))
+                return BitConverter.ToUInt32(data, offset);
+
             byte[] variableAddressData = new byte[4];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -169,13 +392,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static long? ReadLongVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 8, batch, out byte[] data, out int offset))
+                return BitConverter.ToInt64(data, offset);
+
             byte[] variableAddressData = new byte[8];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -188,13 +412,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static ulong? ReadUlongVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 8, batch, out byte[] data, out int offset))
+                return BitConverter.ToUInt64(data, offset);
+
             byte[] variableAddressData = new byte[8];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -207,13 +432,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static float? ReadFloatVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 4, batch, out byte[] data, out int offset))
+                return BitConverter.ToSingle(data, offset);
+
             byte[] variableAddressData = new byte[4];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -226,13 +452,14 @@ namespace LuaDkmDebuggerComponent
 
         internal static double? ReadDoubleVariable(DkmProcess process, ulong address, BatchRead batch = null)
         {
+            if (TryGetReadData(process, address, 8, batch, out byte[] data, out int offset))
+                return BitConverter.ToDouble(data, offset);
+
             byte[] variableAddressData = new byte[8];
 
             try
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                if (!ReadMemory(process, address, variableAddressData))
                     return null;
             }
             catch (DkmException)
@@ -268,7 +495,10 @@ namespace LuaDkmDebuggerComponent
         {
             try
             {
-                byte[] nameData = process.ReadMemoryString(address, DkmReadMemoryFlags.AllowPartialRead, 1, limit);
+                byte[] nameData = process.GetDataItem<ProcessMemoryCache>()?.TryReadString(process, address, limit);
+
+                if (nameData == null)
+                    nameData = process.ReadMemoryString(address, DkmReadMemoryFlags.AllowPartialRead, 1, limit);
 
                 if (nameData != null && nameData.Length != 0)
                     return System.Text.Encoding.UTF8.GetString(nameData, 0, nameData.Length - 1);
@@ -303,23 +533,25 @@ namespace LuaDkmDebuggerComponent
 
         internal static ulong? ReadUleb128Variable(DkmProcess process, ulong address, out ulong length, BatchRead batch = null)
         {
-            byte[] variableAddressData = new byte[8];
-
             length = 0;
 
-            try
+            if (!TryGetReadData(process, address, 8, batch, out byte[] variableAddressData, out int pos))
             {
-                if (batch != null && batch.TryRead(address, variableAddressData.Length, out byte[] batchData))
-                    variableAddressData = batchData;
-                else if (process.ReadMemory(address, DkmReadMemoryFlags.None, variableAddressData) == 0)
+                variableAddressData = new byte[8];
+                pos = 0;
+
+                try
+                {
+                    if (!ReadMemory(process, address, variableAddressData))
+                        return null;
+                }
+                catch (DkmException)
+                {
                     return null;
-            }
-            catch (DkmException)
-            {
-                return null;
+                }
             }
 
-            ulong pos = 0;
+            int start = pos;
             ulong v = variableAddressData[pos++];
 
             if (v >= 0x80)
@@ -335,12 +567,14 @@ namespace LuaDkmDebuggerComponent
                 while (variableAddressData[pos++] >= 0x80);
             }
 
-            length = pos;
+            length = (ulong)(pos - start);
             return v;
         }
 
         internal static bool TryWriteRawBytes(DkmProcess process, ulong address, byte[] value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, value);
@@ -355,6 +589,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteByteVariable(DkmProcess process, ulong address, byte value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, new byte[1] { value });
@@ -369,6 +605,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteShortVariable(DkmProcess process, ulong address, short value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -383,6 +621,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteIntVariable(DkmProcess process, ulong address, int value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -397,6 +637,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteUintVariable(DkmProcess process, ulong address, uint value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -411,6 +653,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteLongVariable(DkmProcess process, ulong address, long value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -425,6 +669,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteUlongVariable(DkmProcess process, ulong address, ulong value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -439,6 +685,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteFloatVariable(DkmProcess process, ulong address, float value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -453,6 +701,8 @@ namespace LuaDkmDebuggerComponent
 
         internal static bool TryWriteDoubleVariable(DkmProcess process, ulong address, double value)
         {
+            InvalidateMemoryCache(process);
+
             try
             {
                 process.WriteMemory(address, BitConverter.GetBytes(value));
@@ -40,6 +40,10 @@ namespace LuaDkmDebuggerComponent
 
                 workList.Execute();
 
+                // Function evaluation can change target memory
+                if ((flags & DkmEvaluationFlags.NoSideEffects) == 0)
+                    DebugHelpers.InvalidateMemoryCache(inspectionSession.Process);
+
                 return result;
             }
             catch (OperationCanceledException)
@@ -91,6 +95,10 @@ namespace LuaDkmDebuggerComponent
 
                 workList.Execute();
 
+                // Function evaluation can change target memory
+                if ((flags & DkmEvaluationFlags.NoSideEffects) == 0)
+                    DebugHelpers.InvalidateMemoryCache(inspectionSession.Process);
+
                 if (Log.instance != null)
                     Log.instance.Verbose($"ExecuteExpression completed");
 
@@ -227,14 +235,16 @@ namespace LuaDkmDebuggerComponent
                 var arrayElementCount = value.value.GetArrayElementCount(process);
                 var nodeElementCount = value.value.GetNodeElementCount(process);
 
+                string nodeElementLimit = value.value.IsNodeElementCountExact() ? "" : "up to ";
+
                 if (arrayElementCount != 0 && nodeElementCount != 0)
-                    return $"0x{value.targetAddress:x} table [{arrayElementCount} element(s) and {nodeElementCount} key(s)]";
+                    return $"0x{value.targetAddress:x} table [{arrayElementCount} element(s) and {nodeElementLimit}{nodeElementCount} key(s)]";
 
                 if (arrayElementCount != 0)
                     return $"0x{value.targetAddress:x} table [{arrayElementCount} element(s)]";
 
                 if (nodeElementCount != 0)
-                    return $"0x{value.targetAddress:x} table [{nodeElementCount} key(s)]";
+                    return $"0x{value.targetAddress:x} table [{nodeElementLimit}{nodeElementCount} key(s)]";
 
                 if (!value.value.HasMetaTable())
                 {
@@ -415,9 +425,7 @@ namespace LuaDkmDebuggerComponent
 
             if (index < arrayElementCount)
             {
-                var arrayElements = value.GetArrayElements(process);
-
-                var element = arrayElements[index];
+                var element = value.GetArrayElement(process, index);
 
                 if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
                     return EvaluateDataAtLuaValue(inspectionContext, stackFrame, $"[{index}]", $"{fullName}[{index}]", element, DkmEvaluationResultFlags.None, DkmEvaluationResultAccessType.None, DkmEvaluationResultStorageType.None);
@@ -431,11 +439,16 @@ namespace LuaDkmDebuggerComponent
 
             if (index < nodeElementCount)
             {
-                var lazyNodeElements = value.GetNodeLazyElements(process);
+                var node = value.GetNodeLazyElement(process, index, out BatchRead nodeBatch);
+
+                // Reported key count of a large table is the node array size, slots after the last key are unused
+                if (node == null && !value.IsNodeElementCountExact())
+                    return DkmFailedEvaluationResult.Create(inspectionContext, stackFrame, $"[{index}]", $"{fullName}[{index}]", "Unused node slot", DkmEvaluationResultFlags.None, null);
 
-                var node = lazyNodeElements[index];
+                if (node == null)
+                    return DkmFailedEvaluationResult.Create(inspectionContext, stackFrame, $"[{index}]", $"{fullName}[{index}]", "Table data is missing", DkmEvaluationResultFlags.Invalid, null);
 
-                var nodeKey = node.LoadKey(process, value.batchNodeElementData);
+                var nodeKey = node.LoadKey(process, nodeBatch);
 
                 DkmEvaluationResultFlags flags = DkmEvaluationResultFlags.None;
                 string name = EvaluateValueAtLuaValue(process, nodeKey, 10, out _, ref flags, out _, out _);
@@ -462,9 +475,9 @@ namespace LuaDkmDebuggerComponent
                 }
 
                 if (isIdentifierName)
-                    return EvaluateDataAtLuaValue(inspectionContext, stackFrame, name, $"{fullName}.{name}", node.LoadValue(process, value.batchNodeElementData), DkmEvaluationResultFlags.None, DkmEvaluationResultAccessType.None, DkmEvaluationResultStorageType.None);
+                    return EvaluateDataAtLuaValue(inspectionContext, stackFrame, name, $"{fullName}.{name}", node.LoadValue(process, nodeBatch), DkmEvaluationResultFlags.None, DkmEvaluationResultAccessType.None, DkmEvaluationResultStorageType.None);
 
-                return EvaluateDataAtLuaValue(inspectionContext, stackFrame, $"\"{name}\"", $"{fullName}[\"{name}\"]", node.LoadValue(process, value.batchNodeElementData), DkmEvaluationResultFlags.None, DkmEvaluationResultAccessType.None, DkmEvaluationResultStorageType.None);
+                return EvaluateDataAtLuaValue(inspectionContext, stackFrame, $"\"{name}\"", $"{fullName}[\"{name}\"]", node.LoadValue(process, nodeBatch), DkmEvaluationResultFlags.None, DkmEvaluationResultAccessType.None, DkmEvaluationResultStorageType.None);
             }
 
             index = index - nodeElementCount;
@@ -182,16 +182,10 @@ namespace LuaDkmDebuggerComponent
             if (process == null)
                 return Report("Can't load table - process memory is not available");
 
-            foreach (var element in table.GetNodeKeys(process))
-            {
-                var keyAsString = element.LoadKey(process, table.batchNodeElementData) as LuaValueDataString;
+            var value = table.FetchMember(process, name);
 
-                if (keyAsString == null)
-                    continue;
-
-                if (keyAsString.value == name)
-                    return element.LoadValue(process, table.batchNodeElementData);
-            }
+            if (value != null)
+                return value;
 
             if (table.HasMetaTable())
             {
@@ -215,35 +209,19 @@ namespace LuaDkmDebuggerComponent
                 if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
                 {
                     if (result >= 0 && result < table.value.GetArrayElementCount(process))
-                    {
-                        var arrayElements = table.value.GetArrayElements(process);
-
-                        return arrayElements[result];
-                    }
+                        return table.value.GetArrayElement(process, result);
                 }
                 else
                 {
                     if (result > 0 && result - 1 < table.value.GetArrayElementCount(process))
-                    {
-                        var arrayElements = table.value.GetArrayElements(process);
-
-                        return arrayElements[result - 1];
-                    }
+                        return table.value.GetArrayElement(process, result - 1);
                 }
             }
 
-            foreach (var element in table.value.GetNodeKeys(process))
-            {
-                var elementKey = element.LoadKey(process, table.value.batchNodeElementData);
-
-                if (elementKey.GetType() != index.GetType())
-                    continue;
+            var value = table.value.FetchElement(process, index);
 
-                if (elementKey.LuaCompare(index))
-                {
-                    return element.LoadValue(process, table.value.batchNodeElementData);
-                }
-            }
+            if (value != null)
+                return value;
 
             if (table.value.HasMetaTable())
             {
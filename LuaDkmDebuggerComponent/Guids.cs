@@ -29,6 +29,8 @@ namespace LuaDkmDebuggerComponent
         public static readonly int throwException = 6;
         public static readonly int registerLuaState = 7;
         public static readonly int unregisterLuaState = 8;
+        public static readonly int registerTracepoints = 9;
+        public static readonly int setProfilerSettings = 10;
     }
 
     static class MessageToLocal
@@ -20,9 +20,46 @@ using System.Web.Script.Serialization;
 
 namespace LuaDkmDebuggerComponent
 {
+    internal class LuaDebugTracepoint
+    {
+        public string Source = null;
+        public int Line = 0;
+    }
+
+    internal class LuaScriptLoadRecord
+    {
+        public ulong stateAddress;
+        public string scriptName; // null if script content was used as a name
+        public byte[] content;
+    }
+
+    // Every state of a Lua library has the same layout, so hook fields can be found from offsets after the first registration
+    internal class LuaStateLayout
+    {
+        public int version;
+
+        public ulong hookFunctionOffset;
+        public ulong hookBaseCountOffset;
+        public ulong hookCountOffset;
+        public ulong hookMaskOffset;
+
+        public ulong setTrapStateCallInfoOffset;
+        public ulong setTrapCallInfoPreviousOffset;
+        public ulong setTrapCallInfoCallStatusOffset;
+        public ulong setTrapCallInfoTrapOffset;
+
+        public ulong helperHookFunctionAddress;
+    }
+
     internal class LuaDebugConfiguration
     {
         public List<string> ScriptPaths = new List<string>();
+        public List<LuaDebugTracepoint> Tracepoints = new List<LuaDebugTracepoint>();
+        public int ProfileInterval = 0;
+        public string TimingOutput = null;
+        public bool LuajitInterpretBreakpointFunctions = true;
+        public bool BreakOnCaughtErrors = false;
+        public List<string> IgnoredErrors = new List<string>();
     }
 
     internal class LuaLocalProcessData : DkmDataItem
@@ -61,11 +98,9 @@ namespace LuaDkmDebuggerComponent
         public ulong helperHookFunctionAddress_5_4 = 0;
         public ulong helperHookFunctionAddress_luajit = 0;
 
-        public ulong helperBreakCountAddress = 0;
-        public ulong helperBreakDataAddress = 0;
+        public ulong helperBreakTableAddress = 0;
         public ulong helperBreakHitIdAddress = 0;
         public ulong helperBreakHitLuaStateAddress = 0;
-        public ulong helperBreakSourcesAddress = 0;
 
         public ulong helperHookFunctionAddress_5_234_compat = 0;
 
@@ -78,21 +113,51 @@ namespace LuaDkmDebuggerComponent
         public ulong helperCompatLuaClosureProtoOffset = 0;
         public ulong helperCompatLuaFunctionSourceOffset = 0;
         public ulong helperCompatStringContentOffset = 0;
+        public ulong helperCompatLuaStateTopOffset = 0;
+
+        public ulong helperHookLayoutCountAddress = 0;
+        public ulong helperHookLayoutsAddress = 0;
 
         public ulong helperLuajitGetInfoAddress = 0;
         public ulong helperLuajitGetStackAddress = 0;
+        public ulong helperLuajitFunctionModeAddress = 0;
+        public ulong helperLuajitHookRemovalAddress = 0;
+        public ulong helperJitFunctionCountAddress = 0;
+        public bool luajitFunctionModeEnabled = false;
 
         public ulong helperStepOverAddress = 0;
         public ulong helperStepIntoAddress = 0;
         public ulong helperStepOutAddress = 0;
-        public ulong helperSkipDepthAddress = 0;
-        public ulong helperStackDepthAtCall = 0;
+        public ulong helperStepStatesAddress = 0;
+        public ulong helperStepLuaStateAddress = 0;
+        public ulong helperStopRecordsAddress = 0;
         public ulong helperAsyncBreakCodeAddress = 0;
-        public ulong helperAsyncBreakDataAddress = 0;
+        public ulong helperCommandRingAddress = 0;
+        public ulong helperCommandWriteAddress = 0;
+        public ulong helperCommandReadAddress = 0;
+        public ulong helperCommandRetryAddress = 0;
+        public ulong helperAsyncBreakEventAddress = 0;
+        public ulong helperLineHookSettingsAddress = 0;
+        public ulong helperHookStatsAddress = 0;
+        public ulong helperTraceBufferAddress = 0;
+        public ulong helperProfileAddress = 0;
+        public ulong helperProfileSettingsAddress = 0;
+        public ulong helperTimingAddress = 0;
+
+        public bool helperConfigurationSent = false;
+        public uint traceReadPosition = 0;
+        public uint profileReportedSampleCount = 0;
+        public uint[] timingReadPositions = null;
+        public LuaTimingProfile timingProfile = null;
+        public long timingFrequency = 0;
+        public bool timingOutputPending = false;
+        public bool stopReportPending = false;
+        public List<List<ulong>> pendingHelperCommands = new List<List<ulong>>();
+        public Dictionary<ulong, LuaFunctionData> functionDataCache = new Dictionary<ulong, LuaFunctionData>();
 
         public LuaLocationsMessage luaLocations;
 
-        public Guid breakpointLuaInitialization;
+        public DkmRuntimeInstructionBreakpoint breakpointLuaInitialization;
 
         public bool skipNextInternalCreate = false;
         public Guid breakpointLuaThreadCreate;
@@ -120,6 +185,15 @@ namespace LuaDkmDebuggerComponent
         public ulong breakpointLuaThrowAddress = 0;
         public DkmRuntimeInstructionBreakpoint breakpointLuaThrow;
 
+        public LuaStateLayout stateLayout = null;
+
+        // Lua 'pcall' and 'xpcall' library functions, errors inside them are handled by scripts
+        public ulong luaBasePcallAddress = 0;
+        public ulong luaBaseXpcallAddress = 0;
+
+        public ulong lastReportedErrorState = 0;
+        public string lastReportedErrorMessage = null;
+
         public Guid breakpointLuaHelperInitialized;
 
         public Guid breakpointLuaHelperBreakpointHit;
@@ -139,6 +213,12 @@ namespace LuaDkmDebuggerComponent
         public ulong luaSetHookAddress = 0;
         public ulong luaGetInfoAddress = 0;
         public ulong luaGetStackAddress = 0;
+        public ulong luaSetTopAddress = 0;
+        public ulong luaToPointerAddress = 0;
+        public ulong luaRawGetIAddress = 0;
+        public ulong luaLibRefAddress = 0;
+        public ulong luaLibUnrefAddress = 0;
+        public ulong ljSetModeAddress = 0;
 
         public bool canAccessBasicSymbolInfo = true;
         public Dictionary<ulong, string> knownStackFilterMethodNames = new Dictionary<ulong, string>();
@@ -150,6 +230,10 @@ namespace LuaDkmDebuggerComponent
 
         public bool pendingBreakpointDocumentsReady = false;
         public HashSet<string> pendingBreakpointDocuments = new HashSet<string>();
+        public HashSet<string> pendingBreakpointFileNames = new HashSet<string>(StringComparer.OrdinalIgnoreCase);
+
+        // Script loads without pending breakpoints are registered in bulk
+        public List<LuaScriptLoadRecord> pendingScriptLoads = new List<LuaScriptLoadRecord>();
 
         public bool versionNotificationSent = false;
 
@@ -158,6 +242,25 @@ namespace LuaDkmDebuggerComponent
 
         public Guid ljStackCacheInspectionContextGuid;
         public Dictionary<ulong, List<DkmStackWalkFrame>> ljStackCache = new Dictionary<ulong, List<DkmStackWalkFrame>>();
+
+        // Decoded call stack frames for each Lua state, keyed by call info (or LuaJIT frame) address and kept across stack walks
+        public Dictionary<ulong, Dictionary<ulong, LuaCallStackFrameCacheEntry>> callStackFrameCache = new Dictionary<ulong, Dictionary<ulong, LuaCallStackFrameCacheEntry>>();
+    }
+
+    internal class LuaCallStackFrameCacheEntry
+    {
+        // Frame data that has to match for the entry to be reused
+        public ulong savedInstructionPointer; // savedpc or callee frame link in LuaJIT
+        public ulong closureAddress;
+        public ulong functionAddress; // Proto or frame size in LuaJIT
+        public ulong callerLink; // Frame link in LuaJIT
+        public string functionName;
+
+        // Entity data is null for C function frames
+        public byte[] entityDataBytes;
+        public byte[] frameDataBytes;
+        public ulong instructionId;
+        public string description;
     }
 
     // DkmWorkerProcessConnection is only available from VS 2019, so we need an indirection to avoid the type load error
@@ -226,7 +329,7 @@ namespace LuaDkmDebuggerComponent
         public ulong stateAddress;
     }
 
-    public class LocalComponent : IDkmCallStackFilter, IDkmSymbolQuery, IDkmSymbolCompilerIdQuery, IDkmSymbolDocumentCollectionQuery, IDkmLanguageExpressionEvaluator, IDkmSymbolDocumentSpanQuery, IDkmModuleInstanceLoadNotification, IDkmCustomMessageCallbackReceiver, IDkmLanguageInstructionDecoder, IDkmModuleUserCodeDeterminer
+    public class LocalComponent : IDkmCallStackFilter, IDkmSymbolQuery, IDkmSymbolCompilerIdQuery, IDkmSymbolDocumentCollectionQuery, IDkmLanguageExpressionEvaluator, IDkmSymbolDocumentSpanQuery, IDkmModuleInstanceLoadNotification, IDkmCustomMessageCallbackReceiver, IDkmLanguageInstructionDecoder, IDkmModuleUserCodeDeterminer, IDkmProcessExecutionNotifications
     {
         public static bool attachOnLaunch = true;
         public static bool breakOnError = true;
@@ -259,7 +362,12 @@ namespace LuaDkmDebuggerComponent
                     {
                         processData.configuration = serializer.Deserialize<LuaDebugConfiguration>(File.ReadAllText(path));
 
-                        return processData.configuration != null;
+                        if (processData.configuration == null)
+                            return false;
+
+                        SendHelperConfiguration(process, processData);
+
+                        return true;
                     }
                     catch (Exception e)
                     {
@@ -353,6 +461,436 @@ namespace LuaDkmDebuggerComponent
             }
         }
 
+        void LogHookStats(DkmProcess process, LuaLocalProcessData processData)
+        {
+            var batch = BatchRead.Create(process, processData.helperHookStatsAddress, 7 * 8);
+
+            ulong[] events = new ulong[5];
+
+            for (int i = 0; i < events.Length; i++)
+                events[i] = DebugHelpers.ReadUlongVariable(process, processData.helperHookStatsAddress + (ulong)i * 8, batch).GetValueOrDefault(0);
+
+            ulong ticks = DebugHelpers.ReadUlongVariable(process, processData.helperHookStatsAddress + 5 * 8, batch).GetValueOrDefault(0);
+            ulong frequency = DebugHelpers.ReadUlongVariable(process, processData.helperHookStatsAddress + 6 * 8, batch).GetValueOrDefault(0);
+
+            ulong total = events.Aggregate(0ul, (acc, el) => acc + el);
+
+            if (total == 0 || frequency == 0)
+                return;
+
+            double nanoseconds = ticks * 1000000000.0 / frequency;
+
+            log.Debug($"Hook stats: {events[0]} call, {events[1]} return, {events[2]} line, {events[3]} count, {events[4]} tail events; {nanoseconds / total:F1}ns per event ({nanoseconds / 1000000.0:F1}ms total, including stops)");
+        }
+
+        void SendHelperConfiguration(DkmProcess process, LuaLocalProcessData processData)
+        {
+            // Tracepoints and profiler are handled by the helper library, so we need both the configuration and the helper
+            if (processData.helperConfigurationSent || processData.configuration == null || processData.helperBreakTableAddress == 0)
+                return;
+
+            processData.helperConfigurationSent = true;
+
+            bool timing = !string.IsNullOrEmpty(processData.configuration.TimingOutput) && processData.helperTimingAddress != 0;
+
+            if (processData.configuration.ProfileInterval > 0 || timing)
+            {
+                log.Debug($"Enabling profiler (sample interval {processData.configuration.ProfileInterval}, timing {timing})");
+
+                if (timing)
+                    DebugHelpers.TryWriteUintVariable(process, processData.helperTimingAddress, 1u);
+
+                var settings = new ProfilerSettingsMessage
+                {
+                    sampleInterval = Math.Max(processData.configuration.ProfileInterval, 0),
+                    timing = timing
+                };
+
+                DkmCustomMessage.Create(process.Connection, process, MessageToRemote.guid, MessageToRemote.setProfilerSettings, settings.Encode(), null).SendLower();
+            }
+
+            if (processData.configuration.Tracepoints == null || processData.configuration.Tracepoints.Count == 0)
+                return;
+
+            var data = new TracepointsMessage();
+
+            foreach (var tracepoint in processData.configuration.Tracepoints)
+            {
+                if (tracepoint.Source == null || tracepoint.Line <= 0)
+                    continue;
+
+                data.sources.Add(tracepoint.Source);
+                data.lines.Add(tracepoint.Line);
+            }
+
+            log.Debug($"Registering {data.sources.Count} tracepoints");
+
+            var message = DkmCustomMessage.Create(process.Connection, process, MessageToRemote.guid, MessageToRemote.registerTracepoints, data.Encode(), null);
+
+            message.SendLower();
+        }
+
+        LuaFunctionData FetchHelperReportFunction(DkmProcess process, LuaLocalProcessData processData, ulong proto)
+        {
+            if (processData.functionDataCache.TryGetValue(proto, out LuaFunctionData functionData))
+                return functionData;
+
+            functionData = new LuaFunctionData();
+
+            functionData.ReadFrom(process, proto);
+            functionData.ReadLocals(process, -1);
+
+            processData.functionDataCache.Add(proto, functionData);
+
+            return functionData;
+        }
+
+        string FormatTraceValues(DkmProcess process, LuaLocalProcessData processData, ulong proto, int line, ulong valuesAddress, int valueCount, BatchRead batch)
+        {
+            if (valueCount == 0)
+                return "";
+
+            var functionData = FetchHelperReportFunction(process, processData, proto);
+
+            // Before Lua 5.4, registers of vararg functions are not placed right after the function
+            if (functionData.isVarargs != 0 && LuaHelpers.luaVersion != 504)
+                return "";
+
+            int instructionPointer = -1;
+
+            for (int i = 0; i < functionData.lineInfoSize; i++)
+            {
+                if (functionData.ReadLineInfoFor(process, i) == line)
+                {
+                    instructionPointer = i;
+                    break;
+                }
+            }
+
+            if (instructionPointer == -1)
+                return "";
+
+            functionData.UpdateLocals(process, instructionPointer);
+
+            ulong valueSize = LuaHelpers.GetValueSize(process);
+
+            var result = new StringBuilder();
+
+            for (int i = 0; i < functionData.activeLocals.Count && i < valueCount; i++)
+            {
+                var value = LuaHelpers.ReadValue(process, valuesAddress + (ulong)i * valueSize, batch);
+
+                if (value == null)
+                    continue;
+
+                result.Append(result.Length == 0 ? " " : ", ");
+                result.Append($"{functionData.activeLocals[i].name} = {value.AsSimpleDisplayString(10)}");
+            }
+
+            return result.ToString();
+        }
+
+        void DrainTraceBuffer(DkmProcess process, LuaLocalProcessData processData)
+        {
+            const int recordSize = 176;
+            const int recordsOffset = 16;
+            const int valuesOffset = 48;
+
+            var write = DebugHelpers.ReadUintVariable(process, processData.helperTraceBufferAddress);
+
+            if (!write.HasValue || write.Value == processData.traceReadPosition)
+                return;
+
+            var header = BatchRead.Create(process, processData.helperTraceBufferAddress, recordsOffset);
+
+            uint recordCount = DebugHelpers.ReadUintVariable(process, processData.helperTraceBufferAddress + 4, header).GetValueOrDefault(0);
+            long frequency = DebugHelpers.ReadLongVariable(process, processData.helperTraceBufferAddress + 8, header).GetValueOrDefault(0);
+
+            if (recordCount == 0 || frequency == 0)
+                return;
+
+            uint pending = write.Value - processData.traceReadPosition;
+            uint dropped = 0;
+
+            // Writers don't wait for the debugger, records that were overwritten are lost
+            if (pending > recordCount)
+            {
+                dropped = pending - recordCount;
+
+                processData.traceReadPosition = write.Value - recordCount;
+            }
+
+            ulong recordsAddress = processData.helperTraceBufferAddress + recordsOffset;
+
+            var batch = BatchRead.Create(process, recordsAddress, (int)recordCount * recordSize);
+
+            if (batch == null)
+                return;
+
+            var output = new StringBuilder();
+
+            for (uint position = processData.traceReadPosition; position != write.Value; position++)
+            {
+                ulong recordAddress = recordsAddress + (ulong)(position & (recordCount - 1)) * recordSize;
+
+                // Record might be incomplete if the writer thread was stopped in the middle of it
+                if (DebugHelpers.ReadUintVariable(process, recordAddress, batch).GetValueOrDefault(0) != position + 1)
+                {
+                    dropped++;
+                    continue;
+                }
+
+                int line = DebugHelpers.ReadIntVariable(process, recordAddress + 4, batch).GetValueOrDefault(0);
+                long timestamp = DebugHelpers.ReadLongVariable(process, recordAddress + 8, batch).GetValueOrDefault(0);
+                ulong state = DebugHelpers.ReadUlongVariable(process, recordAddress + 16, batch).GetValueOrDefault(0);
+                ulong proto = DebugHelpers.ReadUlongVariable(process, recordAddress + 24, batch).GetValueOrDefault(0);
+                uint traceId = DebugHelpers.ReadUintVariable(process, recordAddress + 40, batch).GetValueOrDefault(0);
+                int valueCount = DebugHelpers.ReadIntVariable(process, recordAddress + 44, batch).GetValueOrDefault(0);
+
+                string source = "?";
+
+                if (traceId != 0 && traceId <= processData.configuration.Tracepoints.Count)
+                    source = processData.configuration.Tracepoints[(int)traceId - 1].Source;
+
+                string values = proto != 0 ? FormatTraceValues(process, processData, proto, line, recordAddress + valuesOffset, valueCount, batch) : "";
+
+                output.Append($"Lua tracepoint {source}:{line} at {(double)timestamp / frequency:F6}s, state 0x{state:x}{values}\n");
+            }
+
+            processData.traceReadPosition = write.Value;
+
+            if (dropped != 0)
+                output.Append($"Lua tracepoints: {dropped} records were lost\n");
+
+            if (output.Length != 0)
+                DkmUserMessage.Create(process.Connection, process, DkmUserMessageOutputKind.UnfilteredOutputWindowMessage, output.ToString(), MessageBoxFlags.None, 0).Post();
+        }
+
+        void ReportProfile(DkmProcess process, LuaLocalProcessData processData)
+        {
+            const int slotsOffset = 16;
+            const int slotSize = 16;
+
+            var header = BatchRead.Create(process, processData.helperProfileAddress, slotsOffset);
+
+            uint sampleCount = DebugHelpers.ReadUintVariable(process, processData.helperProfileAddress, header).GetValueOrDefault(0);
+
+            if (sampleCount == 0 || sampleCount == processData.profileReportedSampleCount)
+                return;
+
+            processData.profileReportedSampleCount = sampleCount;
+
+            uint lostCount = DebugHelpers.ReadUintVariable(process, processData.helperProfileAddress + 4, header).GetValueOrDefault(0);
+            uint slotCount = DebugHelpers.ReadUintVariable(process, processData.helperProfileAddress + 8, header).GetValueOrDefault(0);
+            int positionBits = DebugHelpers.ReadIntVariable(process, processData.helperProfileAddress + 12, header).GetValueOrDefault(0);
+
+            if (slotCount == 0 || positionBits <= 0 || positionBits >= 64)
+                return;
+
+            var batch = BatchRead.Create(process, processData.helperProfileAddress + slotsOffset, (int)slotCount * slotSize);
+
+            if (batch == null)
+                return;
+
+            var lineSamples = new Dictionary<string, long>();
+            var functionSamples = new Dictionary<string, long>();
+
+            for (uint i = 0; i < slotCount; i++)
+            {
+                ulong slotAddress = processData.helperProfileAddress + slotsOffset + i * slotSize;
+
+                ulong key = DebugHelpers.ReadUlongVariable(process, slotAddress, batch).GetValueOrDefault(0);
+                uint count = DebugHelpers.ReadUintVariable(process, slotAddress + 8, batch).GetValueOrDefault(0);
+
+                if (key == 0 || count == 0)
+                    continue;
+
+                ulong address = (key & ((1ul << (64 - positionBits)) - 1)) << 3;
+                int position = (int)(key >> (64 - positionBits));
+
+                string function;
+                string line;
+
+                if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                {
+                    // Key holds source name and line
+                    function = DebugHelpers.ReadStringVariable(process, address, 1024) ?? $"0x{address:x}";
+                    line = $"{function}:{position}";
+                }
+                else
+                {
+                    // Key holds Proto and instruction index
+                    var functionData = FetchHelperReportFunction(process, processData, address);
+
+                    string source = functionData.ReadSource(process) ?? "?";
+
+                    function = $"{source}:{functionData.definitionStartLine_opt}";
+                    line = position < functionData.lineInfoSize ? $"{source}:{functionData.ReadLineInfoFor(process, position)}" : function;
+                }
+
+                lineSamples[line] = lineSamples.TryGetValue(line, out long lineCount) ? lineCount + count : count;
+                functionSamples[function] = functionSamples.TryGetValue(function, out long functionCount) ? functionCount + count : count;
+            }
+
+            var output = new StringBuilder();
+
+            output.Append($"Lua profile: {sampleCount} samples ({lostCount} lost)\n");
+
+            output.Append("Hot functions:\n");
+
+            foreach (var el in functionSamples.OrderByDescending(el => el.Value).Take(10))
+                output.Append($"  {el.Value * 100.0 / sampleCount,6:F2}% {el.Key}\n");
+
+            output.Append("Hot lines:\n");
+
+            foreach (var el in lineSamples.OrderByDescending(el => el.Value).Take(10))
+                output.Append($"  {el.Value * 100.0 / sampleCount,6:F2}% {el.Key}\n");
+
+            DkmUserMessage.Create(process.Connection, process, DkmUserMessageOutputKind.UnfilteredOutputWindowMessage, output.ToString(), MessageBoxFlags.None, 0).Post();
+        }
+
+        string GetTimingFunctionName(DkmProcess process, LuaLocalProcessData processData, ulong function)
+        {
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+            {
+                // Source name address and definition line are packed as profile keys
+                ulong address = (function & ((1ul << 44) - 1)) << 3;
+
+                return $"{DebugHelpers.ReadStringVariable(process, address, 1024) ?? "?"}:{function >> 44}";
+            }
+
+            var functionData = FetchHelperReportFunction(process, processData, function);
+
+            string location = $"{functionData.ReadSource(process) ?? "?"}:{functionData.definitionStartLine_opt}";
+
+            string name;
+
+            lock (processData.symbolStore)
+            {
+                name = processData.symbolStore.FetchFunctionName(function);
+            }
+
+            return name != null ? $"{name} ({location})" : location;
+        }
+
+        void DrainTimingBuffers(DkmProcess process, LuaLocalProcessData processData)
+        {
+            const int buffersOffset = 24;
+            const int recordSize = 16;
+
+            var header = BatchRead.Create(process, processData.helperTimingAddress, buffersOffset);
+
+            uint threadCount = DebugHelpers.ReadUintVariable(process, processData.helperTimingAddress + 4, header).GetValueOrDefault(0);
+            uint recordCount = DebugHelpers.ReadUintVariable(process, processData.helperTimingAddress + 8, header).GetValueOrDefault(0);
+            uint lostCount = DebugHelpers.ReadUintVariable(process, processData.helperTimingAddress + 12, header).GetValueOrDefault(0);
+            long frequency = DebugHelpers.ReadLongVariable(process, processData.helperTimingAddress + 16, header).GetValueOrDefault(0);
+
+            if (threadCount == 0 || recordCount == 0 || frequency == 0)
+                return;
+
+            if (processData.timingReadPositions == null)
+                processData.timingReadPositions = new uint[threadCount];
+
+            if (processData.timingProfile == null)
+            {
+                processData.timingProfile = new LuaTimingProfile
+                {
+                    tailEventIsCall = LuaHelpers.luaVersion != 501 && LuaHelpers.luaVersion != LuaHelpers.luaVersionLuajit,
+                    resolveName = (function) => GetTimingFunctionName(process, processData, function)
+                };
+            }
+
+            ulong bufferSize = 8 + (ulong)recordCount * recordSize;
+            uint overwritten = 0;
+
+            for (uint i = 0; i < threadCount && i < processData.timingReadPositions.Length; i++)
+            {
+                ulong bufferAddress = processData.helperTimingAddress + buffersOffset + i * bufferSize;
+
+                var bufferHeader = BatchRead.Create(process, bufferAddress, 8);
+
+                uint threadId = DebugHelpers.ReadUintVariable(process, bufferAddress, bufferHeader).GetValueOrDefault(0);
+                uint write = DebugHelpers.ReadUintVariable(process, bufferAddress + 4, bufferHeader).GetValueOrDefault(0);
+
+                uint position = processData.timingReadPositions[i];
+
+                if (write == position)
+                    continue;
+
+                // Owner thread doesn't wait for the debugger, oldest records are overwritten
+                if (write - position > recordCount)
+                {
+                    overwritten += write - position - recordCount;
+
+                    position = write - recordCount;
+                }
+
+                // Buffers are drained often, so only the new part of the ring is read unless it wraps around
+                uint start = position & (recordCount - 1);
+                bool wraps = start + (write - position) > recordCount;
+
+                var batch = BatchRead.Create(process, bufferAddress + 8 + (wraps ? 0 : (ulong)start * recordSize), (int)((wraps ? recordCount : write - position) * recordSize));
+
+                if (batch == null)
+                    continue;
+
+                for (; position != write; position++)
+                {
+                    ulong recordAddress = bufferAddress + 8 + (ulong)(position & (recordCount - 1)) * recordSize;
+
+                    ulong timestamp = DebugHelpers.ReadUlongVariable(process, recordAddress, batch).GetValueOrDefault(0);
+                    ulong function = DebugHelpers.ReadUlongVariable(process, recordAddress + 8, batch).GetValueOrDefault(0);
+
+                    processData.timingProfile.AddRecord(threadId, (long)(timestamp >> 2), (LuaTimingEvent)(timestamp & 3), function);
+                }
+
+                processData.timingReadPositions[i] = write;
+                processData.timingOutputPending = true;
+            }
+
+            processData.timingFrequency = frequency;
+
+            if (overwritten != 0 || lostCount != 0)
+                log.Warning($"Lua timing: {overwritten} records were overwritten, {lostCount} events from threads without a buffer were lost");
+        }
+
+        void WriteTimingOutput(DkmProcess process, LuaLocalProcessData processData)
+        {
+            // Output files contain the whole session, they are rewritten once per stop instead of every drain
+            if (!processData.timingOutputPending || processData.timingFrequency == 0)
+                return;
+
+            processData.timingOutputPending = false;
+
+            long frequency = processData.timingFrequency;
+
+            string outputPath = processData.configuration.TimingOutput;
+
+            if (!Path.IsPathRooted(outputPath) && processData.workingDirectory != null)
+                outputPath = Path.Combine(processData.workingDirectory, outputPath);
+
+            try
+            {
+                File.WriteAllText(outputPath + ".folded", processData.timingProfile.ExportCollapsedStacks(frequency));
+                File.WriteAllText(outputPath + ".json", processData.timingProfile.ExportChromeTrace(frequency));
+            }
+            catch (Exception e)
+            {
+                log.Error($"Failed to write Lua timing data to '{outputPath}': {e.Message}");
+                return;
+            }
+
+            var output = new StringBuilder();
+
+            output.Append($"Lua timing written to '{outputPath}.folded' and '{outputPath}.json'\n");
+            output.Append("Top functions by exclusive time:\n");
+
+            foreach (var el in processData.timingProfile.functions.Values.OrderByDescending(el => el.exclusiveTicks).Take(10))
+                output.Append($"  {el.exclusiveTicks * 1000.0 / frequency,10:F3}ms exclusive {el.inclusiveTicks * 1000.0 / frequency,10:F3}ms inclusive {el.calls,8} calls {el.name}\n");
+
+            DkmUserMessage.Create(process.Connection, process, DkmUserMessageOutputKind.UnfilteredOutputWindowMessage, output.ToString(), MessageBoxFlags.None, 0).Post();
+        }
+
         bool OnFoundLuaCallStack(DkmProcess process, LuaLocalProcessData processData, DkmStackContext stackContext, DkmStackWalkFrame input)
         {
             if (processData.runtimeInstance == null)
@@ -375,6 +913,9 @@ namespace LuaDkmDebuggerComponent
 
                 if (processData.scratchMemory == 0)
                     return false;
+
+                if (processData.helperHookStatsAddress != 0 && processData.stopReportPending)
+                    LogHookStats(process, processData);
             }
 
             // Find out the current process working directory (Lua script files will be resolved from that location)
@@ -410,6 +951,23 @@ namespace LuaDkmDebuggerComponent
             if ((useSchema || LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit) && !processData.schemaLoaded)
                 LoadSchema(processData, stackContext.InspectionSession, stackContext.Thread, input);
 
+            if (process.LivePart != null)
+                FlushScriptLoads(process, processData);
+
+            if (process.LivePart != null && processData.helperTraceBufferAddress != 0 && processData.configuration != null)
+                DrainTraceBuffer(process, processData);
+
+            if (process.LivePart != null && processData.helperProfileAddress != 0 && processData.configuration != null && processData.configuration.ProfileInterval > 0)
+                ReportProfile(process, processData);
+
+            if (process.LivePart != null && processData.helperTimingAddress != 0 && processData.configuration != null && !string.IsNullOrEmpty(processData.configuration.TimingOutput) && processData.stopReportPending)
+            {
+                DrainTimingBuffers(process, processData);
+                WriteTimingOutput(process, processData);
+            }
+
+            processData.stopReportPending = false;
+
             return true;
         }
 
@@ -501,6 +1059,20 @@ namespace LuaDkmDebuggerComponent
                     SendVersionNotification(process, processData);
                 }
 
+                // Each global state has its own string hash seed which is required to find table keys without a full scan
+                if (registryAddress.HasValue && LuaHelpers.luaVersion != 501)
+                {
+                    var hashLookupData = DebugHelpers.GetOrCreateDataItem<LuaTableHashLookupData>(process);
+
+                    if (hashLookupData.globalStates.Add(registryAddress.Value))
+                    {
+                        long? seed = EvaluationHelpers.TryEvaluateNumberExpression($"(unsigned)L->l_G->seed", stackContext.InspectionSession, stackContext.Thread, input, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects);
+
+                        if (seed.HasValue)
+                            hashLookupData.AddSeed((uint)seed.Value);
+                    }
+                }
+
                 string GetLuaFunctionName(ulong currCallInfoAddress, ulong prevCallInfoAddress, ulong closureAddress)
                 {
                     if (processData.scratchMemory == 0)
@@ -550,6 +1122,36 @@ namespace LuaDkmDebuggerComponent
 
                 DkmStackWalkFrame GetLuaFunctionStackWalkFrame(ulong callInfoAddress, LuaFunctionCallInfoData callInfoData, LuaValueDataLuaFunction callLuaFunction, string functionName)
                 {
+                    var frameCache = GetCallStackFrameCache(processData, stateAddress.Value);
+
+                    // Frame is decoded again only if the call info has a different function or instruction pointer
+                    if (!frameCache.TryGetValue(callInfoAddress, out LuaCallStackFrameCacheEntry cachedFrame) || cachedFrame.savedInstructionPointer != callInfoData.savedInstructionPointerAddress || cachedFrame.closureAddress != callLuaFunction.targetAddress || cachedFrame.functionAddress != callLuaFunction.value.functionAddress || cachedFrame.functionName != functionName)
+                    {
+                        cachedFrame = DecodeLuaFunctionStackWalkFrame(callInfoAddress, callInfoData, callLuaFunction, functionName);
+
+                        if (cachedFrame == null)
+                            return null;
+
+                        frameCache[callInfoAddress] = cachedFrame;
+                    }
+
+                    DkmInstructionAddress instructionAddress = DkmCustomInstructionAddress.Create(processData.runtimeInstance, processData.moduleInstance, cachedFrame.entityDataBytes, cachedFrame.instructionId, cachedFrame.frameDataBytes, null);
+
+                    var parentFrameData = DkmStackWalkFrameData.Create(stackContext.InspectionSession, new LuaStackWalkFrameParentData { originalFrame = input, stateAddress = stateAddress.Value });
+
+                    return DkmStackWalkFrame.Create(stackContext.Thread, instructionAddress, input.FrameBase, input.FrameSize, luaFrameFlags, cachedFrame.description, input.Registers, input.Annotations, null, null, parentFrameData);
+                }
+
+                LuaCallStackFrameCacheEntry DecodeLuaFunctionStackWalkFrame(ulong callInfoAddress, LuaFunctionCallInfoData callInfoData, LuaValueDataLuaFunction callLuaFunction, string functionName)
+                {
+                    var cachedFrame = new LuaCallStackFrameCacheEntry
+                    {
+                        savedInstructionPointer = callInfoData.savedInstructionPointerAddress,
+                        closureAddress = callLuaFunction.targetAddress,
+                        functionAddress = callLuaFunction.value.functionAddress,
+                        functionName = functionName
+                    };
+
                     var currFunctionData = callLuaFunction.value.ReadFunction(process);
 
                     if (currFunctionData == null)
@@ -630,16 +1232,12 @@ namespace LuaDkmDebuggerComponent
                             source = sourceName
                         };
 
-                        var entityDataBytes = entityData.Encode();
-                        var frameDataBytes = frameData.Encode();
+                        cachedFrame.entityDataBytes = entityData.Encode();
+                        cachedFrame.frameDataBytes = frameData.Encode();
+                        cachedFrame.instructionId = (ulong)((currLine << 16) + prevInstructionPointer);
+                        cachedFrame.description = $"{sourceName} {functionName}({argumentList}) Line {currLine}";
 
-                        DkmInstructionAddress instructionAddress = DkmCustomInstructionAddress.Create(processData.runtimeInstance, processData.moduleInstance, entityDataBytes, (ulong)((currLine << 16) + prevInstructionPointer), frameDataBytes, null);
-
-                        var description = $"{sourceName} {functionName}({argumentList}) Line {currLine}";
-
-                        var parentFrameData = DkmStackWalkFrameData.Create(stackContext.InspectionSession, new LuaStackWalkFrameParentData { originalFrame = input, stateAddress = stateAddress.Value });
-
-                        return DkmStackWalkFrame.Create(stackContext.Thread, instructionAddress, input.FrameBase, input.FrameSize, luaFrameFlags, description, input.Registers, input.Annotations, null, null, parentFrameData);
+                        return cachedFrame;
                     }
 
                     return null;
@@ -1121,10 +1719,49 @@ namespace LuaDkmDebuggerComponent
                 var startTime = DateTime.Now.Ticks / 10000.0;
                 bool timeout = false;
 
+                var frameCache = GetCallStackFrameCache(processData, stateAddress.Value);
+
                 while (frameAddress != 0 && !timeout)
                 {
                     ulong functionAddress = Schema.Luajit.fullPointer ? frameAddress - LuaHelpers.GetValueSize(process) : frameAddress;
 
+                    // Frames below the top one are reused while their function, frame link and the link of the called frame (return instruction) are the same
+                    LuaCallStackFrameCacheEntry cachedFrame = null;
+
+                    if (frameNum != 0 && frameSize != 0)
+                    {
+                        cachedFrame = new LuaCallStackFrameCacheEntry
+                        {
+                            savedInstructionPointer = LuajitHelpers.frame_ftsz(process, frameAddress + (ulong)frameSize * LuaHelpers.GetValueSize(process)),
+                            closureAddress = LuaHelpers.ReadGCobjAddress(process, functionAddress).GetValueOrDefault(0),
+                            functionAddress = (ulong)frameSize,
+                            callerLink = LuajitHelpers.frame_ftsz(process, frameAddress)
+                        };
+
+                        if (frameCache.TryGetValue(frameAddress, out LuaCallStackFrameCacheEntry knownFrame) && knownFrame.savedInstructionPointer == cachedFrame.savedInstructionPointer && knownFrame.closureAddress == cachedFrame.closureAddress && knownFrame.functionAddress == cachedFrame.functionAddress && knownFrame.callerLink == cachedFrame.callerLink)
+                        {
+                            if (knownFrame.entityDataBytes != null)
+                            {
+                                DkmInstructionAddress knownInstructionAddress = DkmCustomInstructionAddress.Create(processData.runtimeInstance, processData.moduleInstance, knownFrame.entityDataBytes, knownFrame.instructionId, knownFrame.frameDataBytes, null);
+
+                                var knownParentFrameData = DkmStackWalkFrameData.Create(stackContext.InspectionSession, new LuaStackWalkFrameParentData { originalFrame = input, stateAddress = stateAddress.Value });
+
+                                luaFrames.Add(DkmStackWalkFrame.Create(stackContext.Thread, knownInstructionAddress, input.FrameBase, input.FrameSize, luaFrameFlags, knownFrame.description, input.Registers, input.Annotations, null, null, knownParentFrameData));
+                            }
+                            else
+                            {
+                                luaFrames.Add(DkmStackWalkFrame.Create(stackContext.Thread, input.InstructionAddress, input.FrameBase, input.FrameSize, luaFrameFlags, knownFrame.description, input.Registers, input.Annotations));
+                            }
+
+                            frameNum++;
+
+                            frameAddress = LuajitHelpers.FindDebugFrame(process, luajitStateData, frameNum, out frameSize, out debugFrameIndex);
+
+                            timeout = DateTime.Now.Ticks / 10000.0 - startTime > 1000.0;
+                            continue;
+                        }
+                    }
+
                     LuaValueDataBase callFunction = LuaHelpers.ReadValueOfType(process, (int)LuaExtendedType.LuaFunction, 0, functionAddress);
 
                     long? status;
@@ -1249,12 +1886,29 @@ namespace LuaDkmDebuggerComponent
 
                                 var description = $"{debugData.source} {debugData.name}({argumentList}) Line {debugData.currentLine} PC {instructionPointer} FS {frameSize}";
 
+                                if (cachedFrame != null)
+                                {
+                                    cachedFrame.entityDataBytes = entityDataBytes;
+                                    cachedFrame.frameDataBytes = frameDataBytes;
+                                    cachedFrame.instructionId = (ulong)((debugData.currentLine << 16) + instructionPointer);
+                                    cachedFrame.description = description;
+
+                                    frameCache[frameAddress] = cachedFrame;
+                                }
+
                                 var parentFrameData = DkmStackWalkFrameData.Create(stackContext.InspectionSession, new LuaStackWalkFrameParentData { originalFrame = input, stateAddress = stateAddress.Value });
 
                                 luaFrames.Add(DkmStackWalkFrame.Create(stackContext.Thread, instructionAddress, input.FrameBase, input.FrameSize, luaFrameFlags, description, input.Registers, input.Annotations, null, null, parentFrameData));
                             }
                             else if (debugData.what == "C")
                             {
+                                if (cachedFrame != null)
+                                {
+                                    cachedFrame.description = $"[{debugData.name} C function]";
+
+                                    frameCache[frameAddress] = cachedFrame;
+                                }
+
                                 luaFrames.Add(DkmStackWalkFrame.Create(stackContext.Thread, input.InstructionAddress, input.FrameBase, input.FrameSize, luaFrameFlags, $"[{debugData.name} C function]", input.Registers, input.Annotations));
                             }
                         }
@@ -1688,12 +2342,14 @@ namespace LuaDkmDebuggerComponent
                 if (arrayElementCount == 0 && nodeElementCount == 0 && !resultAsTable.value.HasMetaTable())
                     result.evaluationFlags &= ~DkmEvaluationResultFlags.Expandable;
 
+                string nodeElementLimit = resultAsTable.value.IsNodeElementCountExact() ? "" : "up to ";
+
                 if (arrayElementCount != 0 && nodeElementCount != 0)
-                    resultStr = $"[{arrayElementCount} element(s) and {nodeElementCount} key(s)]";
+                    resultStr = $"[{arrayElementCount} element(s) and {nodeElementLimit}{nodeElementCount} key(s)]";
                 else if (arrayElementCount != 0)
                     resultStr = $"[{arrayElementCount} element(s)]";
                 else if (nodeElementCount != 0)
-                    resultStr = $"[{nodeElementCount} key(s)]";
+                    resultStr = $"[{nodeElementLimit}{nodeElementCount} key(s)]";
                 else if (resultAsTable.value.HasMetaTable())
                     resultStr = "[metatable]";
                 else
@@ -2539,6 +3195,9 @@ namespace LuaDkmDebuggerComponent
             var process = moduleInstance.Process;
             var processData = process.GetDataItem<LuaLocalProcessData>();
 
+            // Scripts have to be known before breakpoints can be bound to them
+            FlushScriptLoads(process, processData);
+
             lock (processData.symbolStore)
             {
                 foreach (var state in processData.symbolStore.knownStates)
@@ -2788,6 +3447,92 @@ namespace LuaDkmDebuggerComponent
             return null;
         }
 
+        // Must match the command ring in the helper library
+        const ulong helperCommandSetHook = 1;
+        const uint helperCommandRingSize = 16384;
+        const uint helperAsyncBreakCommands = 4;
+        const uint helperAsyncBreakTrace = 5;
+        const uint helperAsyncBreakProfile = 6;
+        const uint helperAsyncBreakTiming = 7;
+
+        // Large state lists are split so that each command fits in the ring
+        const int helperCommandMaxStates = (int)helperCommandRingSize / 4;
+
+        // Commands are kept until they fit in the ring, helper library is asked to notify the debugger again after executing what was written
+        void FlushHelperCommands(DkmProcess process, LuaLocalProcessData processData)
+        {
+            while (processData.pendingHelperCommands.Count != 0)
+            {
+                if (!EnqueueHelperCommand(process, processData, processData.pendingHelperCommands[0], out bool ringFull))
+                {
+                    // Retrying will not help if the ring can't be accessed
+                    if (!ringFull)
+                    {
+                        log.Error("Failed to queue helper command");
+
+                        processData.pendingHelperCommands.Clear();
+                    }
+
+                    break;
+                }
+
+                processData.pendingHelperCommands.RemoveAt(0);
+            }
+
+            if (processData.pendingHelperCommands.Count != 0)
+            {
+                log.Debug($"{processData.pendingHelperCommands.Count} helper commands are waiting for space in the command ring");
+
+                if (processData.helperCommandRetryAddress == 0 || !DebugHelpers.TryWriteUintVariable(process, processData.helperCommandRetryAddress, 1u))
+                    log.Error("Failed to request helper command retry");
+            }
+        }
+
+        bool EnqueueHelperCommand(DkmProcess process, LuaLocalProcessData processData, List<ulong> words, out bool ringFull)
+        {
+            ringFull = false;
+
+            if (processData.helperCommandRingAddress == 0 || processData.helperCommandWriteAddress == 0 || processData.helperCommandReadAddress == 0)
+                return false;
+
+            uint? read = DebugHelpers.ReadUintVariable(process, processData.helperCommandReadAddress);
+            uint? write = DebugHelpers.ReadUintVariable(process, processData.helperCommandWriteAddress);
+
+            if (!read.HasValue || !write.HasValue)
+                return false;
+
+            if (helperCommandRingSize - (write.Value - read.Value) < (uint)words.Count)
+            {
+                ringFull = true;
+                return false;
+            }
+
+            byte[] data = new byte[words.Count * 8];
+
+            Buffer.BlockCopy(words.ToArray(), 0, data, 0, data.Length);
+
+            // Command might wrap around the end of the ring
+            uint start = write.Value & (helperCommandRingSize - 1);
+            uint firstPart = Math.Min((uint)words.Count, helperCommandRingSize - start);
+
+            byte[] firstData = new byte[firstPart * 8];
+            Array.Copy(data, 0, firstData, 0, firstData.Length);
+
+            if (!DebugHelpers.TryWriteRawBytes(process, processData.helperCommandRingAddress + start * 8, firstData))
+                return false;
+
+            if (firstPart < words.Count)
+            {
+                byte[] secondData = new byte[data.Length - firstData.Length];
+                Array.Copy(data, firstData.Length, secondData, 0, secondData.Length);
+
+                if (!DebugHelpers.TryWriteRawBytes(process, processData.helperCommandRingAddress, secondData))
+                    return false;
+            }
+
+            return DebugHelpers.TryWriteUintVariable(process, processData.helperCommandWriteAddress, write.Value + (uint)words.Count);
+        }
+
         void SendStatusMessage(DkmProcess process, int id, string content)
         {
             StatusTextMessage statusTextMessage = new StatusTextMessage
@@ -2923,19 +3668,33 @@ namespace LuaDkmDebuggerComponent
                         processData.helperHookFunctionAddress_5_4 = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "LuaHelperHook_5_4");
                         processData.helperHookFunctionAddress_luajit = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "LuaHelperHook_luajit");
 
-                        processData.helperBreakCountAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperBreakCount");
-                        processData.helperBreakDataAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperBreakData");
+                        processData.helperBreakTableAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperBreakTable");
                         processData.helperBreakHitIdAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperBreakHitId");
                         processData.helperBreakHitLuaStateAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperBreakHitLuaStateAddress");
-                        processData.helperBreakSourcesAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperBreakSources");
 
                         processData.helperStepOverAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStepOver");
                         processData.helperStepIntoAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStepInto");
                         processData.helperStepOutAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStepOut");
-                        processData.helperSkipDepthAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperSkipDepth");
-                        processData.helperStackDepthAtCall = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStackDepthAtCall");
+                        processData.helperStepStatesAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStepStates");
+                        processData.helperStepLuaStateAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStepLuaState");
+                        processData.helperStopRecordsAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperStopRecords");
                         processData.helperAsyncBreakCodeAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperAsyncBreakCode");
-                        processData.helperAsyncBreakDataAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperAsyncBreakData");
+                        processData.helperCommandRingAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCommandRing");
+                        processData.helperCommandWriteAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCommandWrite");
+                        processData.helperCommandReadAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCommandRead");
+                        processData.helperCommandRetryAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCommandRetry");
+                        processData.helperAsyncBreakEventAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperAsyncBreakEvent");
+                        processData.helperLineHookSettingsAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperLineHookSettings");
+                        processData.helperTraceBufferAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperTraceBuffer");
+                        processData.helperProfileAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperProfile");
+                        processData.helperProfileSettingsAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperProfileSettings");
+                        processData.helperTimingAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperTiming");
+
+                        // Only available when helper is built with STATS_MODE
+                        var hookStatsAddress = nativeModuleInstance.FindExportName("luaHelperHookStats", IgnoreDataExports: false);
+
+                        if (hookStatsAddress != null)
+                            processData.helperHookStatsAddress = hookStatsAddress.CPUInstructionPart.InstructionPointer;
 
                         // Hooks for compatibility mode
                         processData.helperHookFunctionAddress_5_234_compat = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "LuaHelperHook_5_234_compat");
@@ -2949,9 +3708,16 @@ namespace LuaDkmDebuggerComponent
                         processData.helperCompatLuaClosureProtoOffset = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCompatLuaClosureProtoOffset");
                         processData.helperCompatLuaFunctionSourceOffset = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCompatLuaFunctionSourceOffset");
                         processData.helperCompatStringContentOffset = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCompatStringContentOffset");
+                        processData.helperCompatLuaStateTopOffset = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperCompatLuaStateTopOffset");
+
+                        processData.helperHookLayoutCountAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperHookLayoutCount");
+                        processData.helperHookLayoutsAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperHookLayouts");
 
                         processData.helperLuajitGetInfoAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperLuajitGetInfoAddress");
                         processData.helperLuajitGetStackAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperLuajitGetStackAddress");
+                        processData.helperLuajitFunctionModeAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperLuajitFunctionMode");
+                        processData.helperLuajitHookRemovalAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperLuajitHookRemoval");
+                        processData.helperJitFunctionCountAddress = AttachmentHelpers.FindVariableAddress(nativeModuleInstance, "luaHelperJitFunctionCount");
 
                         // Breakpoints for calls into debugger
                         processData.breakpointLuaHelperBreakpointHit = AttachmentHelpers.CreateHelperFunctionBreakpoint(nativeModuleInstance, "OnLuaHelperBreakpointHit").GetValueOrDefault(Guid.Empty);
@@ -2971,21 +3737,24 @@ namespace LuaDkmDebuggerComponent
                         if (processData.helperLuajitGetStackAddress != 0 && processData.luaGetStackAddress != 0)
                             DebugHelpers.TryWriteUlongVariable(process, processData.helperLuajitGetStackAddress, processData.luaGetStackAddress);
 
+                        WriteLuajitFunctionModeLocations(process, processData);
+
                         // Tell remote component about helper library locations
                         var data = new HelperLocationsMessage
                         {
-                            helperBreakCountAddress = processData.helperBreakCountAddress,
-                            helperBreakDataAddress = processData.helperBreakDataAddress,
+                            helperBreakTableAddress = processData.helperBreakTableAddress,
                             helperBreakHitIdAddress = processData.helperBreakHitIdAddress,
                             helperBreakHitLuaStateAddress = processData.helperBreakHitLuaStateAddress,
-                            helperBreakSourcesAddress = processData.helperBreakSourcesAddress,
 
                             helperStepOverAddress = processData.helperStepOverAddress,
                             helperStepIntoAddress = processData.helperStepIntoAddress,
                             helperStepOutAddress = processData.helperStepOutAddress,
-                            helperSkipDepthAddress = processData.helperSkipDepthAddress,
-                            helperStackDepthAtCallAddress = processData.helperStackDepthAtCall,
+                            helperStepStatesAddress = processData.helperStepStatesAddress,
+                            helperStepLuaStateAddress = processData.helperStepLuaStateAddress,
+                            helperStopRecordsAddress = processData.helperStopRecordsAddress,
                             helperAsyncBreakCodeAddress = processData.helperAsyncBreakCodeAddress,
+                            helperAsyncBreakEventAddress = processData.helperAsyncBreakEventAddress,
+                            helperLineHookSettingsAddress = processData.helperLineHookSettingsAddress,
 
                             breakpointLuaHelperBreakpointHit = processData.breakpointLuaHelperBreakpointHit,
                             breakpointLuaHelperStepComplete = processData.breakpointLuaHelperStepComplete,
@@ -3004,6 +3773,8 @@ namespace LuaDkmDebuggerComponent
 
                         message.SendLower();
 
+                        SendHelperConfiguration(process, processData);
+
                         // Handle Lua helper initialization sequence
                         var initialized = DebugHelpers.ReadIntVariable(process, variableAddress.CPUInstructionPart.InstructionPointer);
 
@@ -3041,6 +3812,8 @@ namespace LuaDkmDebuggerComponent
 
                                 processData.helperInitialized = true;
 
+                                DisableLuaInitializationBreakpoint(processData);
+
                                 if (processData.helperWorkingDirectoryAddress != 0)
                                 {
                                     processData.workingDirectoryRequested = true;
@@ -3113,6 +3886,8 @@ namespace LuaDkmDebuggerComponent
                     if (ljSetMode != 0)
                     {
                         LuaHelpers.luaVersion = LuaHelpers.luaVersionLuajit;
+
+                        processData.ljSetModeAddress = ljSetMode;
                     }
                     else
                     {
@@ -3129,14 +3904,14 @@ namespace LuaDkmDebuggerComponent
                     // Track Lua state initialization (breakpoint at the start of the function)
                     if (processData.luaLocations != null)
                     {
-                        processData.breakpointLuaInitialization = AttachmentHelpers.CreateTargetFunctionBreakpointAtAddress(process, processData.moduleWithLoadedLua, "lua_newstate", "initialization mark", processData.luaLocations.luaNewStateAtStart).GetValueOrDefault(Guid.Empty);
+                        processData.breakpointLuaInitialization = AttachmentHelpers.CreateTargetFunctionBreakpointObjectAtAddress(process, processData.moduleWithLoadedLua, "lua_newstate", "initialization mark", processData.luaLocations.luaNewStateAtStart, !processData.helperInitialized);
                     }
                     else
                     {
-                        processData.breakpointLuaInitialization = AttachmentHelpers.CreateTargetFunctionBreakpointAtDebugStart(process, processData.moduleWithLoadedLua, "lua_newstate", "initialization mark", out _).GetValueOrDefault(Guid.Empty);
+                        processData.breakpointLuaInitialization = AttachmentHelpers.CreateTargetFunctionBreakpointObjectAtDebugStart(process, processData.moduleWithLoadedLua, "lua_newstate", "initialization mark", out _, !processData.helperInitialized);
 
-                        if (processData.breakpointLuaInitialization == Guid.Empty)
-                            processData.breakpointLuaInitialization = AttachmentHelpers.CreateTargetFunctionBreakpointAtDebugStart(process, processData.moduleWithLoadedLua, "luaL_newstate", "initialization mark (outer)", out _).GetValueOrDefault(Guid.Empty);
+                        if (processData.breakpointLuaInitialization == null)
+                            processData.breakpointLuaInitialization = AttachmentHelpers.CreateTargetFunctionBreakpointObjectAtDebugStart(process, processData.moduleWithLoadedLua, "luaL_newstate", "initialization mark (outer)", out _, !processData.helperInitialized);
                     }
 
                     // Track Lua state creation (breakpoint at the end of the function)
@@ -3225,10 +4000,16 @@ namespace LuaDkmDebuggerComponent
                     {
                         processData.breakpointLuaThrowAddress = processData.luaLocations.luaThrow;
                         processData.breakpointLuaThrow = AttachmentHelpers.CreateTargetFunctionBreakpointObjectAtAddress(process, processData.moduleWithLoadedLua, "luaD_throw", "Lua script error", processData.luaLocations.luaThrow, false);
+
+                        processData.luaBasePcallAddress = processData.luaLocations.luaBasePcall;
+                        processData.luaBaseXpcallAddress = processData.luaLocations.luaBaseXpcall;
                     }
                     else
                     {
                         processData.breakpointLuaThrow = AttachmentHelpers.CreateTargetFunctionBreakpointObjectAtDebugStart(process, processData.moduleWithLoadedLua, "luaD_throw", "Lua script error", out processData.breakpointLuaThrowAddress, false);
+
+                        processData.luaBasePcallAddress = AttachmentHelpers.TryGetFunctionAddress(processData.moduleWithLoadedLua, "luaB_pcall", out _).GetValueOrDefault(0);
+                        processData.luaBaseXpcallAddress = AttachmentHelpers.TryGetFunctionAddress(processData.moduleWithLoadedLua, "luaB_xpcall", out _).GetValueOrDefault(0);
                     }
 
                     // Load luajit functions
@@ -3239,6 +4020,11 @@ namespace LuaDkmDebuggerComponent
                             processData.luaSetHookAddress = processData.luaLocations.luaSetHook;
                             processData.luaGetInfoAddress = processData.luaLocations.luaGetInfo;
                             processData.luaGetStackAddress = processData.luaLocations.luaGetStack;
+                            processData.luaSetTopAddress = processData.luaLocations.luaSetTop;
+                            processData.luaToPointerAddress = processData.luaLocations.luaToPointer;
+                            processData.luaRawGetIAddress = processData.luaLocations.luaRawGetI;
+                            processData.luaLibRefAddress = processData.luaLocations.luaLibRef;
+                            processData.luaLibUnrefAddress = processData.luaLocations.luaLibUnref;
 
                             processData.breakpointLuaRuntimeError = AttachmentHelpers.CreateTargetFunctionBreakpointAtAddress(process, processData.moduleWithLoadedLua, "lj_err_run", "LuaJIT runtime error", processData.luaLocations.ljErrRun).GetValueOrDefault(Guid.Empty);
 
@@ -3256,6 +4042,11 @@ namespace LuaDkmDebuggerComponent
                             processData.luaSetHookAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "lua_sethook");
                             processData.luaGetInfoAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "lua_getinfo");
                             processData.luaGetStackAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "lua_getstack");
+                            processData.luaSetTopAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "lua_settop");
+                            processData.luaToPointerAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "lua_topointer");
+                            processData.luaRawGetIAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "lua_rawgeti");
+                            processData.luaLibRefAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "luaL_ref");
+                            processData.luaLibUnrefAddress = AttachmentHelpers.FindFunctionAddress(nativeModuleInstance, "luaL_unref");
 
                             processData.breakpointLuaRuntimeError = AttachmentHelpers.CreateTargetFunctionBreakpointAtDebugStart(process, processData.moduleWithLoadedLua, "lj_err_run", "LuaJIT runtime error", out _).GetValueOrDefault(Guid.Empty);
 
@@ -3410,6 +4201,29 @@ namespace LuaDkmDebuggerComponent
             Schema.LuajitStateData.available = false;
         }
 
+        Dictionary<ulong, LuaCallStackFrameCacheEntry> GetCallStackFrameCache(LuaLocalProcessData processData, ulong stateAddress)
+        {
+            lock (processData.callStackFrameCache)
+            {
+                if (!processData.callStackFrameCache.TryGetValue(stateAddress, out Dictionary<ulong, LuaCallStackFrameCacheEntry> frameCache))
+                {
+                    frameCache = new Dictionary<ulong, LuaCallStackFrameCacheEntry>();
+
+                    processData.callStackFrameCache.Add(stateAddress, frameCache);
+                }
+
+                return frameCache;
+            }
+        }
+
+        void InvalidateCallStackFrameCache(LuaLocalProcessData processData, ulong stateAddress)
+        {
+            lock (processData.callStackFrameCache)
+            {
+                processData.callStackFrameCache.Remove(stateAddress);
+            }
+        }
+
         void LoadSchema(LuaLocalProcessData processData, DkmInspectionSession inspectionSession, DkmThread thread, DkmStackWalkFrame frame)
         {
             if (processData.schemaLoaded)
@@ -3438,156 +4252,441 @@ namespace LuaDkmDebuggerComponent
             if (processData.schemaLoadedLuajit)
                 return;
 
-            Schema.Luajit.LoadSchema(inspectionSession, thread, frame);
-            Schema.LuajitStateData.LoadSchema(inspectionSession, thread, frame);
+            Schema.Luajit.LoadSchema(inspectionSession, thread, frame);
+            Schema.LuajitStateData.LoadSchema(inspectionSession, thread, frame);
+
+            processData.schemaLoadedLuajit = true;
+        }
+
+        void SendVersionNotification(DkmProcess process, LuaLocalProcessData processData)
+        {
+            if (processData.versionNotificationSent)
+                return;
+
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+            {
+                if (DebugHelpers.Is64Bit(process))
+                {
+                    if (Schema.Luajit.fullPointer)
+                    {
+                        SendStatusMessage(process, 1, $"Lua: created (LuaJIT x64 GC64)");
+                    }
+                    else
+                    {
+                        SendStatusMessage(process, 1, $"Lua: created (LuaJIT x64 GC32)");
+                    }
+                }
+                else
+                {
+                    SendStatusMessage(process, 1, $"Lua: created (LuaJIT x86)");
+                }
+            }
+            else
+            {
+                string arch = DebugHelpers.Is64Bit(process) ? "x64" : "x86";
+
+                if (LuaHelpers.luaVersion != 0)
+                {
+                    SendStatusMessage(process, 1, $"Lua: created ({LuaHelpers.luaVersion / 100}.{LuaHelpers.luaVersion % 10} {arch})");
+                }
+                else
+                {
+                    SendStatusMessage(process, 1, $"Lua: created (unknown {arch})");
+                }
+            }
+
+            processData.versionNotificationSent = true;
+        }
+
+        void LoadPendingBreakpointDocuments(DkmProcess process, LuaLocalProcessData processData)
+        {
+            if (processData.pendingBreakpointDocumentsReady)
+                return;
+
+            foreach (var pendingBreakpoint in process.GetPendingBreakpoints())
+            {
+                if (pendingBreakpoint is DkmPendingFileLineBreakpoint pendingFileLineBreakpoint)
+                {
+                    var sourcePosition = pendingFileLineBreakpoint.GetCurrentSourcePosition();
+
+                    if (sourcePosition != null)
+                    {
+                        processData.pendingBreakpointDocuments.Add(sourcePosition.DocumentName);
+
+                        try
+                        {
+                            processData.pendingBreakpointFileNames.Add(Path.GetFileName(sourcePosition.DocumentName));
+                        }
+                        catch (ArgumentException)
+                        {
+                            log.Debug($"Invalid pending breakpoint document path '{sourcePosition.DocumentName}'");
+                        }
+                    }
+                }
+            }
+
+            processData.pendingBreakpointDocumentsReady = true;
+        }
+
+        bool HasPendingBreakpoint(DkmProcess process, LuaLocalProcessData processData, string filePath)
+        {
+            LoadPendingBreakpointDocuments(process, processData);
+
+            return processData.pendingBreakpointDocuments.Contains(filePath);
+        }
+
+        // Resolved script path keeps the file name of the script, so it can be checked without searching for the file
+        bool MightHavePendingBreakpoint(DkmProcess process, LuaLocalProcessData processData, string scriptName)
+        {
+            LoadPendingBreakpointDocuments(process, processData);
+
+            if (processData.pendingBreakpointFileNames.Count == 0)
+                return false;
+
+            if (scriptName.StartsWith("@"))
+                scriptName = scriptName.Substring(1);
+
+            try
+            {
+                return processData.pendingBreakpointFileNames.Contains(Path.GetFileName(scriptName.Replace('/', '\\')));
+            }
+            catch (ArgumentException)
+            {
+                return true;
+            }
+        }
+
+        void RegisterScriptBuffer(DkmProcess process, LuaLocalProcessData processData, ulong stateAddress, ulong scriptBufferAddress, long scriptSize, ulong scriptNameAddress)
+        {
+            // Buffer might not be available after the load, so script content is copied right away
+            byte[] rawScriptContent = DebugHelpers.ReadRawStringVariable(process, scriptBufferAddress, (int)scriptSize);
+
+            if (rawScriptContent == null)
+            {
+                log.Error("Failed to load script content from process");
+                return;
+            }
+
+            string scriptName = null;
+
+            if (scriptBufferAddress != scriptNameAddress)
+            {
+                scriptName = DebugHelpers.ReadStringVariable(process, scriptNameAddress, 1024);
+
+                if (scriptName == null)
+                {
+                    log.Error("Failed to load script name from process");
+                    return;
+                }
+            }
+
+            var record = new LuaScriptLoadRecord { stateAddress = stateAddress, scriptName = scriptName, content = rawScriptContent };
+
+            // Breakpoints have to be bound before the script starts executing
+            if (scriptName != null && MightHavePendingBreakpoint(process, processData, scriptName))
+            {
+                FlushScriptLoads(process, processData);
+
+                ProcessScriptLoad(process, processData, record);
+                return;
+            }
+
+            lock (processData.pendingScriptLoads)
+            {
+                processData.pendingScriptLoads.Add(record);
+
+                if (processData.pendingScriptLoads.Count < 256)
+                    return;
+            }
+
+            FlushScriptLoads(process, processData);
+        }
+
+        void FlushScriptLoads(DkmProcess process, LuaLocalProcessData processData)
+        {
+            List<LuaScriptLoadRecord> records;
+
+            lock (processData.pendingScriptLoads)
+            {
+                if (processData.pendingScriptLoads.Count == 0)
+                    return;
+
+                records = new List<LuaScriptLoadRecord>(processData.pendingScriptLoads);
 
-            processData.schemaLoadedLuajit = true;
+                processData.pendingScriptLoads.Clear();
+            }
+
+            log.Debug($"Registering {records.Count} script loads");
+
+            foreach (var record in records)
+                ProcessScriptLoad(process, processData, record);
         }
 
-        void SendVersionNotification(DkmProcess process, LuaLocalProcessData processData)
+        void ProcessScriptLoad(DkmProcess process, LuaLocalProcessData processData, LuaScriptLoadRecord record)
         {
-            if (processData.versionNotificationSent)
-                return;
+            ulong stateAddress = record.stateAddress;
+            byte[] rawScriptContent = record.content;
 
-            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+            string scriptContent = Encoding.UTF8.GetString(rawScriptContent, 0, rawScriptContent.Length);
+
+            string scriptName = record.scriptName;
+
+            if (scriptName == null)
             {
-                if (DebugHelpers.Is64Bit(process))
-                {
-                    if (Schema.Luajit.fullPointer)
-                    {
-                        SendStatusMessage(process, 1, $"Lua: created (LuaJIT x64 GC64)");
-                    }
-                    else
-                    {
-                        SendStatusMessage(process, 1, $"Lua: created (LuaJIT x64 GC32)");
-                    }
-                }
-                else
+                string badScriptName = scriptContent;
+
+                if (badScriptName.Length > 1023)
+                    badScriptName = badScriptName.Substring(0, 1023);
+
+                lock (processData.symbolStore)
                 {
-                    SendStatusMessage(process, 1, $"Lua: created (LuaJIT x86)");
+                    LuaStateSymbols stateSymbols = processData.symbolStore.FetchOrCreate(stateAddress);
+
+                    scriptName = $"unnamed_{processData.unnamedScriptId++}";
+
+                    if (!stateSymbols.unnamedScriptMapping.ContainsKey(badScriptName))
+                        stateSymbols.unnamedScriptMapping.Add(badScriptName, scriptName);
                 }
+
+                // Frames of this state might have been decoded with the script content as their source name
+                InvalidateCallStackFrameCache(processData, stateAddress);
             }
-            else
+
+            var sha1Hash = new SHA1Managed().ComputeHash(rawScriptContent);
+
+            lock (processData.symbolStore)
             {
-                string arch = DebugHelpers.Is64Bit(process) ? "x64" : "x86";
+                processData.symbolStore.FetchOrCreate(stateAddress).AddScriptSource(scriptName, scriptContent, sha1Hash);
+            }
 
-                if (LuaHelpers.luaVersion != 0)
+            log.Debug($"Adding script {scriptName} to symbol store of Lua state {stateAddress} (with content)");
+
+            string resolvedPath = TryFindSourcePath(process.Path, processData, scriptName, scriptContent, false, out string loadStatus);
+
+            if (resolvedPath != null)
+            {
+                if (HasPendingBreakpoint(process, processData, resolvedPath))
                 {
-                    SendStatusMessage(process, 1, $"Lua: created ({LuaHelpers.luaVersion / 100}.{LuaHelpers.luaVersion % 10} {arch})");
+                    log.Debug($"Reloading script {scriptName} pending breakpoints");
+
+                    var message = DkmCustomMessage.Create(process.Connection, process, Guid.Empty, MessageToVsService.reloadBreakpoints, Encoding.UTF8.GetBytes(resolvedPath), null);
+
+                    message.SendToVsService(Guids.luaVsPackageComponentGuid, true);
                 }
-                else
+
+                if (record.scriptName != null)
                 {
-                    SendStatusMessage(process, 1, $"Lua: created (unknown {arch})");
+                    ScriptLoadMessage scriptLoadMessage = new ScriptLoadMessage
+                    {
+                        name = scriptName,
+                        path = resolvedPath,
+                        status = loadStatus,
+                        content = scriptContent
+                    };
+
+                    DkmCustomMessage.Create(process.Connection, process, Guid.Empty, MessageToVsService.scriptLoad, scriptLoadMessage.Encode(), null).SendToVsService(Guids.luaVsPackageComponentGuid, false);
                 }
             }
-
-            processData.versionNotificationSent = true;
         }
 
-        bool HasPendingBreakpoint(DkmProcess process, LuaLocalProcessData processData, string filePath)
+        // Walks Lua call stack looking for 'pcall' or 'xpcall', protected calls made by the host application are not counted
+        bool IsLuaErrorCaughtByScript(DkmProcess process, LuaLocalProcessData processData, DkmInspectionSession inspectionSession, DkmThread thread, DkmStackWalkFrame frame)
         {
-            if (!processData.pendingBreakpointDocumentsReady)
+            // LuaJIT handles 'pcall' as a fast function without a call info
+            if (LuaHelpers.luaVersion == 0 || LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                return false;
+
+            if (processData.luaBasePcallAddress == 0 && processData.luaBaseXpcallAddress == 0)
+                return false;
+
+            ulong? callInfoAddress = EvaluationHelpers.TryEvaluateAddressExpression($"L->ci", inspectionSession, thread, frame, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects);
+
+            if (!callInfoAddress.HasValue)
+                return false;
+
+            ulong baseCallInfoAddress = 0;
+            ulong callInfoSize = 0;
+
+            if (LuaHelpers.luaVersion == 501)
             {
-                foreach (var pendingBreakpoint in process.GetPendingBreakpoints())
-                {
-                    if (pendingBreakpoint is DkmPendingFileLineBreakpoint pendingFileLineBreakpoint)
-                    {
-                        var sourcePosition = pendingFileLineBreakpoint.GetCurrentSourcePosition();
+                baseCallInfoAddress = EvaluationHelpers.TryEvaluateAddressExpression($"L->base_ci", inspectionSession, thread, frame, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects).GetValueOrDefault(0);
 
-                        if (sourcePosition != null)
-                            processData.pendingBreakpointDocuments.Add(sourcePosition.DocumentName);
-                    }
-                }
+                if (baseCallInfoAddress == 0)
+                    return false;
 
-                processData.pendingBreakpointDocumentsReady = true;
+                if (Schema.LuaFunctionCallInfoData.available)
+                    callInfoSize = (ulong)Schema.LuaFunctionCallInfoData.structSize;
+                else
+                    callInfoSize = DebugHelpers.Is64Bit(process) ? 40ul : 24ul;
             }
 
-            return processData.pendingBreakpointDocuments.Contains(filePath);
+            ulong currCallInfoAddress = callInfoAddress.Value;
+
+            // Limit the walk in case call info chain is corrupted
+            for (int i = 0; i < 4096 && currCallInfoAddress != 0; i++)
+            {
+                if (LuaHelpers.luaVersion == 501 && currCallInfoAddress <= baseCallInfoAddress)
+                    break;
+
+                LuaFunctionCallInfoData callInfoData = new LuaFunctionCallInfoData();
+
+                callInfoData.ReadFrom(process, currCallInfoAddress);
+                callInfoData.ReadFunction(process);
+
+                ulong functionAddress = 0;
+
+                if (callInfoData.func is LuaValueDataExternalFunction externalFunction)
+                    functionAddress = externalFunction.targetAddress;
+                else if (callInfoData.func is LuaValueDataExternalClosure externalClosure && externalClosure.value != null)
+                    functionAddress = externalClosure.value.functionAddress;
+
+                if (functionAddress != 0 && (functionAddress == processData.luaBasePcallAddress || functionAddress == processData.luaBaseXpcallAddress))
+                    return true;
+
+                if (LuaHelpers.luaVersion == 501)
+                    currCallInfoAddress -= callInfoSize;
+                else
+                    currCallInfoAddress = callInfoData.previousAddress;
+            }
+
+            return false;
         }
 
-        void RegisterScriptBuffer(DkmProcess process, LuaLocalProcessData processData, ulong stateAddress, ulong scriptBufferAddress, long scriptSize, ulong scriptNameAddress)
+        bool IsLuaErrorIgnored(LuaLocalProcessData processData, string message)
         {
-            byte[] rawScriptContent = DebugHelpers.ReadRawStringVariable(process, scriptBufferAddress, (int)scriptSize);
+            if (processData.configuration == null || processData.configuration.IgnoredErrors == null)
+                return false;
 
-            if (rawScriptContent != null)
+            foreach (var filter in processData.configuration.IgnoredErrors)
             {
-                string scriptContent = Encoding.UTF8.GetString(rawScriptContent, 0, rawScriptContent.Length);
+                if (!string.IsNullOrEmpty(filter) && message.Contains(filter))
+                    return true;
+            }
 
-                string scriptName;
+            return false;
+        }
 
-                if (scriptBufferAddress == scriptNameAddress)
-                {
-                    string badScriptName = scriptContent;
+        // Helper library switches functions with breakpoints to the interpreter, the rest of the code keeps JIT compilation
+        void WriteLuajitFunctionModeLocations(DkmProcess process, LuaLocalProcessData processData)
+        {
+            ulong[] functions = new ulong[]
+            {
+                processData.ljSetModeAddress,
+                processData.luaSetTopAddress,
+                processData.luaToPointerAddress,
+                processData.luaRawGetIAddress,
+                processData.luaLibRefAddress,
+                processData.luaLibUnrefAddress,
+                processData.luaSetHookAddress,
+            };
 
-                    if (badScriptName.Length > 1023)
-                        badScriptName = badScriptName.Substring(0, 1023);
+            if (functions.Any(el => el == 0) || processData.helperLuajitFunctionModeAddress == 0)
+                return;
 
-                    lock (processData.symbolStore)
-                    {
-                        LuaStateSymbols stateSymbols = processData.symbolStore.FetchOrCreate(stateAddress);
+            if (processData.configuration != null && !processData.configuration.LuajitInterpretBreakpointFunctions)
+                return;
 
-                        scriptName = $"unnamed_{processData.unnamedScriptId++}";
+            // Must match LuaHelperLuajitFunctionMode in the helper library
+            byte[] data = new byte[functions.Length * 8 + 8];
 
-                        if (!stateSymbols.unnamedScriptMapping.ContainsKey(badScriptName))
-                            stateSymbols.unnamedScriptMapping.Add(badScriptName, scriptName);
-                    }
-                }
-                else
-                {
-                    scriptName = DebugHelpers.ReadStringVariable(process, scriptNameAddress, 1024);
-                }
+            Buffer.BlockCopy(functions, 0, data, 0, functions.Length * 8);
 
-                if (scriptName != null)
-                {
-                    var sha1Hash = new SHA1Managed().ComputeHash(rawScriptContent);
+            // Without the closure layout, helper tracks each closure separately
+            if (Schema.Luajit.closurePcOffset.HasValue && Schema.Luajit.mrefSize != 0)
+            {
+                Array.Copy(BitConverter.GetBytes((uint)Schema.Luajit.closurePcOffset.Value), 0, data, functions.Length * 8, 4);
+                Array.Copy(BitConverter.GetBytes((uint)Schema.Luajit.mrefSize), 0, data, functions.Length * 8 + 4, 4);
+            }
 
-                    lock (processData.symbolStore)
-                    {
-                        processData.symbolStore.FetchOrCreate(stateAddress).AddScriptSource(scriptName, scriptContent, sha1Hash);
-                    }
+            processData.luajitFunctionModeEnabled = DebugHelpers.TryWriteRawBytes(process, processData.helperLuajitFunctionModeAddress, data);
+        }
 
-                    log.Debug($"Adding script {scriptName} to symbol store of Lua state {stateAddress} (with content)");
+        // Helper library has hooks with offsets fixed at compile time for common Lua library builds
+        ulong FindHelperHookLayout(DkmProcess process, LuaLocalProcessData processData, uint[] offsets)
+        {
+            // Must match LuaHelperHookLayout in the helper library
+            const int layoutSize = 48;
 
-                    string resolvedPath = TryFindSourcePath(process.Path, processData, scriptName, scriptContent, false, out string loadStatus);
+            if (processData.helperHookLayoutCountAddress == 0 || processData.helperHookLayoutsAddress == 0)
+                return 0;
 
-                    if (resolvedPath != null)
-                    {
-                        if (HasPendingBreakpoint(process, processData, resolvedPath))
-                        {
-                            log.Debug($"Reloading script {scriptName} pending breakpoints");
+            uint count = DebugHelpers.ReadUintVariable(process, processData.helperHookLayoutCountAddress).GetValueOrDefault(0);
 
-                            var message = DkmCustomMessage.Create(process.Connection, process, Guid.Empty, MessageToVsService.reloadBreakpoints, Encoding.UTF8.GetBytes(resolvedPath), null);
+            var batch = BatchRead.Create(process, processData.helperHookLayoutsAddress, (int)count * layoutSize);
 
-                            message.SendToVsService(Guids.luaVsPackageComponentGuid, true);
-                        }
+            if (batch == null)
+                return 0;
 
-                        if (scriptBufferAddress != scriptNameAddress)
-                        {
-                            ScriptLoadMessage scriptLoadMessage = new ScriptLoadMessage
-                            {
-                                name = scriptName,
-                                path = resolvedPath,
-                                status = loadStatus,
-                                content = scriptContent
-                            };
+            for (uint i = 0; i < count; i++)
+            {
+                ulong layoutAddress = processData.helperHookLayoutsAddress + i * layoutSize;
 
-                            DkmCustomMessage.Create(process.Connection, process, Guid.Empty, MessageToVsService.scriptLoad, scriptLoadMessage.Encode(), null).SendToVsService(Guids.luaVsPackageComponentGuid, false);
-                        }
-                    }
-                }
-                else
-                {
-                    log.Error("Failed to load script name from process");
-                }
+                bool matches = true;
+
+                for (int k = 0; k < offsets.Length && matches; k++)
+                    matches = DebugHelpers.ReadUintVariable(process, layoutAddress + (ulong)k * 4, batch) == offsets[k];
+
+                if (matches)
+                    return DebugHelpers.ReadUlongVariable(process, layoutAddress + 40, batch).GetValueOrDefault(0);
             }
-            else
+
+            return 0;
+        }
+
+        // Initialization breakpoint only holds Lua until the helper library is ready
+        void DisableLuaInitializationBreakpoint(LuaLocalProcessData processData)
+        {
+            if (processData.breakpointLuaInitialization != null)
             {
-                log.Error("Failed to load script content from process");
+                log.Debug("Helper is ready, disabling Lua initialization breakpoint");
+
+                processData.breakpointLuaInitialization.Disable();
+            }
+        }
+
+        void RegisterLuaStateWithLayout(DkmProcess process, LuaLocalProcessData processData, ulong stateAddress, LuaStateLayout layout)
+        {
+            log.Debug($"New Lua state 0x{stateAddress:x} version {layout.version} (known layout)");
+
+            lock (processData.symbolStore)
+            {
+                processData.symbolStore.FetchOrCreate(stateAddress);
             }
+
+            // LuaJIT hook is set through the Lua library functions
+            if (layout.version == LuaHelpers.luaVersionLuajit)
+                return;
+
+            var message = new RegisterStateMessage
+            {
+                stateAddress = stateAddress,
+
+                hookFunctionAddress = stateAddress + layout.hookFunctionOffset,
+                hookBaseCountAddress = stateAddress + layout.hookBaseCountOffset,
+                hookCountAddress = stateAddress + layout.hookCountOffset,
+                hookMaskAddress = stateAddress + layout.hookMaskOffset,
+
+                setTrapStateCallInfoOffset = layout.setTrapStateCallInfoOffset,
+                setTrapCallInfoPreviousOffset = layout.setTrapCallInfoPreviousOffset,
+                setTrapCallInfoCallStatusOffset = layout.setTrapCallInfoCallStatusOffset,
+                setTrapCallInfoTrapOffset = layout.setTrapCallInfoTrapOffset,
+
+                helperHookFunctionAddress = layout.helperHookFunctionAddress,
+            };
+
+            DkmCustomMessage.Create(process.Connection, process, MessageToRemote.guid, MessageToRemote.registerLuaState, message.Encode(), null).SendLower();
+
+            log.Debug("Hooked Lua state");
         }
 
         void RegisterLuaStateCreation(DkmProcess process, LuaLocalProcessData processData, DkmInspectionSession inspectionSession, DkmThread thread, DkmStackWalkFrame frame, ulong? stateAddress)
         {
+            if (stateAddress.HasValue && processData.stateLayout != null)
+            {
+                RegisterLuaStateWithLayout(process, processData, stateAddress.Value, processData.stateLayout);
+                return;
+            }
+
             if (useSchema || LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
             {
                 if (!processData.schemaLoaded)
@@ -3692,17 +4791,44 @@ namespace LuaDkmDebuggerComponent
 
                         if (hasSchemaForHook && LuaHelpers.luaVersion != 501)
                         {
-                            message.helperHookFunctionAddress = processData.helperHookFunctionAddress_5_234_compat;
-
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaDebugEventOffset, (uint)Schema.LuaDebugData.eventType.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaDebugCurrentLineOffset, (uint)Schema.LuaDebugData.currentLine.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaStateCallInfoOffset, (uint)Schema.LuaStateData.callInfoAddress.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatCallInfoFunctionOffset, (uint)Schema.LuaFunctionCallInfoData.funcAddress.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatTaggedValueTypeTagOffset, (uint)Schema.LuaValueData.typeAddress.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatTaggedValueValueOffset, (uint)Schema.LuaValueData.valueAddress.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaClosureProtoOffset, (uint)Schema.LuaClosureData.functionAddress.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaFunctionSourceOffset, (uint)Schema.LuaFunctionData.sourceAddress.GetValueOrDefault(0));
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperCompatStringContentOffset, (uint)LuaHelpers.GetStringDataOffset(process));
+                            // Same order as the offsets in the helper library layout table
+                            uint[] layoutOffsets = new uint[]
+                            {
+                                (uint)Schema.LuaDebugData.eventType.GetValueOrDefault(0),
+                                (uint)Schema.LuaDebugData.currentLine.GetValueOrDefault(0),
+                                (uint)Schema.LuaStateData.callInfoAddress.GetValueOrDefault(0),
+                                (uint)Schema.LuaFunctionCallInfoData.funcAddress.GetValueOrDefault(0),
+                                (uint)Schema.LuaValueData.typeAddress.GetValueOrDefault(0),
+                                (uint)Schema.LuaValueData.valueAddress.GetValueOrDefault(0),
+                                (uint)Schema.LuaClosureData.functionAddress.GetValueOrDefault(0),
+                                (uint)Schema.LuaFunctionData.sourceAddress.GetValueOrDefault(0),
+                                (uint)LuaHelpers.GetStringDataOffset(process),
+                                (uint)Schema.LuaStateData.topAddress_opt.GetValueOrDefault(0),
+                            };
+
+                            ulong layoutHookAddress = FindHelperHookLayout(process, processData, layoutOffsets);
+
+                            if (layoutHookAddress != 0)
+                            {
+                                log.Debug($"Using hook specialized for the Lua library layout at 0x{layoutHookAddress:x}");
+
+                                message.helperHookFunctionAddress = layoutHookAddress;
+                            }
+                            else
+                            {
+                                message.helperHookFunctionAddress = processData.helperHookFunctionAddress_5_234_compat;
+
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaDebugEventOffset, layoutOffsets[0]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaDebugCurrentLineOffset, layoutOffsets[1]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaStateCallInfoOffset, layoutOffsets[2]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatCallInfoFunctionOffset, layoutOffsets[3]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatTaggedValueTypeTagOffset, layoutOffsets[4]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatTaggedValueValueOffset, layoutOffsets[5]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaClosureProtoOffset, layoutOffsets[6]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaFunctionSourceOffset, layoutOffsets[7]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatStringContentOffset, layoutOffsets[8]);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperCompatLuaStateTopOffset, layoutOffsets[9]);
+                            }
                         }
                         else if (LuaHelpers.luaVersion == 501)
                         {
@@ -3721,9 +4847,39 @@ namespace LuaDkmDebuggerComponent
                             message.helperHookFunctionAddress = processData.helperHookFunctionAddress_5_4;
                         }
 
+                        // Sampling profiler finds the current instruction from the saved instruction pointer
+                        if (processData.helperProfileSettingsAddress != 0 && LuaHelpers.luaVersion != 501)
+                        {
+                            ulong? savedPcOffset = EvaluationHelpers.TryEvaluateAddressExpression($"&((CallInfo*)0)->u.l.savedpc", inspectionSession, thread, frame, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects);
+                            ulong? protoCodeOffset = EvaluationHelpers.TryEvaluateAddressExpression($"&((Proto*)0)->code", inspectionSession, thread, frame, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects);
+
+                            if (savedPcOffset.HasValue && protoCodeOffset.HasValue)
+                            {
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperProfileSettingsAddress, (uint)savedPcOffset.Value);
+                                DebugHelpers.TryWriteUintVariable(process, processData.helperProfileSettingsAddress + 4, (uint)protoCodeOffset.Value);
+                            }
+                        }
+
                         DkmCustomMessage.Create(process.Connection, process, MessageToRemote.guid, MessageToRemote.registerLuaState, message.Encode(), null).SendLower();
 
                         log.Debug("Hooked Lua state");
+
+                        processData.stateLayout = new LuaStateLayout
+                        {
+                            version = LuaHelpers.luaVersion,
+
+                            hookFunctionOffset = message.hookFunctionAddress - stateAddress.Value,
+                            hookBaseCountOffset = message.hookBaseCountAddress - stateAddress.Value,
+                            hookCountOffset = message.hookCountAddress - stateAddress.Value,
+                            hookMaskOffset = message.hookMaskAddress - stateAddress.Value,
+
+                            setTrapStateCallInfoOffset = message.setTrapStateCallInfoOffset,
+                            setTrapCallInfoPreviousOffset = message.setTrapCallInfoPreviousOffset,
+                            setTrapCallInfoCallStatusOffset = message.setTrapCallInfoCallStatusOffset,
+                            setTrapCallInfoTrapOffset = message.setTrapCallInfoTrapOffset,
+
+                            helperHookFunctionAddress = message.helperHookFunctionAddress,
+                        };
                     }
                     else
                     {
@@ -3734,6 +4890,10 @@ namespace LuaDkmDebuggerComponent
                 {
                     DebugHelpers.TryWriteUlongVariable(process, processData.helperLuajitGetInfoAddress, processData.luaGetInfoAddress);
                     DebugHelpers.TryWriteUlongVariable(process, processData.helperLuajitGetStackAddress, processData.luaGetStackAddress);
+
+                    WriteLuajitFunctionModeLocations(process, processData);
+
+                    processData.stateLayout = new LuaStateLayout { version = LuaHelpers.luaVersionLuajit };
                 }
                 else
                 {
@@ -3783,7 +4943,44 @@ namespace LuaDkmDebuggerComponent
             }
         }
 
+        void IDkmProcessExecutionNotifications.OnProcessPause(DkmProcess process, DkmProcessExecutionCounters processCounters)
+        {
+            DebugHelpers.GetOrCreateDataItem<ProcessMemoryCache>(process).BeginStop();
+
+            // Reports that rewrite whole outputs are made on the first call stack walk of the stop
+            DebugHelpers.GetOrCreateDataItem<LuaLocalProcessData>(process).stopReportPending = true;
+        }
+
+        void IDkmProcessExecutionNotifications.OnProcessResume(DkmProcess process, DkmProcessExecutionCounters processCounters)
+        {
+            var cache = process.GetDataItem<ProcessMemoryCache>();
+
+            if (cache != null)
+            {
+                log.Debug($"Memory cache hit rate {cache.HitRate:F1}% ({cache.hits} hits, {cache.misses} page reads)");
+
+                cache.EndStop();
+            }
+        }
+
+        // Messages from remote component are sent while the process is stopped
         DkmCustomMessage IDkmCustomMessageCallbackReceiver.SendHigher(DkmCustomMessage customMessage)
+        {
+            var cache = DebugHelpers.GetOrCreateDataItem<ProcessMemoryCache>(customMessage.Process);
+
+            cache.BeginStop();
+
+            try
+            {
+                return HandleMessageFromRemote(customMessage);
+            }
+            finally
+            {
+                cache.EndStop();
+            }
+        }
+
+        DkmCustomMessage HandleMessageFromRemote(DkmCustomMessage customMessage)
         {
             log.Debug($"IDkmCustomMessageCallbackReceiver.SendHigher begin");
 
@@ -3799,7 +4996,7 @@ namespace LuaDkmDebuggerComponent
 
                 var thread = process.GetThreads().FirstOrDefault(el => el.UniqueId == data.threadId);
 
-                if (data.breakpointId == processData.breakpointLuaInitialization || data.breakpointId == processData.breakpointLuaThreadCreateExternalStart)
+                if ((processData.breakpointLuaInitialization != null && data.breakpointId == processData.breakpointLuaInitialization.UniqueId) || data.breakpointId == processData.breakpointLuaThreadCreateExternalStart)
                 {
                     if (data.breakpointId == processData.breakpointLuaThreadCreateExternalStart)
                     {
@@ -3909,15 +5106,30 @@ namespace LuaDkmDebuggerComponent
 
                     ulong? stateAddress = EvaluationHelpers.TryEvaluateAddressExpression($"L", inspectionSession, thread, frame, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects);
 
+                    // Functions of the closing state can still be named, write out the timing data collected since the last stop
+                    if (processData.helperTimingAddress != 0 && processData.configuration != null && !string.IsNullOrEmpty(processData.configuration.TimingOutput))
+                    {
+                        DrainTimingBuffers(process, processData);
+                        WriteTimingOutput(process, processData);
+                    }
+
                     if (stateAddress.HasValue)
                     {
                         log.Debug($"Removing Lua state 0x{stateAddress:x} from symbol store");
 
+                        // Scripts loaded before state destruction shouldn't be registered after it
+                        lock (processData.pendingScriptLoads)
+                        {
+                            processData.pendingScriptLoads.RemoveAll(el => el.stateAddress == stateAddress.Value);
+                        }
+
                         lock (processData.symbolStore)
                         {
                             processData.symbolStore.Remove(stateAddress.Value);
                         }
 
+                        InvalidateCallStackFrameCache(processData, stateAddress.Value);
+
                         var message = new UnregisterStateMessage
                         {
                             stateAddress = stateAddress.Value,
@@ -4100,6 +5312,8 @@ namespace LuaDkmDebuggerComponent
                     processData.helperInitializationWaitActive = false;
                     processData.helperInitialized = true;
 
+                    DisableLuaInitializationBreakpoint(processData);
+
                     if (processData.helperInitializationSuspensionThread != null)
                     {
                         log.Debug("Resuming Lua thread");
@@ -4137,6 +5351,22 @@ namespace LuaDkmDebuggerComponent
                         return null;
                     }
 
+                    if (processData.configuration == null || !processData.configuration.BreakOnCaughtErrors)
+                    {
+                        var inspectionSession = EvaluationHelpers.CreateInspectionSession(process, thread, data, out DkmStackWalkFrame frame);
+
+                        bool caught = IsLuaErrorCaughtByScript(process, processData, inspectionSession, thread, frame);
+
+                        inspectionSession.Close();
+
+                        if (caught)
+                        {
+                            log.Debug("Error will be caught by a protected call, ignoring");
+
+                            return null;
+                        }
+                    }
+
                     log.Debug("Enabling a trap at next luaD_throw");
 
                     if (processData.breakpointLuaThrow != null)
@@ -4160,6 +5390,26 @@ namespace LuaDkmDebuggerComponent
                         {
                             var description = value.AsSimpleDisplayString(10);
 
+                            if (IsLuaErrorIgnored(processData, description))
+                            {
+                                log.Debug($"Error '{description}' matches an ignored error filter");
+
+                                return null;
+                            }
+
+                            ulong stateAddress = EvaluationHelpers.TryEvaluateAddressExpression($"L", inspectionSession, thread, frame, DkmEvaluationFlags.TreatAsExpression | DkmEvaluationFlags.NoSideEffects).GetValueOrDefault(0);
+
+                            // Error that is rethrown while unwinding is reported once
+                            if (stateAddress == processData.lastReportedErrorState && description == processData.lastReportedErrorMessage)
+                            {
+                                log.Debug($"Error '{description}' was already reported");
+
+                                return null;
+                            }
+
+                            processData.lastReportedErrorState = stateAddress;
+                            processData.lastReportedErrorMessage = description;
+
                             return DkmCustomMessage.Create(process.Connection, process, MessageToRemote.guid, MessageToRemote.throwException, Encoding.UTF8.GetBytes(description), null);
                         }
                         else
@@ -4179,7 +5429,29 @@ namespace LuaDkmDebuggerComponent
 
                     var inspectionSession = EvaluationHelpers.CreateInspectionSession(process, thread, data, out DkmStackWalkFrame frame);
 
-                    if (code == 1)
+                    if (code == helperAsyncBreakCommands)
+                    {
+                        log.Debug("Helper has space for pending commands");
+                    }
+                    else if (code == helperAsyncBreakTrace)
+                    {
+                        // Tracepoint hits are shown without waiting for the process to stop
+                        if (processData.helperTraceBufferAddress != 0 && processData.configuration != null)
+                            DrainTraceBuffer(process, processData);
+                    }
+                    else if (code == helperAsyncBreakProfile)
+                    {
+                        // Profile is updated during a live session without waiting for the process to stop
+                        if (processData.helperProfileAddress != 0 && processData.configuration != null && processData.configuration.ProfileInterval > 0)
+                            ReportProfile(process, processData);
+                    }
+                    else if (code == helperAsyncBreakTiming)
+                    {
+                        // Timing buffers are drained before they wrap around, output files are written when the process stops
+                        if (processData.helperTimingAddress != 0 && processData.configuration != null && !string.IsNullOrEmpty(processData.configuration.TimingOutput))
+                            DrainTimingBuffers(process, processData);
+                    }
+                    else if (code == 1 || code == 3)
                     {
                         if (processData.luaSetHookAddress == 0)
                         {
@@ -4187,54 +5459,61 @@ namespace LuaDkmDebuggerComponent
                             return null;
                         }
 
+                        // Functions switched to the interpreter have to be switched back by their Lua state, hook removes itself after that
+                        bool hooksRemovedByHelper = code == 3 && processData.luajitFunctionModeEnabled && DebugHelpers.ReadUintVariable(process, processData.helperJitFunctionCountAddress).GetValueOrDefault(0) != 0;
+
+                        DebugHelpers.TryWriteUintVariable(process, processData.helperLuajitHookRemovalAddress, hooksRemovedByHelper ? 1u : 0u);
+
                         List<ulong> states = new List<ulong>();
 
                         lock (processData.symbolStore)
                         {
-                            foreach (var state in processData.symbolStore.knownStates)
-                                states.Add(state.Key);
+                            if (!hooksRemovedByHelper)
+                            {
+                                foreach (var state in processData.symbolStore.knownStates)
+                                    states.Add(state.Key);
+                            }
                         }
 
-                        if (states.Count > 0)
+                        for (int start = 0; start < states.Count; start += helperCommandMaxStates)
                         {
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperAsyncBreakCodeAddress, 2u);
+                            int count = Math.Min(helperCommandMaxStates, states.Count - start);
 
-                            uint index = 0;
-                            DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, processData.luaSetHookAddress);
-                            DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, processData.helperHookFunctionAddress_luajit);
+                            var command = new List<ulong>();
 
-                            foreach (var state in states)
-                                DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, state);
-                            DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, 0);
-                        }
-                    }
-                    else if (code == 3)
-                    {
-                        List<ulong> states = new List<ulong>();
+                            command.Add(helperCommandSetHook);
+                            command.Add(processData.luaSetHookAddress);
 
-                        lock (processData.symbolStore)
-                        {
-                            foreach (var state in processData.symbolStore.knownStates)
-                                states.Add(state.Key);
-                        }
+                            int profileInterval = processData.configuration != null ? Math.Max(processData.configuration.ProfileInterval, 0) : 0;
 
-                        if (states.Count > 0)
-                        {
-                            DebugHelpers.TryWriteUintVariable(process, processData.helperAsyncBreakCodeAddress, 4u);
+                            if (code == 1)
+                            {
+                                command.Add(processData.helperHookFunctionAddress_luajit);
+
+                                // LUA_HOOKLINE | LUA_HOOKCALL | LUA_HOOKRET and LUA_HOOKCOUNT for sampling profiler
+                                command.Add(profileInterval != 0 ? 15ul : 7ul);
+                                command.Add((ulong)profileInterval);
+                            }
+                            else
+                            {
+                                command.Add(0);
+                                command.Add(0);
+                                command.Add(0);
+                            }
 
-                            uint index = 0;
-                            DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, processData.luaSetHookAddress);
-                            DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, 0);
+                            command.Add((ulong)count);
+                            command.AddRange(states.GetRange(start, count));
 
-                            foreach (var state in states)
-                                DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, state);
-                            DebugHelpers.TryWriteUlongVariable(process, processData.helperAsyncBreakDataAddress + index++ * 8, 0);
+                            processData.pendingHelperCommands.Add(command);
                         }
                     }
                     else
                     {
                         log.Error("Unknown async break code");
                     }
+
+                    // Helper thread executes the commands after this notification
+                    FlushHelperCommands(process, processData);
                 }
                 else
                 {
@@ -59,6 +59,9 @@ namespace LuaDkmDebuggerComponent
                     locations.luaRunError = AttachmentHelpers.TryGetFunctionAddressAtDebugStart(nativeModuleInstance, "luaG_runerror", out _).GetValueOrDefault(0);
                     locations.luaThrow = AttachmentHelpers.TryGetFunctionAddressAtDebugStart(nativeModuleInstance, "luaD_throw", out _).GetValueOrDefault(0);
 
+                    locations.luaBasePcall = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "luaB_pcall", out _).GetValueOrDefault(0);
+                    locations.luaBaseXpcall = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "luaB_xpcall", out _).GetValueOrDefault(0);
+
                     locations.luaPcall = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_pcall", out _).GetValueOrDefault(0);
                     locations.luaPcallk = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_pcallk", out _).GetValueOrDefault(0);
 
@@ -73,6 +76,11 @@ namespace LuaDkmDebuggerComponent
                         locations.luaSetHook = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_sethook", out _).GetValueOrDefault(0);
                         locations.luaGetInfo = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_getinfo", out _).GetValueOrDefault(0);
                         locations.luaGetStack = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_getstack", out _).GetValueOrDefault(0);
+                        locations.luaSetTop = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_settop", out _).GetValueOrDefault(0);
+                        locations.luaToPointer = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_topointer", out _).GetValueOrDefault(0);
+                        locations.luaRawGetI = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "lua_rawgeti", out _).GetValueOrDefault(0);
+                        locations.luaLibRef = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "luaL_ref", out _).GetValueOrDefault(0);
+                        locations.luaLibUnref = AttachmentHelpers.TryGetFunctionAddress(nativeModuleInstance, "luaL_unref", out _).GetValueOrDefault(0);
 
                         locations.ljErrRun = AttachmentHelpers.TryGetFunctionAddressAtDebugStart(nativeModuleInstance, "lj_err_run", out _).GetValueOrDefault(0);
                         locations.ljErrThrow = AttachmentHelpers.TryGetFunctionAddressAtDebugStart(nativeModuleInstance, "lj_err_throw", out _).GetValueOrDefault(0);
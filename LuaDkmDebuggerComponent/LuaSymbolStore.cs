@@ -129,6 +129,19 @@ namespace LuaDkmDebuggerComponent
             return null;
         }
 
+        public string FetchFunctionName(ulong address)
+        {
+            foreach (var state in knownStates)
+            {
+                var functionName = state.Value.FetchFunctionName(address);
+
+                if (functionName != null)
+                    return functionName;
+            }
+
+            return null;
+        }
+
         public LuaScriptSymbols FetchScriptSource(string sourceFileName)
         {
             foreach (var state in knownStates)
@@ -0,0 +1,209 @@
+using System;
+using System.Collections.Generic;
+using System.Globalization;
+using System.Linq;
+using System.Text;
+
+namespace LuaDkmDebuggerComponent
+{
+    // Must match LUA_HELPER_TIMING_* constants in the helper library
+    public enum LuaTimingEvent
+    {
+        Call = 1,
+        Return = 2,
+        Tail = 3,
+    }
+
+    public class LuaFunctionTiming
+    {
+        public string name;
+
+        public long calls = 0;
+        public long inclusiveTicks = 0;
+        public long exclusiveTicks = 0;
+    }
+
+    // Rebuilds per-thread call stacks from helper library call/return records
+    public class LuaTimingProfile
+    {
+        class Frame
+        {
+            public ulong function;
+            public string name;
+            public string path;
+            public long start;
+            public long childTicks;
+        }
+
+        // In Lua 5.2+ tail event is a tail call that replaces the current frame, in Lua 5.1 and LuaJIT it ends a replaced frame
+        public bool tailEventIsCall = true;
+
+        public int maxTraceEvents = 200000;
+        public long droppedTraceEvents = 0;
+
+        public Func<ulong, string> resolveName = null;
+
+        public long baseTimestamp = long.MaxValue;
+
+        public Dictionary<string, long> collapsedStacks = new Dictionary<string, long>();
+        public Dictionary<ulong, LuaFunctionTiming> functions = new Dictionary<ulong, LuaFunctionTiming>();
+
+        Dictionary<uint, List<Frame>> threads = new Dictionary<uint, List<Frame>>();
+        Dictionary<ulong, string> names = new Dictionary<ulong, string>();
+
+        List<(uint threadId, string name, long start, long duration)> traceEvents = new List<(uint, string, long, long)>();
+
+        string GetName(ulong function)
+        {
+            if (names.TryGetValue(function, out string name))
+                return name;
+
+            name = resolveName != null ? resolveName(function) : null;
+
+            if (name == null)
+                name = $"0x{function:x}";
+
+            names.Add(function, name);
+
+            return name;
+        }
+
+        public void AddRecord(uint threadId, long timestamp, LuaTimingEvent timingEvent, ulong function)
+        {
+            if (!threads.TryGetValue(threadId, out List<Frame> stack))
+            {
+                stack = new List<Frame>();
+
+                threads.Add(threadId, stack);
+            }
+
+            if (timestamp < baseTimestamp)
+                baseTimestamp = timestamp;
+
+            if (timingEvent == LuaTimingEvent.Call)
+            {
+                PushFrame(stack, function, timestamp);
+            }
+            else if (timingEvent == LuaTimingEvent.Return)
+            {
+                // Recording might have started in the middle of the call stack, and events might have been lost
+                int index = stack.FindLastIndex(el => el.function == function);
+
+                if (index == -1)
+                    return;
+
+                while (stack.Count > index)
+                    PopFrame(threadId, stack, timestamp);
+            }
+            else if (timingEvent == LuaTimingEvent.Tail)
+            {
+                if (stack.Count != 0)
+                    PopFrame(threadId, stack, timestamp);
+
+                if (tailEventIsCall)
+                    PushFrame(stack, function, timestamp);
+            }
+        }
+
+        void PushFrame(List<Frame> stack, ulong function, long timestamp)
+        {
+            string name = GetName(function);
+
+            string path = stack.Count != 0 ? stack[stack.Count - 1].path + ";" + name : name;
+
+            stack.Add(new Frame { function = function, name = name, path = path, start = timestamp, childTicks = 0 });
+        }
+
+        void PopFrame(uint threadId, List<Frame> stack, long timestamp)
+        {
+            var frame = stack[stack.Count - 1];
+
+            stack.RemoveAt(stack.Count - 1);
+
+            long inclusive = Math.Max(timestamp - frame.start, 0);
+            long exclusive = Math.Max(inclusive - frame.childTicks, 0);
+
+            if (stack.Count != 0)
+                stack[stack.Count - 1].childTicks += inclusive;
+
+            collapsedStacks[frame.path] = collapsedStacks.TryGetValue(frame.path, out long ticks) ? ticks + exclusive : exclusive;
+
+            if (!functions.TryGetValue(frame.function, out LuaFunctionTiming timing))
+            {
+                timing = new LuaFunctionTiming { name = frame.name };
+
+                functions.Add(frame.function, timing);
+            }
+
+            timing.calls++;
+            timing.exclusiveTicks += exclusive;
+
+            // Recursive calls are counted once
+            if (!stack.Any(el => el.function == frame.function))
+                timing.inclusiveTicks += inclusive;
+
+            if (traceEvents.Count < maxTraceEvents)
+                traceEvents.Add((threadId, frame.name, frame.start, inclusive));
+            else
+                droppedTraceEvents++;
+        }
+
+        static string ToMicroseconds(long ticks, long frequency)
+        {
+            return (ticks * 1000000.0 / frequency).ToString("F3", CultureInfo.InvariantCulture);
+        }
+
+        static string EscapeJson(string str)
+        {
+            var result = new StringBuilder();
+
+            foreach (char ch in str)
+            {
+                if (ch == '"' || ch == '\\')
+                    result.Append('\\').Append(ch);
+                else if (ch < ' ')
+                    result.Append($"\\u{(int)ch:x4}");
+                else
+                    result.Append(ch);
+            }
+
+            return result.ToString();
+        }
+
+        // Format used by flamegraph.pl and speedscope, values are exclusive microseconds
+        public string ExportCollapsedStacks(long frequency)
+        {
+            var result = new StringBuilder();
+
+            foreach (var el in collapsedStacks.OrderBy(el => el.Key, StringComparer.Ordinal))
+            {
+                long microseconds = el.Value * 1000000 / frequency;
+
+                if (microseconds != 0)
+                    result.Append($"{el.Key} {microseconds}\n");
+            }
+
+            return result.ToString();
+        }
+
+        // Chrome trace event format (chrome://tracing, Perfetto), complete events are created when frames end
+        public string ExportChromeTrace(long frequency)
+        {
+            var result = new StringBuilder();
+
+            result.Append("{\"traceEvents\":[\n");
+
+            for (int i = 0; i < traceEvents.Count; i++)
+            {
+                var el = traceEvents[i];
+
+                result.Append($"{{\"name\":\"{EscapeJson(el.name)}\",\"ph\":\"X\",\"pid\":1,\"tid\":{el.threadId},\"ts\":{ToMicroseconds(el.start - baseTimestamp, frequency)},\"dur\":{ToMicroseconds(el.duration, frequency)}}}");
+                result.Append(i + 1 < traceEvents.Count ? ",\n" : "\n");
+            }
+
+            result.Append("],\"displayTimeUnit\":\"ms\"}\n");
+
+            return result.ToString();
+        }
+    }
+}
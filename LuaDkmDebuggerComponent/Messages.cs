@@ -1,4 +1,5 @@
 using System;
+using System.Collections.Generic;
 using System.Collections.ObjectModel;
 using System.IO;
 
@@ -54,18 +55,19 @@ namespace LuaDkmDebuggerComponent
 
     public class HelperLocationsMessage
     {
-        public ulong helperBreakCountAddress = 0;
-        public ulong helperBreakDataAddress = 0;
+        public ulong helperBreakTableAddress = 0;
         public ulong helperBreakHitIdAddress = 0;
         public ulong helperBreakHitLuaStateAddress = 0;
-        public ulong helperBreakSourcesAddress = 0;
 
         public ulong helperStepOverAddress = 0;
         public ulong helperStepIntoAddress = 0;
         public ulong helperStepOutAddress = 0;
-        public ulong helperSkipDepthAddress = 0;
-        public ulong helperStackDepthAtCallAddress = 0;
+        public ulong helperStepStatesAddress = 0;
+        public ulong helperStepLuaStateAddress = 0;
+        public ulong helperStopRecordsAddress = 0;
         public ulong helperAsyncBreakCodeAddress = 0;
+        public ulong helperAsyncBreakEventAddress = 0;
+        public ulong helperLineHookSettingsAddress = 0;
 
         public Guid breakpointLuaHelperBreakpointHit;
         public Guid breakpointLuaHelperStepComplete;
@@ -85,18 +87,19 @@ namespace LuaDkmDebuggerComponent
             {
                 using (var writer = new BinaryWriter(stream))
                 {
-                    writer.Write(helperBreakCountAddress);
-                    writer.Write(helperBreakDataAddress);
+                    writer.Write(helperBreakTableAddress);
                     writer.Write(helperBreakHitIdAddress);
                     writer.Write(helperBreakHitLuaStateAddress);
-                    writer.Write(helperBreakSourcesAddress);
 
                     writer.Write(helperStepOverAddress);
                     writer.Write(helperStepIntoAddress);
                     writer.Write(helperStepOutAddress);
-                    writer.Write(helperSkipDepthAddress);
-                    writer.Write(helperStackDepthAtCallAddress);
+                    writer.Write(helperStepStatesAddress);
+                    writer.Write(helperStepLuaStateAddress);
+                    writer.Write(helperStopRecordsAddress);
                     writer.Write(helperAsyncBreakCodeAddress);
+                    writer.Write(helperAsyncBreakEventAddress);
+                    writer.Write(helperLineHookSettingsAddress);
 
                     writer.Write(breakpointLuaHelperBreakpointHit.ToByteArray());
                     writer.Write(breakpointLuaHelperStepComplete.ToByteArray());
@@ -123,18 +126,19 @@ namespace LuaDkmDebuggerComponent
             {
                 using (var reader = new BinaryReader(stream))
                 {
-                    helperBreakCountAddress = reader.ReadUInt64();
-                    helperBreakDataAddress = reader.ReadUInt64();
+                    helperBreakTableAddress = reader.ReadUInt64();
                     helperBreakHitIdAddress = reader.ReadUInt64();
                     helperBreakHitLuaStateAddress = reader.ReadUInt64();
-                    helperBreakSourcesAddress = reader.ReadUInt64();
 
                     helperStepOverAddress = reader.ReadUInt64();
                     helperStepIntoAddress = reader.ReadUInt64();
                     helperStepOutAddress = reader.ReadUInt64();
-                    helperSkipDepthAddress = reader.ReadUInt64();
-                    helperStackDepthAtCallAddress = reader.ReadUInt64();
+                    helperStepStatesAddress = reader.ReadUInt64();
+                    helperStepLuaStateAddress = reader.ReadUInt64();
+                    helperStopRecordsAddress = reader.ReadUInt64();
                     helperAsyncBreakCodeAddress = reader.ReadUInt64();
+                    helperAsyncBreakEventAddress = reader.ReadUInt64();
+                    helperLineHookSettingsAddress = reader.ReadUInt64();
 
                     breakpointLuaHelperBreakpointHit = new Guid(reader.ReadBytes(16));
                     breakpointLuaHelperStepComplete = new Guid(reader.ReadBytes(16));
@@ -282,6 +286,9 @@ namespace LuaDkmDebuggerComponent
         public ulong luaRunError = 0;
         public ulong luaThrow = 0;
 
+        public ulong luaBasePcall = 0;
+        public ulong luaBaseXpcall = 0;
+
         public ulong luaPcall = 0;
         public ulong luaPcallk = 0;
 
@@ -294,6 +301,11 @@ namespace LuaDkmDebuggerComponent
         public ulong luaSetHook = 0;
         public ulong luaGetInfo = 0;
         public ulong luaGetStack = 0;
+        public ulong luaSetTop = 0;
+        public ulong luaToPointer = 0;
+        public ulong luaRawGetI = 0;
+        public ulong luaLibRef = 0;
+        public ulong luaLibUnref = 0;
 
         public ulong ljErrRun = 0;
         public ulong ljErrThrow = 0;
@@ -320,6 +332,8 @@ namespace LuaDkmDebuggerComponent
                     writer.Write(luaError);
                     writer.Write(luaRunError);
                     writer.Write(luaThrow);
+                    writer.Write(luaBasePcall);
+                    writer.Write(luaBaseXpcall);
                     writer.Write(luaPcall);
                     writer.Write(luaPcallk);
 
@@ -329,6 +343,11 @@ namespace LuaDkmDebuggerComponent
                     writer.Write(luaSetHook);
                     writer.Write(luaGetInfo);
                     writer.Write(luaGetStack);
+                    writer.Write(luaSetTop);
+                    writer.Write(luaToPointer);
+                    writer.Write(luaRawGetI);
+                    writer.Write(luaLibRef);
+                    writer.Write(luaLibUnref);
                     writer.Write(ljErrRun);
                     writer.Write(ljErrThrow);
 
@@ -361,6 +380,8 @@ namespace LuaDkmDebuggerComponent
                     luaError = reader.ReadUInt64();
                     luaRunError = reader.ReadUInt64();
                     luaThrow = reader.ReadUInt64();
+                    luaBasePcall = reader.ReadUInt64();
+                    luaBaseXpcall = reader.ReadUInt64();
                     luaPcall = reader.ReadUInt64();
                     luaPcallk = reader.ReadUInt64();
 
@@ -370,6 +391,11 @@ namespace LuaDkmDebuggerComponent
                     luaSetHook = reader.ReadUInt64();
                     luaGetInfo = reader.ReadUInt64();
                     luaGetStack = reader.ReadUInt64();
+                    luaSetTop = reader.ReadUInt64();
+                    luaToPointer = reader.ReadUInt64();
+                    luaRawGetI = reader.ReadUInt64();
+                    luaLibRef = reader.ReadUInt64();
+                    luaLibUnref = reader.ReadUInt64();
                     ljErrRun = reader.ReadUInt64();
                     ljErrThrow = reader.ReadUInt64();
                 }
@@ -426,4 +452,86 @@ namespace LuaDkmDebuggerComponent
             }
         }
     }
+
+    public class TracepointsMessage
+    {
+        public List<string> sources = new List<string>();
+        public List<int> lines = new List<int>();
+
+        public byte[] Encode()
+        {
+            using (var stream = new MemoryStream())
+            {
+                using (var writer = new BinaryWriter(stream))
+                {
+                    writer.Write(sources.Count);
+
+                    for (int i = 0; i < sources.Count; i++)
+                    {
+                        writer.Write(sources[i]);
+                        writer.Write(lines[i]);
+                    }
+
+                    writer.Flush();
+
+                    return stream.ToArray();
+                }
+            }
+        }
+
+        public bool ReadFrom(byte[] data)
+        {
+            using (var stream = new MemoryStream(data))
+            {
+                using (var reader = new BinaryReader(stream))
+                {
+                    int count = reader.ReadInt32();
+
+                    for (int i = 0; i < count; i++)
+                    {
+                        sources.Add(reader.ReadString());
+                        lines.Add(reader.ReadInt32());
+                    }
+                }
+            }
+
+            return true;
+        }
+    }
+
+    public class ProfilerSettingsMessage
+    {
+        public int sampleInterval = 0;
+        public bool timing = false;
+
+        public byte[] Encode()
+        {
+            using (var stream = new MemoryStream())
+            {
+                using (var writer = new BinaryWriter(stream))
+                {
+                    writer.Write(sampleInterval);
+                    writer.Write(timing);
+
+                    writer.Flush();
+
+                    return stream.ToArray();
+                }
+            }
+        }
+
+        public bool ReadFrom(byte[] data)
+        {
+            using (var stream = new MemoryStream(data))
+            {
+                using (var reader = new BinaryReader(stream))
+                {
+                    sampleInterval = reader.ReadInt32();
+                    timing = reader.ReadBoolean();
+                }
+            }
+
+            return true;
+        }
+    }
 }
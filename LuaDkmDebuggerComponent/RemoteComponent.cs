@@ -26,6 +26,36 @@ namespace LuaDkmDebuggerComponent
         public ulong functionAddress = 0;
 
         public DkmRuntimeBreakpoint runtimeBreakpoint = null;
+
+        // Simple conditions are compiled for the helper library to skip hits without stopping the process
+        // Condition text is kept to compile the predicate again only when the condition is edited, edits are seen on the periodic recheck of filtered hits
+        public string predicateSource = null;
+        public byte[] predicateData = null;
+
+        // Set when the debugger evaluated the condition of the current hit
+        public bool conditionEvaluated = false;
+
+        // Tracepoints from the configuration file are recorded by the helper library without stopping
+        public int traceId = 0;
+    }
+
+    internal class LuaBreakpointTableBuffer
+    {
+        public ulong address = 0;
+        public int size = 0;
+
+        // Process pause count when the buffer was replaced by another one
+        public int retiredAtPause = 0;
+    }
+
+    public class LuaStopRecord
+    {
+        // Must match LUA_HELPER_STOP_NO_BREAKPOINT in the helper library
+        public const uint noBreakpoint = 0xffffffffu;
+
+        public uint breakpointId = noBreakpoint;
+        public ulong stateAddress = 0;
+        public ulong functionAddress = 0;
     }
 
     internal class LuaRemoteProcessData : DkmDataItem
@@ -41,6 +71,14 @@ namespace LuaDkmDebuggerComponent
         public int luaVersion = 0;
 
         public List<LuaBreakpoint> activeBreakpoints = new List<LuaBreakpoint>();
+        public uint breakpointGeneration = 0;
+
+        // Breakpoint table buffers in target process, each update is written to a buffer that no hook can be reading
+        public LuaBreakpointTableBuffer publishedBreakpointTable = null;
+        public int publishedBreakpointTableLength = 0;
+        public List<LuaBreakpointTableBuffer> retiredBreakpointTables = new List<LuaBreakpointTableBuffer>();
+        public List<LuaBreakpointTableBuffer> freeBreakpointTables = new List<LuaBreakpointTableBuffer>();
+        public int processPauseCount = 0;
 
         public bool pauseBreakpoints = false;
 
@@ -50,10 +88,23 @@ namespace LuaDkmDebuggerComponent
 
         public Dictionary<ulong, RegisterStateMessage> knownStates = new Dictionary<ulong, RegisterStateMessage>();
         public bool hooksEnabled = false;
-        public bool hadActiveStepper = false;
+        public bool hooksEnabledForAllStates = false;
+        public bool selectiveLineHooks = false;
+
+        // Count hook sampling interval in instructions, zero when profiling is disabled
+        public int profileInterval = 0;
+
+        // Helper library records call/return timing, hooks have to stay enabled
+        public bool timingEnabled = false;
+
+        public IntPtr asyncBreakEvent = IntPtr.Zero;
+
+        // States that were stepped keep their hooks, other states run without them unless breakpoints or profiling require hooks
+        public HashSet<ulong> steppedStates = new HashSet<ulong>();
+        public bool hadUntargetedStepper = false;
     }
 
-    public class RemoteComponent : IDkmCustomMessageForwardReceiver, IDkmRuntimeBreakpointReceived, IDkmRuntimeMonitorBreakpointHandler, IDkmRuntimeStepper, IDkmLanguageConditionEvaluator, IDkmExceptionFormatter
+    public class RemoteComponent : IDkmCustomMessageForwardReceiver, IDkmRuntimeBreakpointReceived, IDkmRuntimeMonitorBreakpointHandler, IDkmRuntimeStepper, IDkmLanguageConditionEvaluator, IDkmExceptionFormatter, IDkmProcessExecutionNotifications
     {
         DkmCustomMessage IDkmCustomMessageForwardReceiver.SendLower(DkmCustomMessage customMessage)
         {
@@ -149,87 +200,198 @@ namespace LuaDkmDebuggerComponent
                 // Registration is called only for states that can be hooked, unregistration is always called
                 if (processData.knownStates.ContainsKey(data.stateAddress))
                     processData.knownStates.Remove(data.stateAddress);
+
+                processData.steppedStates.Remove(data.stateAddress);
+            }
+            else if (customMessage.MessageCode == MessageToRemote.registerTracepoints)
+            {
+                var data = new TracepointsMessage();
+
+                data.ReadFrom(customMessage.Parameter1 as byte[]);
+
+                processData.activeBreakpoints.RemoveAll(el => el.traceId != 0);
+
+                for (int i = 0; i < data.sources.Count; i++)
+                {
+                    processData.activeBreakpoints.Add(new LuaBreakpoint
+                    {
+                        source = data.sources[i],
+                        line = data.lines[i],
+
+                        traceId = i + 1
+                    });
+                }
+
+                UpdateBreakpoints(process, processData);
+            }
+            else if (customMessage.MessageCode == MessageToRemote.setProfilerSettings)
+            {
+                var data = new ProfilerSettingsMessage();
+
+                data.ReadFrom(customMessage.Parameter1 as byte[]);
+
+                processData.profileInterval = data.sampleInterval;
+                processData.timingEnabled = data.timing;
+
+                if (processData.locations == null)
+                    return null;
+
+                // Hook mask and count have to be updated in all states
+                if (processData.hooksEnabled)
+                    SetupHooks(process, processData);
+                else
+                    UpdateHooks(process, processData);
             }
 
             return null;
         }
 
-        void SetupHooks(DkmProcess process, LuaRemoteProcessData processData)
+        void UpdateLineHookSettings(DkmProcess process, LuaRemoteProcessData processData)
         {
-            processData.hooksEnabled = true;
+            if (processData.selectiveLineHooks || processData.locations == null || processData.locations.helperLineHookSettingsAddress == 0)
+                return;
 
-            foreach (var stateKV in processData.knownStates)
+            // Layout is the same for all states
+            var state = processData.knownStates.Values.FirstOrDefault();
+
+            if (state == null)
+                return;
+
+            if (processData.luaVersion == 504 && state.setTrapCallInfoTrapOffset == 0)
+                return;
+
+            uint[] settings = new uint[]
             {
-                var state = stateKV.Value;
+                1, // enabled
+                (uint)(state.hookMaskAddress - state.stateAddress),
+                processData.luaVersion == 503 || processData.luaVersion == 504 ? 4u : 1u,
+                (uint)state.setTrapStateCallInfoOffset,
+                (uint)state.setTrapCallInfoPreviousOffset,
+                (uint)state.setTrapCallInfoCallStatusOffset,
+                (uint)state.setTrapCallInfoTrapOffset,
+            };
 
-                DebugHelpers.TryWritePointerVariable(process, state.hookFunctionAddress, state.helperHookFunctionAddress);
+            byte[] data = new byte[settings.Length * 4];
 
-                if (processData.luaVersion == 503 || processData.luaVersion == 504)
-                    DebugHelpers.TryWriteIntVariable(process, state.hookMaskAddress, 7); // LUA_HOOKLINE | LUA_HOOKCALL | LUA_HOOKRET
-                else
-                    DebugHelpers.TryWriteByteVariable(process, state.hookMaskAddress, 7); // LUA_HOOKLINE | LUA_HOOKCALL | LUA_HOOKRET
+            Buffer.BlockCopy(settings, 0, data, 0, data.Length);
 
-                DebugHelpers.TryWriteIntVariable(process, state.hookBaseCountAddress, 0);
-                DebugHelpers.TryWriteIntVariable(process, state.hookCountAddress, 0);
+            processData.selectiveLineHooks = DebugHelpers.TryWriteRawBytes(process, processData.locations.helperLineHookSettingsAddress, data);
+        }
 
-                // Lua 5.4 has to update 'trap' flag for all Lua call stack frames
-                if (processData.luaVersion == 504)
-                {
-                    ulong? callInfo = DebugHelpers.ReadPointerVariable(process, state.stateAddress + state.setTrapStateCallInfoOffset);
+        bool AllStatesNeedHooks(LuaRemoteProcessData processData)
+        {
+            return processData.activeBreakpoints.Count != 0 || processData.hadUntargetedStepper || processData.profileInterval != 0 || processData.timingEnabled;
+        }
 
-                    while (callInfo.HasValue && callInfo.Value != 0)
-                    {
-                        var callStatus = DebugHelpers.ReadShortVariable(process, callInfo.Value + state.setTrapCallInfoCallStatusOffset);
+        void SetupHooks(DkmProcess process, LuaRemoteProcessData processData)
+        {
+            processData.hooksEnabled = true;
+            processData.hooksEnabledForAllStates = AllStatesNeedHooks(processData);
 
-                        if (callStatus.HasValue && (callStatus.Value & (int)CallStatus_5_4.C) == 0)
-                        {
-                            if (!DebugHelpers.TryWriteIntVariable(process, callInfo.Value + state.setTrapCallInfoTrapOffset, 1))
-                                break;
-                        }
+            // Line hooks are enabled everywhere, helper will disable them in functions without breakpoints
+            UpdateLineHookSettings(process, processData);
 
-                        callInfo = DebugHelpers.ReadPointerVariable(process, callInfo.Value + state.setTrapCallInfoPreviousOffset);
-                    }
-                }
+            foreach (var stateKV in processData.knownStates)
+            {
+                if (processData.hooksEnabledForAllStates || processData.steppedStates.Contains(stateKV.Key))
+                    SetupStateHooks(process, processData, stateKV.Value);
+                else
+                    RemoveStateHooks(process, processData, stateKV.Value);
             }
 
             if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
             {
                 // Trigger a custom breakpoint
-                DebugHelpers.TryWriteUintVariable(process, processData.locations.helperAsyncBreakCodeAddress, 1u);
+                SignalAsyncBreak(process, processData, 1u);
             }
         }
 
-        void RemoveHooks(DkmProcess process, LuaRemoteProcessData processData)
+        void SetupStateHooks(DkmProcess process, LuaRemoteProcessData processData, RegisterStateMessage state)
         {
-            processData.hooksEnabled = false;
+            // LUA_HOOKLINE | LUA_HOOKCALL | LUA_HOOKRET and LUA_HOOKCOUNT for sampling profiler
+            int hookMask = processData.profileInterval != 0 ? 15 : 7;
 
-            foreach (var stateKV in processData.knownStates)
+            DebugHelpers.TryWritePointerVariable(process, state.hookFunctionAddress, state.helperHookFunctionAddress);
+
+            if (processData.luaVersion == 503 || processData.luaVersion == 504)
+                DebugHelpers.TryWriteIntVariable(process, state.hookMaskAddress, hookMask);
+            else
+                DebugHelpers.TryWriteByteVariable(process, state.hookMaskAddress, (byte)hookMask);
+
+            DebugHelpers.TryWriteIntVariable(process, state.hookBaseCountAddress, processData.profileInterval);
+            DebugHelpers.TryWriteIntVariable(process, state.hookCountAddress, processData.profileInterval);
+
+            // Lua 5.4 has to update 'trap' flag for all Lua call stack frames
+            if (processData.luaVersion == 504)
             {
-                var state = stateKV.Value;
+                ulong? callInfo = DebugHelpers.ReadPointerVariable(process, state.stateAddress + state.setTrapStateCallInfoOffset);
 
-                DebugHelpers.TryWritePointerVariable(process, state.hookFunctionAddress, 0);
+                while (callInfo.HasValue && callInfo.Value != 0)
+                {
+                    var callStatus = DebugHelpers.ReadShortVariable(process, callInfo.Value + state.setTrapCallInfoCallStatusOffset);
 
-                if (processData.luaVersion == 503 || processData.luaVersion == 504)
-                    DebugHelpers.TryWriteIntVariable(process, state.hookMaskAddress, 0);
-                else
-                    DebugHelpers.TryWriteByteVariable(process, state.hookMaskAddress, 0);
+                    if (callStatus.HasValue && (callStatus.Value & (int)CallStatus_5_4.C) == 0)
+                    {
+                        if (!DebugHelpers.TryWriteIntVariable(process, callInfo.Value + state.setTrapCallInfoTrapOffset, 1))
+                            break;
+                    }
 
-                DebugHelpers.TryWriteIntVariable(process, state.hookBaseCountAddress, 0);
-                DebugHelpers.TryWriteIntVariable(process, state.hookCountAddress, 0);
+                    callInfo = DebugHelpers.ReadPointerVariable(process, callInfo.Value + state.setTrapCallInfoPreviousOffset);
+                }
             }
+        }
+
+        void RemoveStateHooks(DkmProcess process, LuaRemoteProcessData processData, RegisterStateMessage state)
+        {
+            DebugHelpers.TryWritePointerVariable(process, state.hookFunctionAddress, 0);
+
+            if (processData.luaVersion == 503 || processData.luaVersion == 504)
+                DebugHelpers.TryWriteIntVariable(process, state.hookMaskAddress, 0);
+            else
+                DebugHelpers.TryWriteByteVariable(process, state.hookMaskAddress, 0);
+
+            DebugHelpers.TryWriteIntVariable(process, state.hookBaseCountAddress, 0);
+            DebugHelpers.TryWriteIntVariable(process, state.hookCountAddress, 0);
+        }
+
+        void RemoveHooks(DkmProcess process, LuaRemoteProcessData processData)
+        {
+            processData.hooksEnabled = false;
+
+            foreach (var stateKV in processData.knownStates)
+                RemoveStateHooks(process, processData, stateKV.Value);
 
             if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
             {
                 // Trigger a custom breakpoint
-                DebugHelpers.TryWriteUintVariable(process, processData.locations.helperAsyncBreakCodeAddress, 3u);
+                SignalAsyncBreak(process, processData, 3u);
+            }
+        }
+
+        void SignalAsyncBreak(DkmProcess process, LuaRemoteProcessData processData, uint code)
+        {
+            DebugHelpers.TryWriteUintVariable(process, processData.locations.helperAsyncBreakCodeAddress, code);
+
+            // Helper thread waits for the event, if it's not available, it will see the code on the next poll
+            if (processData.asyncBreakEvent == IntPtr.Zero && processData.locations.helperAsyncBreakEventAddress != 0 && process.LivePart != null)
+            {
+                ulong? handle = DebugHelpers.ReadPointerVariable(process, processData.locations.helperAsyncBreakEventAddress);
+
+                if (handle.HasValue && handle.Value != 0)
+                    processData.asyncBreakEvent = Kernel32.DuplicateProcessHandle(process.LivePart.Id, handle.Value);
             }
+
+            if (processData.asyncBreakEvent != IntPtr.Zero)
+                Kernel32.SetEvent(processData.asyncBreakEvent);
         }
 
         void UpdateHooks(DkmProcess process, LuaRemoteProcessData processData)
         {
-            if (processData.activeBreakpoints.Count != 0 || processData.hadActiveStepper)
+            bool allStates = AllStatesNeedHooks(processData);
+
+            if (allStates || processData.steppedStates.Count != 0)
             {
-                if (!processData.hooksEnabled)
+                if (!processData.hooksEnabled || processData.hooksEnabledForAllStates != allStates)
                     SetupHooks(process, processData);
             }
             else
@@ -245,48 +407,286 @@ namespace LuaDkmDebuggerComponent
             if (processData.locations == null)
                 return;
 
+            bool hadHooksEnabled = processData.hooksEnabled;
+
             UpdateHooks(process, processData);
 
-            int count = processData.activeBreakpoints.Count;
+            if (!WriteBreakpointTable(process, processData))
+                return;
+
+            // Helper might have disabled line hooks in functions that have breakpoints now
+            if (hadHooksEnabled && processData.hooksEnabled && processData.selectiveLineHooks)
+                SetupHooks(process, processData);
+        }
+
+        bool WriteBreakpointTable(DkmProcess process, LuaRemoteProcessData processData)
+        {
+            if (processData.locations.helperBreakTableAddress == 0)
+                return false;
+
+            int pointerSize = DebugHelpers.GetPointerSize(process);
+            ulong valueSize = LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit ? 0 : LuaHelpers.GetValueSize(process);
 
-            if (count > 256)
-                count = 256;
+            // Fill a buffer that is not visible to the helper library and switch helper library to it with a single pointer write
+            uint generation = processData.breakpointGeneration + 1;
 
-            ulong pointerSize = (ulong)DebugHelpers.GetPointerSize(process);
+            var buffer = TakeBreakpointTableBuffer(process, processData, processData.publishedBreakpointTableLength);
+
+            if (buffer == null)
+                return false;
 
-            ulong sourceNameAddress = processData.locations.helperBreakSourcesAddress;
+            byte[] table = BuildBreakpointTable(processData, buffer.address, pointerSize, valueSize, generation);
 
-            for (int i = 0; i < count; i++)
+            if (table.Length > buffer.size)
             {
-                ulong dataAddress = processData.locations.helperBreakDataAddress + (ulong)i * 3 * pointerSize;
+                processData.freeBreakpointTables.Add(buffer);
 
-                var breakpoint = processData.activeBreakpoints[i];
+                buffer = TakeBreakpointTableBuffer(process, processData, table.Length);
 
-                DebugHelpers.TryWritePointerVariable(process, dataAddress, (ulong)breakpoint.line);
+                if (buffer == null)
+                    return false;
 
-                if (breakpoint.functionAddress == 0)
+                table = BuildBreakpointTable(processData, buffer.address, pointerSize, valueSize, generation);
+            }
+
+            if (!DebugHelpers.TryWriteRawBytes(process, buffer.address, table) || !DebugHelpers.TryWritePointerVariable(process, processData.locations.helperBreakTableAddress, buffer.address))
+            {
+                processData.freeBreakpointTables.Add(buffer);
+
+                return false;
+            }
+
+            // Helper hook might still be reading the previous buffer, even after the next stop if its thread was suspended inside the hook
+            if (processData.publishedBreakpointTable != null)
+            {
+                processData.publishedBreakpointTable.retiredAtPause = processData.processPauseCount;
+                processData.retiredBreakpointTables.Add(processData.publishedBreakpointTable);
+            }
+
+            processData.publishedBreakpointTable = buffer;
+            processData.publishedBreakpointTableLength = table.Length;
+            processData.breakpointGeneration = generation;
+
+            return true;
+        }
+
+        LuaBreakpointTableBuffer TakeBreakpointTableBuffer(DkmProcess process, LuaRemoteProcessData processData, int length)
+        {
+            int index = processData.freeBreakpointTables.FindIndex(el => el.size >= length);
+
+            if (index != -1)
+            {
+                var buffer = processData.freeBreakpointTables[index];
+
+                processData.freeBreakpointTables.RemoveAt(index);
+
+                return buffer;
+            }
+
+            int size = Math.Max(4096, (length + 4095) & ~4095);
+
+            ulong address = process.AllocateVirtualMemory(0, size, 0x3000, 0x04);
+
+            if (address == 0)
+                return null;
+
+            return new LuaBreakpointTableBuffer { address = address, size = size };
+        }
+
+        void IDkmProcessExecutionNotifications.OnProcessPause(DkmProcess process, DkmProcessExecutionCounters processCounters)
+        {
+            var processData = process.GetDataItem<LuaRemoteProcessData>();
+
+            if (processData == null)
+                return;
+
+            processData.processPauseCount++;
+
+            // Thread that was inside the hook at the previous stop has left it since the process was resumed
+            foreach (var buffer in processData.retiredBreakpointTables.Where(el => el.retiredAtPause + 2 <= processData.processPauseCount).ToList())
+            {
+                processData.retiredBreakpointTables.Remove(buffer);
+                processData.freeBreakpointTables.Add(buffer);
+            }
+        }
+
+        void IDkmProcessExecutionNotifications.OnProcessResume(DkmProcess process, DkmProcessExecutionCounters processCounters)
+        {
+        }
+
+        // Must match LuaHelperBreakTable and LuaHelperBreakData layout in the helper library
+        const int breakTableHeaderSize = 32;
+        const int breakLineBits = 8192;
+        const int breakEntryPointers = 6;
+        const int breakLineSize = 12;
+        const int traceValueCount = 8;
+
+        static int GetBreakProtoSlot(ulong proto, int slotCount)
+        {
+            return (int)((uint)((proto >> 3) ^ (proto >> 12)) & (uint)(slotCount - 1));
+        }
+
+        static void WriteTablePointer(byte[] table, int offset, ulong value, int pointerSize)
+        {
+            if (pointerSize == 8)
+                Array.Copy(BitConverter.GetBytes(value), 0, table, offset, 8);
+            else
+                Array.Copy(BitConverter.GetBytes((uint)value), 0, table, offset, 4);
+        }
+
+        static ulong ReadTablePointer(byte[] table, int offset, int pointerSize)
+        {
+            return pointerSize == 8 ? BitConverter.ToUInt64(table, offset) : BitConverter.ToUInt32(table, offset);
+        }
+
+        byte[] BuildBreakpointTable(LuaRemoteProcessData processData, ulong tableAddress, int pointerSize, ulong valueSize, uint generation)
+        {
+            var breakpoints = processData.activeBreakpoints;
+
+            int functionCount = breakpoints.Count(el => el.functionAddress != 0);
+
+            int protoSlotCount = 16;
+
+            while (protoSlotCount < functionCount * 2)
+                protoSlotCount *= 2;
+
+            // Entries are grouped by line, id of an entry is its position in the active breakpoint list
+            var entryOrder = Enumerable.Range(0, breakpoints.Count).OrderBy(el => breakpoints[el].line).ToList();
+
+            int lineCount = breakpoints.Select(el => el.line).Distinct().Count();
+
+            int lineSlotCount = 16;
+
+            while (lineSlotCount < lineCount * 2)
+                lineSlotCount *= 2;
+
+            // Helper library compares source name pointers after the first match, so each unique source is placed once
+            var sourceNameOffsets = new Dictionary<string, int>();
+            var sourceNames = new List<byte>();
+
+            int sourceCount = 0;
+
+            foreach (var breakpoint in breakpoints)
+            {
+                if (breakpoint.functionAddress != 0)
+                    continue;
+
+                Debug.Assert(breakpoint.source != null);
+
+                sourceCount++;
+
+                if (sourceNameOffsets.ContainsKey(breakpoint.source))
+                    continue;
+
+                sourceNameOffsets.Add(breakpoint.source, sourceNames.Count);
+
+                sourceNames.AddRange(Encoding.UTF8.GetBytes(breakpoint.source));
+                sourceNames.Add(0);
+            }
+
+            int protosOffset = breakTableHeaderSize + pointerSize * 3 + breakLineBits / 8;
+            int dataOffset = protosOffset + protoSlotCount * pointerSize;
+            int linesOffset = dataOffset + breakpoints.Count * breakEntryPointers * pointerSize;
+            int sourcesOffset = linesOffset + lineSlotCount * breakLineSize;
+
+            // Predicates contain 8 byte values and are placed after source names
+            int predicatesOffset = (sourcesOffset + sourceNames.Count + 7) & ~7;
+            int predicatesSize = 0;
+
+            foreach (var breakpoint in breakpoints)
+            {
+                if (breakpoint.predicateData != null)
+                    predicatesSize += (breakpoint.predicateData.Length + 7) & ~7;
+            }
+
+            byte[] table = new byte[predicatesOffset + predicatesSize];
+
+            Array.Copy(BitConverter.GetBytes(generation), 0, table, 0, 4);
+            Array.Copy(BitConverter.GetBytes(breakpoints.Count), 0, table, 4, 4);
+            Array.Copy(BitConverter.GetBytes(sourceCount), 0, table, 8, 4);
+            Array.Copy(BitConverter.GetBytes(protoSlotCount), 0, table, 12, 4);
+            Array.Copy(BitConverter.GetBytes(lineSlotCount), 0, table, 16, 4);
+            Array.Copy(BitConverter.GetBytes((uint)valueSize), 0, table, 20, 4);
+            Array.Copy(BitConverter.GetBytes(traceValueCount), 0, table, 24, 4);
+
+            WriteTablePointer(table, breakTableHeaderSize, tableAddress + (ulong)dataOffset, pointerSize);
+            WriteTablePointer(table, breakTableHeaderSize + pointerSize, tableAddress + (ulong)protosOffset, pointerSize);
+            WriteTablePointer(table, breakTableHeaderSize + pointerSize * 2, tableAddress + (ulong)linesOffset, pointerSize);
+
+            int lineMaskOffset = breakTableHeaderSize + pointerSize * 3;
+
+            for (int i = 0; i < entryOrder.Count; i++)
+            {
+                var breakpoint = breakpoints[entryOrder[i]];
+
+                int bit = breakpoint.line & (breakLineBits - 1);
+
+                table[lineMaskOffset + bit / 8] |= (byte)(1 << (bit % 8));
+
+                // First entry of a line adds the line slot, following entries extend it
+                int lineSlot = breakpoint.line & (lineSlotCount - 1);
+
+                while (true)
                 {
-                    Debug.Assert(breakpoint.source != null);
+                    int current = BitConverter.ToInt32(table, linesOffset + lineSlot * breakLineSize);
 
-                    byte[] sourceNameBytes = Encoding.UTF8.GetBytes(breakpoint.source);
+                    if (current == 0 || current == breakpoint.line)
+                        break;
 
-                    DebugHelpers.TryWriteRawBytes(process, sourceNameAddress, sourceNameBytes);
-                    DebugHelpers.TryWriteByteVariable(process, sourceNameAddress + (ulong)sourceNameBytes.Length, 0);
+                    lineSlot = (lineSlot + 1) & (lineSlotCount - 1);
+                }
 
-                    ulong currSourceNameAddress = sourceNameAddress;
-                    sourceNameAddress += (ulong)sourceNameBytes.Length + 1;
+                int lineOffset = linesOffset + lineSlot * breakLineSize;
 
-                    DebugHelpers.TryWritePointerVariable(process, dataAddress + pointerSize, 0);
-                    DebugHelpers.TryWritePointerVariable(process, dataAddress + pointerSize * 2, currSourceNameAddress);
+                if (BitConverter.ToInt32(table, lineOffset) == 0)
+                {
+                    Array.Copy(BitConverter.GetBytes(breakpoint.line), 0, table, lineOffset, 4);
+                    Array.Copy(BitConverter.GetBytes(i), 0, table, lineOffset + 4, 4);
                 }
-                else
+
+                Array.Copy(BitConverter.GetBytes(BitConverter.ToInt32(table, lineOffset + 8) + 1), 0, table, lineOffset + 8, 4);
+
+                int entryOffset = dataOffset + i * breakEntryPointers * pointerSize;
+
+                WriteTablePointer(table, entryOffset, (ulong)breakpoint.line, pointerSize);
+                WriteTablePointer(table, entryOffset + pointerSize * 4, (ulong)breakpoint.traceId, pointerSize);
+                WriteTablePointer(table, entryOffset + pointerSize * 5, (ulong)entryOrder[i], pointerSize);
+
+                if (breakpoint.predicateData != null)
+                {
+                    breakpoint.predicateData.CopyTo(table, predicatesOffset);
+
+                    WriteTablePointer(table, entryOffset + pointerSize * 3, tableAddress + (ulong)predicatesOffset, pointerSize);
+
+                    predicatesOffset += (breakpoint.predicateData.Length + 7) & ~7;
+                }
+
+                if (breakpoint.functionAddress == 0)
+                {
+                    WriteTablePointer(table, entryOffset + pointerSize * 2, tableAddress + (ulong)(sourcesOffset + sourceNameOffsets[breakpoint.source]), pointerSize);
+                    continue;
+                }
+
+                WriteTablePointer(table, entryOffset + pointerSize, breakpoint.functionAddress, pointerSize);
+
+                int slot = GetBreakProtoSlot(breakpoint.functionAddress, protoSlotCount);
+
+                while (true)
                 {
-                    DebugHelpers.TryWritePointerVariable(process, dataAddress + pointerSize, breakpoint.functionAddress);
-                    DebugHelpers.TryWritePointerVariable(process, dataAddress + pointerSize * 2, 0);
+                    ulong current = ReadTablePointer(table, protosOffset + slot * pointerSize, pointerSize);
+
+                    if (current == 0 || current == breakpoint.functionAddress)
+                        break;
+
+                    slot = (slot + 1) & (protoSlotCount - 1);
                 }
+
+                WriteTablePointer(table, protosOffset + slot * pointerSize, breakpoint.functionAddress, pointerSize);
             }
 
-            DebugHelpers.TryWriteIntVariable(process, processData.locations.helperBreakCountAddress, count);
+            sourceNames.CopyTo(table, sourcesOffset);
+
+            return table;
         }
 
         void IDkmRuntimeBreakpointReceived.OnRuntimeBreakpointReceived(DkmRuntimeBreakpoint runtimeBreakpoint, DkmThread thread, bool hasException, DkmEventDescriptorS eventDescriptor)
@@ -307,7 +707,13 @@ namespace LuaDkmDebuggerComponent
                     {
                         eventDescriptor.Suppress();
 
-                        var breakpointPos = DebugHelpers.ReadUintVariable(process, processData.locations.helperBreakHitIdAddress);
+                        var stopRecord = ReadStopRecord(process, processData, thread);
+
+                        uint? breakpointPos = stopRecord?.breakpointId;
+
+                        // Hits from threads that didn't get their own record use the shared fallback
+                        if (stopRecord == null)
+                            breakpointPos = DebugHelpers.ReadUintVariable(process, processData.locations.helperBreakHitIdAddress);
 
                         if (!breakpointPos.HasValue)
                             return;
@@ -318,13 +724,29 @@ namespace LuaDkmDebuggerComponent
                             {
                                 var breakpoint = processData.activeBreakpoints[(int)breakpointPos.Value];
 
+                                breakpoint.conditionEvaluated = false;
+
                                 if (breakpoint.runtimeBreakpoint != null)
                                     breakpoint.runtimeBreakpoint.OnHit(thread, false);
+
+                                // Condition was removed, helper library must not filter the hits anymore
+                                if (!breakpoint.conditionEvaluated && breakpoint.predicateSource != null)
+                                {
+                                    bool hadPredicate = breakpoint.predicateData != null;
+
+                                    breakpoint.predicateSource = null;
+                                    breakpoint.predicateData = null;
+
+                                    if (hadPredicate)
+                                        WriteBreakpointTable(process, processData);
+                                }
                             }
                             catch (System.ObjectDisposedException)
                             {
                                 // Breakpoint was implicitly closed
                                 processData.activeBreakpoints.RemoveAt((int)breakpointPos.Value);
+
+                                UpdateBreakpoints(process, processData);
                             }
                             catch (DkmException)
                             {
@@ -487,13 +909,74 @@ namespace LuaDkmDebuggerComponent
                 DebugHelpers.TryWriteIntVariable(process, processData.locations.helperStepOverAddress, 0);
                 DebugHelpers.TryWriteIntVariable(process, processData.locations.helperStepIntoAddress, 0);
                 DebugHelpers.TryWriteIntVariable(process, processData.locations.helperStepOutAddress, 0);
-                DebugHelpers.TryWriteIntVariable(process, processData.locations.helperSkipDepthAddress, 0);
-                DebugHelpers.TryWriteIntVariable(process, processData.locations.helperStackDepthAtCallAddress, 0);
+                DebugHelpers.TryWriteUlongVariable(process, processData.locations.helperStepLuaStateAddress, 0);
+
+                ClearStepStates(process, processData);
             }
 
             processData.activeStepper = null;
         }
 
+        void ClearStepStates(DkmProcess process, LuaRemoteProcessData processData)
+        {
+            // Must match LuaHelperStepState table in the helper library
+            const int stepStateCount = 64;
+            const int stepStateSize = 16;
+
+            if (processData.locations.helperStepStatesAddress != 0)
+                DebugHelpers.TryWriteRawBytes(process, processData.locations.helperStepStatesAddress, new byte[stepStateCount * stepStateSize]);
+        }
+
+        // Each thread that stops inside the helper library reports the stop in its own record
+        LuaStopRecord ReadStopRecord(DkmProcess process, LuaRemoteProcessData processData, DkmThread thread)
+        {
+            // Must match LuaHelperStopRecord table in the helper library
+            const int stopRecordCount = 64;
+            const int stopRecordSize = 24;
+
+            if (processData.locations == null || processData.locations.helperStopRecordsAddress == 0 || thread == null)
+                return null;
+
+            ulong address = processData.locations.helperStopRecordsAddress;
+
+            var batch = BatchRead.Create(process, address, stopRecordCount * stopRecordSize);
+
+            if (batch == null)
+                return null;
+
+            uint threadId = (uint)thread.SystemPart.Id;
+
+            for (int i = 0; i < stopRecordCount; i++)
+            {
+                ulong recordAddress = address + (ulong)(i * stopRecordSize);
+
+                if (DebugHelpers.ReadUintVariable(process, recordAddress, batch) != threadId)
+                    continue;
+
+                return new LuaStopRecord
+                {
+                    breakpointId = DebugHelpers.ReadUintVariable(process, recordAddress + 4, batch).GetValueOrDefault(LuaStopRecord.noBreakpoint),
+                    stateAddress = DebugHelpers.ReadUlongVariable(process, recordAddress + 8, batch).GetValueOrDefault(0),
+                    functionAddress = DebugHelpers.ReadUlongVariable(process, recordAddress + 16, batch).GetValueOrDefault(0)
+                };
+            }
+
+            return null;
+        }
+
+        // State is only known if the thread has stopped inside the helper library, other stops can't tell which state is running
+        ulong GetSteppedLuaState(DkmProcess process, LuaRemoteProcessData processData, DkmStepper stepper)
+        {
+            var instructionAddress = stepper.StartingAddress.CPUInstructionPart.InstructionPointer;
+
+            if (instructionAddress < processData.locations.helperStartAddress || instructionAddress >= processData.locations.helperEndAddress)
+                return 0;
+
+            var stopRecord = ReadStopRecord(process, processData, stepper.Thread);
+
+            return stopRecord != null ? stopRecord.stateAddress : 0;
+        }
+
         void IDkmRuntimeStepper.BeforeEnableNewStepper(DkmRuntimeInstance runtimeInstance, DkmStepper stepper)
         {
             // Don't have anything to do here right now
@@ -537,6 +1020,13 @@ namespace LuaDkmDebuggerComponent
                 processData.activeStepper = null;
             }
 
+            ulong steppedState = GetSteppedLuaState(process, processData, stepper);
+
+            // Other states will ignore the step action, each state keeps its own skip depth
+            DebugHelpers.TryWriteUlongVariable(process, processData.locations.helperStepLuaStateAddress, steppedState);
+
+            ClearStepStates(process, processData);
+
             if (stepper.StepKind == DkmStepKind.Over)
             {
                 DebugHelpers.TryWriteIntVariable(process, processData.locations.helperStepOverAddress, 1);
@@ -553,9 +1043,25 @@ namespace LuaDkmDebuggerComponent
 
             processData.activeStepper = stepper;
 
-            processData.hadActiveStepper = true;
+            if (steppedState != 0)
+                processData.steppedStates.Add(steppedState);
+            else
+                processData.hadUntargetedStepper = true;
 
-            UpdateHooks(process, processData);
+            if (processData.hooksEnabled && processData.knownStates.TryGetValue(steppedState, out RegisterStateMessage state))
+            {
+                // Only the stepped state needs line hooks in its current function
+                SetupStateHooks(process, processData, state);
+            }
+            else if (processData.hooksEnabled && processData.selectiveLineHooks)
+            {
+                // Current function might have line hooks disabled
+                SetupHooks(process, processData);
+            }
+            else
+            {
+                UpdateHooks(process, processData);
+            }
         }
 
         void IDkmRuntimeStepper.StopStep(DkmRuntimeInstance runtimeInstance, DkmStepper stepper)
@@ -627,7 +1133,9 @@ namespace LuaDkmDebuggerComponent
 
             DkmInspectionSession inspectionSession = DkmInspectionSession.Create(process, null);
 
-            ulong stateAddress = DebugHelpers.ReadPointerVariable(process, processData.locations.helperBreakHitLuaStateAddress).GetValueOrDefault(0);
+            var stopRecord = ReadStopRecord(process, processData, stackFrame.Thread);
+
+            ulong stateAddress = stopRecord != null ? stopRecord.stateAddress : DebugHelpers.ReadPointerVariable(process, processData.locations.helperBreakHitLuaStateAddress).GetValueOrDefault(0);
 
             if (stateAddress == 0)
             {
@@ -758,6 +1266,8 @@ namespace LuaDkmDebuggerComponent
 
             functionData.UpdateLocals(process, prevInstructionPointer);
 
+            UpdateBreakpointPredicate(process, processData, stopRecord, evaluationCondition.Source.Text, callInfoData, closureData, functionData);
+
             ExpressionEvaluation evaluation = new ExpressionEvaluation(process, null, null, functionData, callInfoData.stackBaseAddress, closureData);
 
             var result = evaluation.Evaluate(evaluationCondition.Source.Text, false);
@@ -808,6 +1318,114 @@ namespace LuaDkmDebuggerComponent
             errorText = null;
         }
 
+        BreakpointPredicateLayout GetBreakpointPredicateLayout(DkmProcess process, LuaFunctionCallInfoData callInfoData, LuaFunctionData functionData)
+        {
+            if (LuaHelpers.luaVersion == LuaHelpers.luaVersionLuajit)
+                return null;
+
+            // Values with NAN trick are not supported
+            if (Schema.LuaValueData.available ? Schema.LuaValueData.doubleAddress.HasValue : LuaHelpers.luaVersion == 502 && !DebugHelpers.Is64Bit(process))
+                return null;
+
+            ulong valueSize = LuaHelpers.GetValueSize(process);
+
+            // Registers are addressed from the function slot, which only works when arguments were not moved by a vararg call
+            if (callInfoData.stackBaseAddress != callInfoData.funcAddress + valueSize)
+                return null;
+
+            if (LuaHelpers.luaVersion != 504 && functionData.isVarargs != 0)
+                return null;
+
+            LuaHelpers.GetValueAddressParts(process, 0, out ulong tagOffset, out ulong valueOffset);
+
+            var layout = new BreakpointPredicateLayout
+            {
+                valueSize = (uint)valueSize,
+                valueOffset = (uint)valueOffset,
+                tagOffset = (uint)tagOffset,
+                tagMask = 0x3f,
+                nilTag = (int)LuaExtendedType.Nil,
+                falseTag = (int)LuaExtendedType.Boolean,
+                trueTag = LuaHelpers.luaVersion == 504 ? (int)LuaExtendedType.BooleanTrue : (int)LuaExtendedType.Boolean,
+                floatTag = (int)LuaHelpers.GetFloatNumberExtendedType(),
+                booleanInPayload = LuaHelpers.luaVersion != 504,
+                upvalueValueOffset = (uint)LuaUpvalueData.GetValueAddressOffset(process)
+            };
+
+            if (LuaHelpers.HasIntegerNumberExtendedType())
+                layout.integerTag = (int)LuaHelpers.GetIntegerNumberExtendedType();
+
+            return layout;
+        }
+
+        void UpdateBreakpointPredicate(DkmProcess process, LuaRemoteProcessData processData, LuaStopRecord stopRecord, string condition, LuaFunctionCallInfoData callInfoData, LuaClosureData closureData, LuaFunctionData functionData)
+        {
+            // Hits from threads without their own record can't be matched with a breakpoint reliably
+            if (stopRecord == null || stopRecord.breakpointId >= processData.activeBreakpoints.Count)
+                return;
+
+            var breakpoint = processData.activeBreakpoints[(int)stopRecord.breakpointId];
+
+            breakpoint.conditionEvaluated = true;
+
+            if (breakpoint.functionAddress != 0 && breakpoint.functionAddress != closureData.functionAddress)
+                return;
+
+            if (breakpoint.predicateSource == condition)
+                return;
+
+            byte[] previousData = breakpoint.predicateData;
+
+            breakpoint.predicateSource = condition;
+            breakpoint.predicateData = null;
+
+            var layout = GetBreakpointPredicateLayout(process, callInfoData, functionData);
+
+            ulong closureAddress = 0;
+
+            if (layout != null)
+                closureAddress = DebugHelpers.ReadPointerVariable(process, callInfoData.funcAddress + layout.valueOffset).GetValueOrDefault(0);
+
+            if (closureAddress != 0)
+            {
+                layout.upvalueArrayOffset = (uint)(closureData.firstUpvaluePointerAddress - closureAddress);
+
+                // Same lookup order as in ExpressionEvaluation.LookupVariable, globals are left to the debugger
+                var predicate = BreakpointPredicate.Compile(condition, (string name, out BreakpointPredicateOperand kind, out int index) =>
+                {
+                    for (int i = functionData.activeLocals.Count - 1; i >= 0; i--)
+                    {
+                        if (functionData.activeLocals[i].name == name)
+                        {
+                            kind = BreakpointPredicateOperand.Register;
+                            index = i;
+                            return true;
+                        }
+                    }
+
+                    for (int i = 0; i < functionData.upvalues.Count; i++)
+                    {
+                        if (functionData.upvalues[i].name == name)
+                        {
+                            kind = BreakpointPredicateOperand.Upvalue;
+                            index = i;
+                            return true;
+                        }
+                    }
+
+                    kind = BreakpointPredicateOperand.None;
+                    index = 0;
+                    return false;
+                });
+
+                if (predicate != null)
+                    breakpoint.predicateData = predicate.Encode(closureData.functionAddress, layout, DebugHelpers.GetPointerSize(process));
+            }
+
+            if (previousData != null || breakpoint.predicateData != null)
+                WriteBreakpointTable(process, processData);
+        }
+
         string IDkmExceptionFormatter.GetDescription(DkmExceptionInformation exception)
         {
             return exception.Name;
@@ -479,5 +479,145 @@ namespace Tests
                 Assert.AreEqual("false", result.AsSimpleDisplayString(10));
             }
         }
+
+        static bool ResolvePredicateOperand(string name, out LuaDkmDebuggerComponent.BreakpointPredicateOperand kind, out int index)
+        {
+            kind = LuaDkmDebuggerComponent.BreakpointPredicateOperand.None;
+            index = 0;
+
+            if (name == "a" || name == "b")
+            {
+                kind = LuaDkmDebuggerComponent.BreakpointPredicateOperand.Register;
+                index = name == "a" ? 0 : 1;
+                return true;
+            }
+
+            if (name == "u")
+            {
+                kind = LuaDkmDebuggerComponent.BreakpointPredicateOperand.Upvalue;
+                index = 2;
+                return true;
+            }
+
+            return false;
+        }
+
+        [TestMethod]
+        public void TestBreakpointPredicates()
+        {
+            {
+                var result = LuaDkmDebuggerComponent.BreakpointPredicate.Compile("a == 10", ResolvePredicateOperand);
+
+                Assert.IsNotNull(result);
+
+                Assert.AreEqual(1, result.ops.Count);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCompare.Equal, result.ops[0].compare);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateConstant.Integer, result.ops[0].constantKind);
+                Assert.AreEqual(10, result.ops[0].constantInteger);
+            }
+
+            {
+                var result = LuaDkmDebuggerComponent.BreakpointPredicate.Compile("2.5 < u", ResolvePredicateOperand);
+
+                Assert.IsNotNull(result);
+
+                Assert.AreEqual(1, result.ops.Count);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCompare.Greater, result.ops[0].compare);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateOperand.Upvalue, result.ops[0].operandKind);
+                Assert.AreEqual(2, result.ops[0].operandIndex);
+                Assert.AreEqual(2.5, result.ops[0].constantNumber);
+            }
+
+            {
+                var result = LuaDkmDebuggerComponent.BreakpointPredicate.Compile("(a >= -3 and b ~= nil) or not u", ResolvePredicateOperand);
+
+                Assert.IsNotNull(result);
+
+                Assert.AreEqual(6, result.ops.Count);
+                Assert.AreEqual(-3, result.ops[0].constantInteger);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.And, result.ops[2].code);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCompare.Truthy, result.ops[3].compare);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.Not, result.ops[4].code);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.Or, result.ops[5].code);
+            }
+
+            {
+                // 'not' binds to the operand, this is '(not a) == false'
+                var result = LuaDkmDebuggerComponent.BreakpointPredicate.Compile("not a == false", ResolvePredicateOperand);
+
+                Assert.IsNotNull(result);
+
+                Assert.AreEqual(3, result.ops.Count);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCompare.Truthy, result.ops[0].compare);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.Not, result.ops[1].code);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.Not, result.ops[2].code);
+            }
+
+            {
+                var result = LuaDkmDebuggerComponent.BreakpointPredicate.Compile("not (a ~= nil) and b > 1", ResolvePredicateOperand);
+
+                Assert.IsNotNull(result);
+
+                Assert.AreEqual(4, result.ops.Count);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCompare.NotEqual, result.ops[0].compare);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.Not, result.ops[1].code);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCompare.Greater, result.ops[2].compare);
+                Assert.AreEqual(LuaDkmDebuggerComponent.BreakpointPredicateCode.And, result.ops[3].code);
+            }
+
+            // Left to the debugger
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("not a ~= nil", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("not a == 1", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("global == 1", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("a.field == 1", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("a == \"text\"", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("a + 1 == 2", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("a < true", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("a == b", ResolvePredicateOperand));
+            Assert.IsNull(LuaDkmDebuggerComponent.BreakpointPredicate.Compile("f(a)", ResolvePredicateOperand));
+        }
+
+        [TestMethod]
+        public void TestTimingProfile()
+        {
+            {
+                var profile = new LuaDkmDebuggerComponent.LuaTimingProfile { resolveName = (function) => function == 1 ? "a" : function == 2 ? "b" : "c" };
+
+                profile.AddRecord(10, 100, LuaDkmDebuggerComponent.LuaTimingEvent.Call, 1);
+                profile.AddRecord(10, 110, LuaDkmDebuggerComponent.LuaTimingEvent.Call, 2);
+                profile.AddRecord(10, 130, LuaDkmDebuggerComponent.LuaTimingEvent.Return, 2);
+                profile.AddRecord(10, 140, LuaDkmDebuggerComponent.LuaTimingEvent.Call, 2);
+                profile.AddRecord(10, 150, LuaDkmDebuggerComponent.LuaTimingEvent.Tail, 3);
+                profile.AddRecord(10, 190, LuaDkmDebuggerComponent.LuaTimingEvent.Return, 3);
+                profile.AddRecord(10, 200, LuaDkmDebuggerComponent.LuaTimingEvent.Return, 1);
+
+                // Return without a call that was recorded
+                profile.AddRecord(10, 210, LuaDkmDebuggerComponent.LuaTimingEvent.Return, 1);
+
+                Assert.AreEqual(30, profile.collapsedStacks["a"]);
+                Assert.AreEqual(30, profile.collapsedStacks["a;b"]);
+                Assert.AreEqual(40, profile.collapsedStacks["a;c"]);
+
+                Assert.AreEqual(1, profile.functions[1].calls);
+                Assert.AreEqual(100, profile.functions[1].inclusiveTicks);
+                Assert.AreEqual(2, profile.functions[2].calls);
+                Assert.AreEqual(30, profile.functions[2].exclusiveTicks);
+
+                Assert.AreEqual("a 30\na;b 30\na;c 40\n", profile.ExportCollapsedStacks(1000000));
+            }
+
+            {
+                // Lua 5.1 tail return ends the frame that was replaced
+                var profile = new LuaDkmDebuggerComponent.LuaTimingProfile { tailEventIsCall = false, resolveName = (function) => function == 1 ? "a" : "b" };
+
+                profile.AddRecord(1, 0, LuaDkmDebuggerComponent.LuaTimingEvent.Call, 1);
+                profile.AddRecord(1, 10, LuaDkmDebuggerComponent.LuaTimingEvent.Call, 2);
+                profile.AddRecord(1, 30, LuaDkmDebuggerComponent.LuaTimingEvent.Return, 2);
+                profile.AddRecord(1, 30, LuaDkmDebuggerComponent.LuaTimingEvent.Tail, 0);
+
+                Assert.AreEqual(10, profile.collapsedStacks["a"]);
+                Assert.AreEqual(20, profile.collapsedStacks["a;b"]);
+            }
+        }
     }
 }